@@ -233,6 +233,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         FLAG_precise = true;
         return true;
     }
+    if (arg == "--repack") {
+        FLAG_repack = true;
+        return true;
+    }
     if (arg == "--trap") {
         FLAG_trap = true;
         FLAG_unsecure = true; // for better backtraces
@@ -1565,6 +1569,7 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     }
     if (llama_supports_mmap()) {
         options.push_back({ "*",           "       --no-mmap",              "do not memory-map model (slower load but may reduce pageouts if not using mlock)" });
+        options.push_back({ "*",           "       --repack",               "interleave q4_0 weights at load for faster cpu matmul (implies --no-mmap)" });
     }
     options.push_back({ "*",           "       --numa TYPE",            "attempt optimizations that help on some NUMA systems\n"
                                                                         "  - distribute: spread execution evenly over all nodes\n"
@@ -366,6 +366,38 @@ size_t quantize_q4_0_8x8(const float * restrict src, void * restrict dst, int64_
     }
 }
 
+// converts the rows of a loaded Q4_0 tensor, in place, into the same
+// interleaved layout that quantize_q4_0_8x8() produces
+int ggml_repack_q4_0_8x8(struct ggml_tensor * t) {
+    if (t->type != GGML_TYPE_Q4_0 || ggml_n_dims(t) != 2 ||
+        t->ne[1] % 8 != 0 || !ggml_is_contiguous(t)) {
+        return -1;
+    }
+
+    const int64_t nb = t->ne[0] / QK4_0;
+    block_q4_0 * tmp = (block_q4_0 *) malloc(8 * nb * sizeof(block_q4_0));
+    if (!tmp) {
+        return -1;
+    }
+
+    for (int64_t r = 0; r < t->ne[1]; r += 8) {
+        block_q4_0 * src = (block_q4_0 *) t->data + r * nb;
+        block_q4_0x8 * dst = (block_q4_0x8 *) src;
+        memcpy(tmp, src, 8 * nb * sizeof(block_q4_0));
+        for (int64_t x = 0; x < nb; x++) {
+            block_q4_0 in[8];
+            for (int i = 0; i < 8; i++) {
+                in[i] = tmp[i * nb + x];
+            }
+            dst[x] = make_block_q4_0x8(in, 8, 0x88);
+        }
+    }
+
+    free(tmp);
+    t->type = GGML_TYPE_Q4_0_8_8;
+    return 0;
+}
+
 void ggml_gemv_q4_0_4x4_q8_0(int n, float * restrict s, size_t bs, const void * restrict vx, const void * restrict vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -1541,6 +1541,7 @@ struct ggml_compute_state_shared {
 
     // synchronization primitives
     atomic_int n_barrier;
+    atomic_int n_barrier_sleepers;
     struct ggml_phaser *n_barrier_passed;
 
     ggml_abort_callback abort_callback; // abort ggml_graph_compute when true
@@ -1807,11 +1808,18 @@ inline static void ggml_critical_section_start(void) {
     }
 }
 
+// how many times to spin at a barrier before sleeping on a futex. this
+// is tens of microseconds, which is longer than threads of a graph are
+// normally out of step, but it keeps threads that are waiting on ones
+// which got descheduled from burning their cores for a whole timeslice
+#define GGML_BARRIER_SPINS 1000
+
 void ggml_barrier(const struct ggml_compute_params * params) {
     if (params->shared->n_threads == 1)
         return;
     int n = params->shared->n_threads;
     atomic_int * count = &params->shared->n_barrier;
+    atomic_int * sleepers = &params->shared->n_barrier_sleepers;
     atomic_uint * phase = &params->shared->n_barrier_passed[params->ith].i;
     unsigned i = atomic_load_explicit(phase, memory_order_relaxed);
     if (atomic_fetch_add_explicit(count, 1, memory_order_acq_rel) == n - 1) {
@@ -1819,11 +1827,29 @@ void ggml_barrier(const struct ggml_compute_params * params) {
         for (int j = 0; j < n; ++j)
             atomic_store_explicit(&params->shared->n_barrier_passed[j].i,
                                   i + 1, memory_order_relaxed);
-        atomic_thread_fence(memory_order_release);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(sleepers, memory_order_relaxed))
+            for (int j = 0; j < n; ++j)
+                if (j != params->ith)
+                    cosmo_futex_wake((atomic_int *)&params->shared->n_barrier_passed[j].i, 1, 0);
     } else {
-        while (atomic_load_explicit(phase, memory_order_relaxed) == i)
-            pthread_pause_np();
+        if (FLAG_trace)
+            llamafile_trace_begin("barrier");
+        for (int spins = 0; atomic_load_explicit(phase, memory_order_relaxed) == i;) {
+            if (spins < GGML_BARRIER_SPINS) {
+                ++spins;
+                pthread_pause_np();
+                continue;
+            }
+            // the last thread to arrive wakes us if it sees we're asleep.
+            // the futex won't sleep if the phase already changed
+            atomic_fetch_add_explicit(sleepers, 1, memory_order_seq_cst);
+            cosmo_futex_wait((atomic_int *)phase, i, 0, 0, 0);
+            atomic_fetch_sub_explicit(sleepers, 1, memory_order_relaxed);
+        }
         atomic_thread_fence(memory_order_acquire);
+        if (FLAG_trace)
+            llamafile_trace_end("barrier");
     }
 }
 
@@ -11027,6 +11053,10 @@ static void ggml_compute_forward_mul_mat_one_chunk(
     }
 }
 
+// number of chunks each thread's share of a matmul gets split into, so
+// threads that finish early can steal from threads on slower cores
+#define GGML_MUL_MAT_CHUNKS_PER_THREAD 4
+
 static void ggml_compute_forward_mul_mat(
         const struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
@@ -11050,6 +11080,15 @@ static void ggml_compute_forward_mul_mat(
     ggml_gemv_t              const gemv                 = type_traits[type].gemv;
     ggml_gemm_t              const gemm                 = type_traits[type].gemm;
 
+    // tinyBLAS multiplies Q4_0_8_8 weights on x86 with plain Q8_0 rows,
+    // so src1 only gets interleaved for the generic gemm kernels
+    bool interleave = from_float_to_mat && gemm;
+#if GGML_USE_LLAMAFILE && defined(__x86_64__)
+    if (type == GGML_TYPE_Q4_0_8_8 && ggml_cpu_has_avx2() && ggml_cpu_has_fma()) {
+        interleave = false;
+    }
+#endif
+
     GGML_ASSERT(ne0 == ne01);
     GGML_ASSERT(ne1 == ne11);
     GGML_ASSERT(ne2 == ne12);
@@ -11068,28 +11107,49 @@ static void ggml_compute_forward_mul_mat(
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
 
+    // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
+    // [jart] the barrier keeps everyone from claiming until the counter is reset, and the barrier that ended the last op
+    //        keeps the reset from happening while threads are still claiming chunks of a previous mul_mat.
+    if (ith == 0) {
+        atomic_store(&params->shared->current_chunk, nth);
+    }
+
+    ggml_barrier(params);
+
 #if GGML_USE_LLAMAFILE
     // broadcast factors
     const int64_t r2 = ne12 / ne02;
     const int64_t r3 = ne13 / ne03;
 
+    // Each thread's share of tinyBLAS tiles is split into smaller jobs
+    // that are handed out dynamically, so threads on fast cores finish
+    // the work of threads that were preempted or run on slower cores.
+    // Job ith is always claimed first by thread ith, so every thread
+    // learns whether llamafile_sgemm() supports this op before the
+    // shared counter gets touched.
+    const int64_t nsgemm = ggml_is_numa() ? nth : nth * GGML_MUL_MAT_CHUNKS_PER_THREAD;
+    const int64_t nsgemm_jobs = nsgemm * ne12 * ne13;
+
     const bool src1_cont = ggml_is_contiguous(src1);
 
     if (src1_cont) {
-        for (int64_t i13 = 0; i13 < ne13; i13++)
-            for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
-                                     nb01/ggml_type_size(src0->type),
-                                     (const char *)src1->data + i12*nb12 + i13*nb13,
-                                     nb11/ggml_type_size(src1->type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
-                                     nb1/ggml_type_size(dst->type),
-                                     ith, nth,
-                                     src0->type,
-                                     src1->type,
-                                     dst->type))
-                    goto UseGgmlGemm1;
+        for (int64_t job = ith; job < nsgemm_jobs;
+             job = atomic_fetch_add(&params->shared->current_chunk, 1)) {
+            const int64_t i12 = job / nsgemm % ne12;
+            const int64_t i13 = job / nsgemm / ne12;
+            if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
+                                 (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                                 nb01/ggml_type_size(src0->type),
+                                 (const char *)src1->data + i12*nb12 + i13*nb13,
+                                 nb11/ggml_type_size(src1->type),
+                                 (char *)dst->data + i12*nb2 + i13*nb3,
+                                 nb1/ggml_type_size(dst->type),
+                                 job % nsgemm, nsgemm,
+                                 src0->type,
+                                 src1->type,
+                                 dst->type))
+                goto UseGgmlGemm1;
+        }
         return;
     }
 UseGgmlGemm1:;
@@ -11108,7 +11168,7 @@ UseGgmlGemm1:;
         for (int64_t i13 = 0; i13 < ne13; ++i13) {
             for (int64_t i12 = 0; i12 < ne12; ++i12) {
                 int64_t i11_processed = 0;
-                if ((ggml_n_dims(src1) == 2) && from_float_to_mat && gemm) {
+                if ((ggml_n_dims(src1) == 2) && interleave) {
                     for (int64_t i11 = ith * 4; i11 < ne11 - ne11 % 4; i11 += nth * 4) {
                         from_float_to_mat((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11),
                                           (void *)               (wdata + i13*nbw3 + i12*nbw2 + i11*nbw1),
@@ -11127,30 +11187,28 @@ UseGgmlGemm1:;
         ggml_barrier(params);
     }
 
-    if (ith == 0) {
-        // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
-        atomic_store(&params->shared->current_chunk, nth);
-    }
-
 #if GGML_USE_LLAMAFILE
     if (src1->type != vec_dot_type) {
         const void* wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
-        for (int64_t i13 = 0; i13 < ne13; i13++)
-            for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
-                                     nb01/ggml_type_size(src0->type),
-                                     (const char *)wdata + (i12*ne11 + i13*ne12*ne11)*row_size,
-                                     row_size/ggml_type_size(vec_dot_type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
-                                     nb1/ggml_type_size(dst->type),
-                                     ith, nth,
-                                     src0->type,
-                                     vec_dot_type,
-                                     dst->type))
-                    goto UseGgmlGemm2;
+        for (int64_t job = ith; job < nsgemm_jobs;
+             job = atomic_fetch_add(&params->shared->current_chunk, 1)) {
+            const int64_t i12 = job / nsgemm % ne12;
+            const int64_t i13 = job / nsgemm / ne12;
+            if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
+                                 (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                                 nb01/ggml_type_size(src0->type),
+                                 (const char *)wdata + (i12*ne11 + i13*ne12*ne11)*row_size,
+                                 row_size/ggml_type_size(vec_dot_type),
+                                 (char *)dst->data + i12*nb2 + i13*nb3,
+                                 nb1/ggml_type_size(dst->type),
+                                 job % nsgemm, nsgemm,
+                                 src0->type,
+                                 vec_dot_type,
+                                 dst->type))
+                goto UseGgmlGemm2;
+        }
         return;
     }
 UseGgmlGemm2:;
@@ -11184,13 +11242,17 @@ UseGgmlGemm2:;
     int64_t nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
     int64_t nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
 
-    // If the chunking is poor for the number of threads on this setup, scrap the whole plan.  Re-chunk it by thread.
-    //   Also, chunking by thread was measured to have perform better on NUMA systems.  See https://github.com/ggerganov/llama.cpp/pull/6915
+    // Chunking by thread was measured to have perform better on NUMA systems.  See https://github.com/ggerganov/llama.cpp/pull/6915
     //   In theory, chunking should be just as useful on NUMA and non NUMA systems, but testing disagreed with that.
-    if (nchunk0 * nchunk1 < nth * 4 || ggml_is_numa()) {
+    if (ggml_is_numa()) {
         // distribute the thread work across the inner or outer loop based on which one is larger
         nchunk0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
         nchunk1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
+    } else if (nchunk0 * nchunk1 < nth * GGML_MUL_MAT_CHUNKS_PER_THREAD) {
+        // If the chunking is too coarse for the number of threads, use smaller chunks along the larger dimension
+        //   rather than one chunk per thread, so threads on fast cores can pick up the slack of slower ones.
+        nchunk0 = nr0 > nr1 ? MIN(nr0, nth * GGML_MUL_MAT_CHUNKS_PER_THREAD) : 1; // parallelize by src0 rows
+        nchunk1 = nr0 > nr1 ? 1 : MIN(nr1, nth * GGML_MUL_MAT_CHUNKS_PER_THREAD); // parallelize by src1 rows
     }
 
     // The number of elements in each chunk
@@ -11200,21 +11262,24 @@ UseGgmlGemm2:;
     if ((ggml_n_dims(src0) == 2) && gemv) {
         const void * src1_wdata      = (src1->type == vec_dot_type) ? src1->data : params->wdata;
         const size_t src1_col_stride = ggml_is_contiguous(src1) || src1->type != vec_dot_type ? ggml_row_size(vec_dot_type, ne10) : nb11;
-        int64_t src0_start = (ith * ne01) / nth;
-        int64_t src0_end   = ((ith + 1) * ne01) / nth;
-        src0_start = (src0_start % matmul_num_cols) ? src0_start + matmul_num_cols - (src0_start % matmul_num_cols): src0_start;
-        src0_end   = (src0_end   % matmul_num_cols) ? src0_end   + matmul_num_cols - (src0_end   % matmul_num_cols): src0_end;
-        if (src0_start >= src0_end) return;
-
-        // If there are more than three rows in src1, use gemm; otherwise, use gemv.
-        if (gemm && (ne11 > 3)) {
-            gemm(ne00, (float *)((char *) dst->data) + src0_start, ne01, (const char *) src0->data + src0_start * nb01,
-                 (const char *) src1_wdata, ne11 - ne11 % 4, src0_end - src0_start);
-        }
-        for (int iter = gemm ? ne11 - ne11 % 4 : 0; iter < ne11; iter++) {
-            gemv(ne00, (float *)((char *) dst->data + (iter * nb1)) + src0_start, ne01,
-                 (const char *) src0->data + src0_start * nb01, (const char *) src1_wdata + (src1_col_stride * iter), 1,
-                 src0_end - src0_start);
+        const int64_t nchunk = ggml_is_numa() ? nth : nth * GGML_MUL_MAT_CHUNKS_PER_THREAD;
+        for (int64_t chunk = ith; chunk < nchunk; chunk = atomic_fetch_add(&params->shared->current_chunk, 1)) {
+            int64_t src0_start = (chunk * ne01) / nchunk;
+            int64_t src0_end   = ((chunk + 1) * ne01) / nchunk;
+            src0_start = (src0_start % matmul_num_cols) ? src0_start + matmul_num_cols - (src0_start % matmul_num_cols): src0_start;
+            src0_end   = (src0_end   % matmul_num_cols) ? src0_end   + matmul_num_cols - (src0_end   % matmul_num_cols): src0_end;
+            if (src0_start >= src0_end) continue;
+
+            // If there are more than three rows in src1, use gemm; otherwise, use gemv.
+            if (interleave && (ne11 > 3)) {
+                gemm(ne00, (float *)((char *) dst->data) + src0_start, ne01, (const char *) src0->data + src0_start * nb01,
+                     (const char *) src1_wdata, ne11 - ne11 % 4, src0_end - src0_start);
+            }
+            for (int iter = interleave ? ne11 - ne11 % 4 : 0; iter < ne11; iter++) {
+                gemv(ne00, (float *)((char *) dst->data + (iter * nb1)) + src0_start, ne01,
+                     (const char *) src0->data + src0_start * nb01, (const char *) src1_wdata + (src1_col_stride * iter), 1,
+                     src0_end - src0_start);
+            }
         }
         return;
     }
@@ -17729,6 +17794,7 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         /*.cgraph_plan             =*/ cplan,
         /*.n_threads               =*/ n_threads,
         /*.n_barrier               =*/ 0,
+        /*.n_barrier_sleepers      =*/ 0,
         /*.n_barrier_passed        =*/ n_barrier_passed,
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
@@ -2277,6 +2277,10 @@ extern "C" {
                    int64_t   n_per_row,
                const float * imatrix);
 
+    // converts the data of a loaded Q4_0 weight, in place, into the interleaved Q4_0_8_8 layout
+    // returns 0 on success, or -1 if the tensor isn't a 2d Q4_0 matrix with a multiple of 8 rows
+    GGML_API int ggml_repack_q4_0_8x8(struct ggml_tensor * tensor);
+
     //
     // gguf
     //
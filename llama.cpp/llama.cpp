@@ -3322,6 +3322,24 @@ static size_t llama_model_max_nodes(const llama_model & model) {
     return std::max<size_t>(8192, model.tensors_by_name.size()*5);
 }
 
+// [jart] whether q4_0 weights should be interleaved at load time, for
+//        the tinyBLAS kernels that exist for the Q4_0_8_8 layout on x86
+static bool llama_want_repack() {
+#ifdef __x86_64__
+    return FLAG_repack && ggml_cpu_has_avx2() && ggml_cpu_has_fma();
+#else
+    return false;
+#endif
+}
+
+// [jart] weights that are only ever the first operand of ggml_mul_mat()
+//        and have the shape that ggml_repack_q4_0_8x8() accepts
+static bool llama_can_repack(const struct ggml_tensor * t) {
+    const char * name = ggml_get_name(t);
+    return t->type == GGML_TYPE_Q4_0 && ggml_n_dims(t) == 2 && t->ne[1] % 8 == 0 &&
+           (!strncmp(name, "blk.", 4) || !strcmp(name, "output.weight"));
+}
+
 struct llama_model_loader {
     int n_kv      = 0;
     int n_tensors = 0;
@@ -3584,6 +3602,18 @@ struct llama_model_loader {
             use_mmap = false;
         }
 
+        if (use_mmap && llama_want_repack()) { // [jart]
+            // only give up mmap if this model has weights we'd repack
+            int n_repack = 0;
+            for (const auto & w : weights) {
+                n_repack += llama_can_repack(w.tensor);
+            }
+            if (n_repack) {
+                LLAMA_LOG_INFO("%s: not using mmap since %d weights will be repacked\n", __func__, n_repack);
+                use_mmap = false;
+            }
+        }
+
         this->use_mmap = use_mmap;
         this->check_tensors = check_tensors;
     }
@@ -3984,6 +4014,7 @@ struct llama_model_loader {
 
         std::vector<no_init<uint8_t>> read_buf;
         std::vector<std::future<std::pair<ggml_tensor *, bool>>> validation_result;
+        std::vector<ggml_tensor *> repack; // [jart]
 
 // #if defined(GGML_USE_CUDA)
         // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
@@ -4077,6 +4108,9 @@ struct llama_model_loader {
                             return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
                         }));
                     }
+                    if (llama_want_repack() && llama_can_repack(cur)) {
+                        repack.push_back(cur);
+                    }
                 } else {
 // #if defined(GGML_USE_CUDA)
                     // If cuda_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
@@ -4140,6 +4174,17 @@ struct llama_model_loader {
             throw std::runtime_error("found tensors with invalid data");
         }
 
+        // [jart] interleave weights once nothing else is reading them
+        int n_repacked = 0;
+        for (ggml_tensor * cur : repack) {
+            if (!ggml_repack_q4_0_8x8(cur)) {
+                ++n_repacked;
+            }
+        }
+        if (n_repacked) {
+            LLAMA_LOG_INFO("%s: repacked %d q4_0 tensors to q4_0_8x8\n", __func__, n_repacked);
+        }
+
         // check if this is the last call and do final cleanup
         if (size_done >= size_data) {
             // unmap offloaded tensors and metadata
@@ -14603,7 +14648,7 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
 }
 
 
-static void llama_graph_compute(
+static enum ggml_status llama_graph_compute(
         llama_context & lctx,
           ggml_cgraph * gf,
                   int   n_threads) {
@@ -14632,13 +14677,14 @@ static void llama_graph_compute(
     }
 #endif
 
-    ggml_backend_sched_graph_compute_async(lctx.sched, gf);
+    enum ggml_status status = ggml_backend_sched_graph_compute_async(lctx.sched, gf);
 
     // [jart] resources management
     cleanup.set(nullptr);
     g_core_manager.release((intptr_t)n_threads);
 
     // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
+    return status;
 }
 
 struct llama_coder {
@@ -14863,7 +14909,11 @@ static int llama_decode_internal(
 
         llama_set_inputs(lctx, u_batch);
 
-        llama_graph_compute(lctx, gf, n_threads);
+        // [jart] let abort_callback cancel a decode
+        if (llama_graph_compute(lctx, gf, n_threads) == GGML_STATUS_ABORTED) {
+            LLAMA_LOG_WARN("%s: graph compute was aborted\n", __func__);
+            return 2;
+        }
 
         // update the kv ring buffer
         {
@@ -17310,6 +17360,17 @@ uint64_t llama_model_size(const struct llama_model * model) {
     return size;
 }
 
+uint64_t llama_context_size(const struct llama_context * ctx) { // [jart]
+    uint64_t size = ctx->kv_self.total_size();
+    if (ctx->buf_output) {
+        size += ggml_backend_buffer_get_size(ctx->buf_output);
+    }
+    for (auto * backend : ctx->backends) {
+        size += ggml_backend_sched_get_buffer_size(ctx->sched, backend);
+    }
+    return size;
+}
+
 uint64_t llama_model_n_params(const struct llama_model * model) {
     uint64_t nparams = 0;
     for (const auto & it : model->tensors_by_name) {
@@ -504,6 +504,9 @@ extern "C" {
     // Returns the total number of parameters in the model
     LLAMA_API uint64_t llama_model_n_params(const struct llama_model * model);
 
+    // Returns the total size of the kv cache, output and compute buffers of the context in bytes
+    LLAMA_API uint64_t llama_context_size(const struct llama_context * ctx); // [jart]
+
     // Get a llama model tensor
     LLAMA_API struct ggml_tensor * llama_get_model_tensor(struct llama_model * model, const char * name);
 
@@ -832,6 +835,7 @@ extern "C" {
     // Positive return values does not mean a fatal error, but rather a warning.
     //   0 - success
     //   1 - could not find a KV slot for the batch (try reducing the size of the batch or increase the context)
+    //   2 - aborted by abort_callback
     // < 0 - error
     LLAMA_API int32_t llama_decode(
             struct llama_context * ctx,
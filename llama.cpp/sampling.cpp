@@ -267,11 +267,21 @@ static void sampler_queue(
     }
 }
 
+static llama_token_data_array llama_sampling_prepare_impl(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  struct llama_context * ctx_cfg,
+                  const int idx,
+                  float * logits,
+                  bool apply_grammar,
+                  std::vector<float> * original_logits);
+
 static llama_token llama_sampling_sample_impl(
                   struct llama_sampling_context * ctx_sampling,
                   struct llama_context * ctx_main,
                   struct llama_context * ctx_cfg,
                   const int idx,
+                  float * logits, // [jart]
                   bool is_resampling) {
     const llama_sampling_params & params = ctx_sampling->params;
 
@@ -281,7 +291,7 @@ static llama_token llama_sampling_sample_impl(
     const float   mirostat_eta    = params.mirostat_eta;
 
     std::vector<float> original_logits;
-    auto cur_p = llama_sampling_prepare(ctx_sampling, ctx_main, ctx_cfg, idx, /* apply_grammar= */ is_resampling, &original_logits);
+    auto cur_p = llama_sampling_prepare_impl(ctx_sampling, ctx_main, ctx_cfg, idx, logits, /* apply_grammar= */ is_resampling, &original_logits);
     if (ctx_sampling->grammar != NULL && !is_resampling) {
         GGML_ASSERT(!original_logits.empty());
     }
@@ -327,7 +337,8 @@ static llama_token llama_sampling_sample_impl(
 
     if (ctx_sampling->grammar != NULL && !is_resampling) {
         // Get a pointer to the logits
-        float * logits = llama_get_logits_ith(ctx_main, idx);
+        if (!logits) // [jart]
+            logits = llama_get_logits_ith(ctx_main, idx);
 
         // Create an array with a single token data element for the sampled id
         llama_token_data single_token_data = {id, logits[id], 0.0f};
@@ -346,7 +357,7 @@ static llama_token llama_sampling_sample_impl(
             // Restore logits from the copy
             std::copy(original_logits.begin(), original_logits.end(), logits);
 
-            return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, /* is_resampling= */ true);
+            return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, logits, /* is_resampling= */ true);
         }
     }
 
@@ -360,6 +371,7 @@ static llama_token_data_array llama_sampling_prepare_impl(
                   struct llama_context * ctx_main,
                   struct llama_context * ctx_cfg,
                   const int idx,
+                  float * logits, // [jart]
                   bool apply_grammar,
                   std::vector<float> * original_logits) {
     const llama_sampling_params & params = ctx_sampling->params;
@@ -377,7 +389,8 @@ static llama_token_data_array llama_sampling_prepare_impl(
     auto & cur  = ctx_sampling->cur;
 
     // Get a pointer to the logits
-    float * logits = llama_get_logits_ith(ctx_main, idx);
+    if (!logits) // [jart]
+        logits = llama_get_logits_ith(ctx_main, idx);
 
     if (ctx_sampling->grammar != NULL && !apply_grammar) {
         GGML_ASSERT(original_logits != NULL);
@@ -437,7 +450,14 @@ llama_token llama_sampling_sample(
                   struct llama_context * ctx_cfg,
                   const int idx) {
     // Call the implementation function with is_resampling set to false by default
-    return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, /* is_resampling= */ false);
+    return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, nullptr, /* is_resampling= */ false);
+}
+
+llama_token llama_sampling_sample_logits(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  float * logits) {
+    return llama_sampling_sample_impl(ctx_sampling, ctx_main, nullptr, 0, logits, /* is_resampling= */ false);
 }
 
 llama_token_data_array llama_sampling_prepare(
@@ -447,7 +467,7 @@ llama_token_data_array llama_sampling_prepare(
                   const int idx,
                   bool apply_grammar,
                   std::vector<float> * original_logits) {
-    return llama_sampling_prepare_impl(ctx_sampling,ctx_main, ctx_cfg, idx, apply_grammar, original_logits);
+    return llama_sampling_prepare_impl(ctx_sampling,ctx_main, ctx_cfg, idx, nullptr, apply_grammar, original_logits);
 }
 
 void llama_sampling_accept(
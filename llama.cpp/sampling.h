@@ -144,6 +144,13 @@ llama_token llama_sampling_sample(
         struct llama_context * ctx_cfg,
         int idx = -1);
 
+// [jart] same as above, but samples from a logits row that the caller
+//        copied out of a llama_context which is shared across threads
+llama_token llama_sampling_sample_logits(
+        struct llama_sampling_context * ctx_sampling,
+        struct llama_context * ctx_main,
+        float * logits);
+
 // Prepares and adjusts the set of token candidates for sampling based on penalties, biases, and sampling parameters.
 llama_token_data_array llama_sampling_prepare(
         struct llama_sampling_context * ctx_sampling,
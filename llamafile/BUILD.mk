@@ -59,11 +59,15 @@ o/$(MODE)/llamafile:						\
 		o/$(MODE)/llamafile/tokenize			\
 		o/$(MODE)/llamafile/addnl			\
 		o/$(MODE)/llamafile/high			\
+		o/$(MODE)/llamafile/core_manager_test.runs	\
 		o/$(MODE)/llamafile/datauri_test.runs		\
 		o/$(MODE)/llamafile/parse_cidr_test.runs	\
 		o/$(MODE)/llamafile/pool_cancel_test.runs	\
 		o/$(MODE)/llamafile/pool_test.runs		\
+		o/$(MODE)/llamafile/repack_test.runs		\
 		o/$(MODE)/llamafile/json_test.runs		\
+		o/$(MODE)/llamafile/kquant_test.runs		\
+		o/$(MODE)/llamafile/mulmat_chunk_test.runs	\
 		o/$(MODE)/llamafile/thread_test.runs		\
 		o/$(MODE)/llamafile/vmathf_test.runs		\
 
@@ -130,6 +134,8 @@ o/$(MODE)/llamafile/tinyblas_cpu_mixmul_arm82.o: private TARGET_ARCH += -Xaarch6
 
 o/$(MODE)/llamafile/sgemm.o: private CXXFLAGS += -Os
 
+o/$(MODE)/llamafile/sgemm_chunk_test.o			\
+o/$(MODE)/llamafile/sgemm_kquant_test.o			\
 o/$(MODE)/llamafile/sgemm_matmul_test.o			\
 o/$(MODE)/llamafile/sgemm_sss_test.o			\
 o/$(MODE)/llamafile/sgemm_vecdot_test.o			\
@@ -167,6 +173,18 @@ o/$(MODE)/llamafile/vmathf_test:			\
 		o/$(MODE)/llamafile/vmathf_test.o	\
 		o/$(MODE)/llama.cpp/llama.cpp.a		\
 
+o/$(MODE)/llamafile/mulmat_chunk_test:			\
+		o/$(MODE)/llamafile/mulmat_chunk_test.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a		\
+
+o/$(MODE)/llamafile/repack_test:			\
+		o/$(MODE)/llamafile/repack_test.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a		\
+
+o/$(MODE)/llamafile/kquant_test:			\
+		o/$(MODE)/llamafile/kquant_test.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a		\
+
 o/$(MODE)/llamafile/parse_cidr_test:			\
 		o/$(MODE)/llamafile/parse_cidr_test.o	\
 		o/$(MODE)/llamafile/parse_cidr.o	\
@@ -196,6 +214,11 @@ o/$(MODE)/llamafile/pool_cancel_test:			\
 		o/$(MODE)/llamafile/crash.o		\
 		o/$(MODE)/llamafile/pool.o		\
 
+o/$(MODE)/llamafile/core_manager_test:			\
+		o/$(MODE)/llamafile/core_manager_test.o	\
+		o/$(MODE)/llamafile/core_manager.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a		\
+
 o/$(MODE)/llamafile/thread_test:			\
 		o/$(MODE)/llamafile/thread_test.o	\
 		o/$(MODE)/llamafile/crash.o		\
@@ -205,6 +228,8 @@ o/$(MODE)/llamafile/sgemm_sss_test: private LDFLAGS += -fopenmp
 o/$(MODE)/llamafile/sgemm_sss_test.o: private CCFLAGS += -fopenmp
 o/$(MODE)/llamafile/sgemm_matmul_test: private LDFLAGS += -fopenmp
 o/$(MODE)/llamafile/sgemm_matmul_test.o: private CCFLAGS += -fopenmp
+o/$(MODE)/llamafile/sgemm_chunk_test: private LDFLAGS += -fopenmp
+o/$(MODE)/llamafile/sgemm_chunk_test.o: private CCFLAGS += -fopenmp
 
 o/$(MODE)/llamafile/sgemm_sss_test:			\
 		o/$(MODE)/llamafile/sgemm_sss_test.o	\
@@ -218,6 +243,14 @@ o/$(MODE)/llamafile/sgemm_vecdot_test:			\
 		o/$(MODE)/llamafile/sgemm_vecdot_test.o	\
 		o/$(MODE)/llama.cpp/llama.cpp.a
 
+o/$(MODE)/llamafile/sgemm_chunk_test:			\
+		o/$(MODE)/llamafile/sgemm_chunk_test.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a
+
+o/$(MODE)/llamafile/sgemm_kquant_test:			\
+		o/$(MODE)/llamafile/sgemm_kquant_test.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a
+
 o/$(MODE)/llamafile/sgemm_vecdot_test:			\
 		private LDFLAGS += -fopenmp
 
@@ -17,54 +17,58 @@
 
 #include "core_manager.h"
 
+#include <algorithm>
 #include <assert.h>
 
 #include "llama.cpp/cores.h"
 
 CoreManager g_core_manager;
 
-CoreManager::CoreManager()
+CoreManager::CoreManager() : CoreManager(cpu_get_num_math()) {
+}
+
+CoreManager::CoreManager(int total)
     : used_(0),
-      total_(cpu_get_num_math()),
+      total_(total),
+      leases_(0),
+      waiters_(0),
       cv_(PTHREAD_COND_INITIALIZER),
       mu_(PTHREAD_MUTEX_INITIALIZER) {
 }
 
-static void unlock_mutex(void *arg) {
-    pthread_mutex_t *mu = (pthread_mutex_t *)arg;
-    pthread_mutex_unlock(mu);
+void CoreManager::cancel_wait(void *arg) {
+    CoreManager *cm = (CoreManager *)arg;
+    --cm->waiters_;
+    pthread_mutex_unlock(&cm->mu_);
 }
 
+// leases at least `need` and at most `greed` cores
+//
+// this blocks until `need` cores are free. if other leases are held or
+// wanted, then no more than an equal share is taken beyond `need`, so
+// that a big prefill doesn't starve small decodes of cores, while one
+// running alone still gets the whole machine.
+//
+// @return number of cores leased, which must be passed to release()
 int CoreManager::acquire(int need, int greed) {
     npassert(need >= 1);
     npassert(greed >= need);
+    need = std::min(need, total_);
 
-    int got = 0;
-
-    while (got < need) {
-        pthread_mutex_lock(&mu_);
-        pthread_cleanup_push(unlock_mutex, &mu_);
-        if (used_ < total_) {
-            ++got;
-            ++used_;
-        } else {
-            pthread_cond_wait(&cv_, &mu_);
-        }
-        pthread_cleanup_pop(true);
-    }
+    pthread_mutex_lock(&mu_);
+    ++waiters_;
+    pthread_cleanup_push(cancel_wait, this);
+    while (used_ + need > total_)
+        pthread_cond_wait(&cv_, &mu_);
+    pthread_cleanup_pop(false);
+    --waiters_;
 
-    while (got < greed) {
-        errno_t err;
-        if (pthread_mutex_trylock(&mu_))
-            break;
-        if (used_ < total_) {
-            ++got;
-            ++used_;
-        } else {
-            greed = got;
-        }
-        pthread_mutex_unlock(&mu_);
-    }
+    int share = total_ / (leases_ + waiters_ + 1);
+    int got = std::min(greed, total_ - used_);
+    got = std::min(got, std::max(need, share));
+    used_ += got;
+    ++leases_;
+    pthread_mutex_unlock(&mu_);
 
     return got;
 }
@@ -72,13 +76,15 @@ int CoreManager::acquire(int need, int greed) {
 void CoreManager::release(int count) {
     bool ok;
     pthread_mutex_lock(&mu_);
-    if ((used_ -= count) >= 0) {
+    if ((used_ -= count) >= 0 && leases_ > 0) {
         ok = true;
+        --leases_;
     } else {
         ok = false;
         used_ = 0;
+        leases_ = 0;
     }
-    pthread_cond_signal(&cv_);
+    pthread_cond_broadcast(&cv_);
     pthread_mutex_unlock(&mu_);
     npassert(ok);
 }
@@ -18,17 +18,27 @@
 #pragma once
 #include <pthread.h>
 
+// leases cpu cores to threads that compute graphs
+//
+// this keeps concurrent computations from spawning more threads than
+// there are cores. when several leases are wanted at the same time,
+// greedy requests are limited to an equal share of the cores.
 class CoreManager {
   public:
     CoreManager();
+    explicit CoreManager(int);
     int acquire(int, int);
     void release(int);
 
   private:
     int used_;
     int total_;
+    int leases_;
+    int waiters_;
     pthread_cond_t cv_;
     pthread_mutex_t mu_;
+
+    static void cancel_wait(void *);
 };
 
 extern CoreManager g_core_manager;
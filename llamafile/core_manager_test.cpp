@@ -0,0 +1,70 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "core_manager.h"
+
+#include <cosmo.h>
+#include <pthread.h>
+
+CoreManager g_cores(8);
+
+void *lease_two(void *arg) {
+    return (void *)(long)g_cores.acquire(2, 2);
+}
+
+int main(int argc, char *argv[]) {
+    int a, b;
+
+    // a lease running alone gets every core it wants
+    if ((a = g_cores.acquire(1, 8)) != 8)
+        return 1;
+    g_cores.release(a);
+
+    // greedy leases are limited to an equal share when others exist
+    if ((a = g_cores.acquire(1, 6)) != 6)
+        return 2;
+    if ((b = g_cores.acquire(1, 8)) != 2)
+        return 3;
+    g_cores.release(b);
+    g_cores.release(a);
+    if ((a = g_cores.acquire(1, 2)) != 2)
+        return 4;
+    if ((b = g_cores.acquire(1, 8)) != 4)
+        return 5;
+    g_cores.release(b);
+    g_cores.release(a);
+
+    // need is waited for until enough cores are released
+    void *res;
+    pthread_t th;
+    if ((a = g_cores.acquire(8, 8)) != 8)
+        return 6;
+    if (pthread_create(&th, 0, lease_two, 0))
+        return 7;
+    usleep(10000);
+    g_cores.release(a);
+    if (pthread_join(th, &res))
+        return 8;
+    if ((long)res != 2)
+        return 9;
+    g_cores.release(2);
+
+    // need is clamped to the number of cores
+    if ((a = g_cores.acquire(16, 16)) != 8)
+        return 10;
+    g_cores.release(a);
+}
@@ -22,7 +22,9 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
+#include <vector>
 
 __static_yoink("llamafile/schema.sql");
 
@@ -31,18 +33,37 @@ __static_yoink("llamafile/schema.sql");
 namespace lf {
 namespace db {
 
+// Returns prepared statement for `sql`, reusing a previous one if possible.
+//
+// Connections are meant to be long lived, so rather than finalizing our
+// statements, we reset them when we're done. SQLite already keeps a list
+// of every statement a connection has prepared, so that serves as our
+// cache. Callers must pass string literals and call sqlite3_reset() on the
+// statement when they're done with it.
+static sqlite3_stmt *prepare(sqlite3 *db, const char *sql) {
+    sqlite3_stmt *stmt = nullptr;
+    while ((stmt = sqlite3_next_stmt(db, stmt)))
+        if (!sqlite3_stmt_busy(stmt) && !strcmp(sqlite3_sql(stmt), sql)) {
+            sqlite3_clear_bindings(stmt);
+            return stmt;
+        }
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK)
+        return nullptr;
+    return stmt;
+}
+
 static bool table_exists(sqlite3 *db, const char *table_name) {
     const char *query = "SELECT name FROM sqlite_master WHERE type='table' AND name=?;";
     sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, query, -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!(stmt = prepare(db, query))) {
         return false;
     }
     if (sqlite3_bind_text(stmt, 1, table_name, -1, SQLITE_STATIC) != SQLITE_OK) {
-        sqlite3_finalize(stmt);
+        sqlite3_reset(stmt);
         return false;
     }
     bool exists = sqlite3_step(stmt) == SQLITE_ROW;
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return exists;
 }
 
@@ -95,9 +116,17 @@ static sqlite3 *open_impl() {
     }
     if (!table_exists(db, "metadata") && !init_schema(db)) {
         fprintf(stderr, "%s: failed to initialize database schema\n", path.c_str());
-        sqlite3_close(db);
+        close(db);
         return nullptr;
     }
+    // databases created by older versions don't have this index
+    if (sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS messages_chat_id ON messages (chat_id, id);",
+                     nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        fprintf(stderr, "%s: failed to create index: %s\n", path.c_str(), errmsg);
+        sqlite3_free(errmsg);
+    }
+    // several workers may write at the same time
+    sqlite3_busy_timeout(db, 5000);
     return db;
 }
 
@@ -111,7 +140,10 @@ sqlite3 *open() {
 
 void close(sqlite3 *db) {
     int cs;
+    sqlite3_stmt *stmt;
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+    while ((stmt = sqlite3_next_stmt(db, nullptr)))
+        sqlite3_finalize(stmt);
     sqlite3_close(db);
     pthread_setcancelstate(cs, 0);
 }
@@ -119,19 +151,19 @@ void close(sqlite3 *db) {
 static int64_t add_chat_impl(sqlite3 *db, const std::string &model, const std::string &title) {
     const char *query = "INSERT INTO chats (model, title) VALUES (?, ?);";
     sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, query, -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!(stmt = prepare(db, query))) {
         return -1;
     }
     if (sqlite3_bind_text(stmt, 1, model.data(), model.size(), SQLITE_STATIC) != SQLITE_OK ||
         sqlite3_bind_text(stmt, 2, title.data(), title.size(), SQLITE_STATIC) != SQLITE_OK) {
-        sqlite3_finalize(stmt);
+        sqlite3_reset(stmt);
         return -1;
     }
     if (sqlite3_step(stmt) != SQLITE_DONE) {
-        sqlite3_finalize(stmt);
+        sqlite3_reset(stmt);
         return -1;
     }
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return sqlite3_last_insert_rowid(db);
 }
 
@@ -150,7 +182,7 @@ static int64_t add_message_impl(sqlite3 *db, int64_t chat_id, const std::string
                         "top_p, presence_penalty, frequency_penalty) "
                         "VALUES (?, ?, ?, ?, ?, ?, ?);";
     sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, query, -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!(stmt = prepare(db, query))) {
         return -1;
     }
     if (sqlite3_bind_int64(stmt, 1, chat_id) != SQLITE_OK ||
@@ -160,14 +192,14 @@ static int64_t add_message_impl(sqlite3 *db, int64_t chat_id, const std::string
         sqlite3_bind_double(stmt, 5, top_p) != SQLITE_OK ||
         sqlite3_bind_double(stmt, 6, presence_penalty) != SQLITE_OK ||
         sqlite3_bind_double(stmt, 7, frequency_penalty) != SQLITE_OK) {
-        sqlite3_finalize(stmt);
+        sqlite3_reset(stmt);
         return -1;
     }
     if (sqlite3_step(stmt) != SQLITE_DONE) {
-        sqlite3_finalize(stmt);
+        sqlite3_reset(stmt);
         return -1;
     }
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return sqlite3_last_insert_rowid(db);
 }
 
@@ -182,19 +214,51 @@ int64_t add_message(sqlite3 *db, int64_t chat_id, const std::string &role,
     return res;
 }
 
+static bool add_messages_impl(sqlite3 *db, int64_t chat_id, const std::vector<Message> &messages,
+                              std::vector<int64_t> *ids) {
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr) != SQLITE_OK)
+        return false;
+    for (const Message &m : messages) {
+        int64_t id = add_message_impl(db, chat_id, m.role, m.content, m.temperature, m.top_p,
+                                      m.presence_penalty, m.frequency_penalty);
+        if (id == -1) {
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            ids->clear();
+            return false;
+        }
+        ids->push_back(id);
+    }
+    if (sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        ids->clear();
+        return false;
+    }
+    return true;
+}
+
+// Inserts several messages using a single transaction.
+bool add_messages(sqlite3 *db, int64_t chat_id, const std::vector<Message> &messages,
+                  std::vector<int64_t> *ids) {
+    int cs;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+    bool res = add_messages_impl(db, chat_id, messages, ids);
+    pthread_setcancelstate(cs, 0);
+    return res;
+}
+
 static bool update_title_impl(sqlite3 *db, int64_t chat_id, const std::string &title) {
     const char *query = "UPDATE chats SET title = ? WHERE id = ?;";
     sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, query, -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!(stmt = prepare(db, query))) {
         return false;
     }
     if (sqlite3_bind_text(stmt, 1, title.data(), title.size(), SQLITE_STATIC) != SQLITE_OK ||
         sqlite3_bind_int64(stmt, 2, chat_id) != SQLITE_OK) {
-        sqlite3_finalize(stmt);
+        sqlite3_reset(stmt);
         return false;
     }
     bool success = sqlite3_step(stmt) == SQLITE_DONE;
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return success;
 }
 
@@ -209,15 +273,15 @@ bool update_title(sqlite3 *db, int64_t chat_id, const std::string &title) {
 static bool delete_message_impl(sqlite3 *db, int64_t message_id) {
     const char *query = "DELETE FROM messages WHERE id = ?;";
     sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, query, -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!(stmt = prepare(db, query))) {
         return false;
     }
     if (sqlite3_bind_int64(stmt, 1, message_id) != SQLITE_OK) {
-        sqlite3_finalize(stmt);
+        sqlite3_reset(stmt);
         return false;
     }
     bool success = sqlite3_step(stmt) == SQLITE_DONE;
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return success;
 }
 
@@ -229,12 +293,20 @@ bool delete_message(sqlite3 *db, int64_t message_id) {
     return res;
 }
 
-static jt::Json get_chats_impl(sqlite3 *db) {
-    const char *query = "SELECT id, created_at, model, title FROM chats ORDER BY created_at DESC;";
+static jt::Json get_chats_impl(sqlite3 *db, int64_t before, int limit) {
+    const char *query = "SELECT id, created_at, model, title FROM chats "
+                        "WHERE id < ? "
+                        "ORDER BY id DESC "
+                        "LIMIT ?;";
     sqlite3_stmt *stmt;
     jt::Json result;
     result.setArray();
-    if (sqlite3_prepare_v2(db, query, -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!(stmt = prepare(db, query))) {
+        return result;
+    }
+    if (sqlite3_bind_int64(stmt, 1, before > 0 ? before : INT64_MAX) != SQLITE_OK ||
+        sqlite3_bind_int(stmt, 2, limit) != SQLITE_OK) {
+        sqlite3_reset(stmt);
         return result;
     }
     while (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -246,32 +318,41 @@ static jt::Json get_chats_impl(sqlite3 *db) {
         chat["title"] = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3));
         result.getArray().push_back(std::move(chat));
     }
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return result;
 }
 
-jt::Json get_chats(sqlite3 *db) {
+// Returns newest chats first.
+//
+// Pages are selected using keyset pagination, so each one costs the same
+// no matter how deep it is. To fetch the next page, pass the id of the last
+// chat on the current page as `before`. Passing 0 for `before` starts at the
+// newest chat, and passing -1 for `limit` returns everything.
+jt::Json get_chats(sqlite3 *db, int64_t before, int limit) {
     int cs;
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
-    jt::Json res = get_chats_impl(db);
+    jt::Json res = get_chats_impl(db, before, limit);
     pthread_setcancelstate(cs, 0);
     return res;
 }
 
-static jt::Json get_messages_impl(sqlite3 *db, int64_t chat_id) {
+static jt::Json get_messages_impl(sqlite3 *db, int64_t chat_id, int64_t before, int limit) {
     const char *query = "SELECT id, created_at, role, content, temperature, top_p, "
                         "presence_penalty, frequency_penalty "
                         "FROM messages "
-                        "WHERE chat_id = ? "
-                        "ORDER BY created_at DESC;";
+                        "WHERE chat_id = ? AND id < ? "
+                        "ORDER BY id DESC "
+                        "LIMIT ?;";
     sqlite3_stmt *stmt;
     jt::Json result;
     result.setArray();
-    if (sqlite3_prepare_v2(db, query, -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!(stmt = prepare(db, query))) {
         return result;
     }
-    if (sqlite3_bind_int64(stmt, 1, chat_id) != SQLITE_OK) {
-        sqlite3_finalize(stmt);
+    if (sqlite3_bind_int64(stmt, 1, chat_id) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt, 2, before > 0 ? before : INT64_MAX) != SQLITE_OK ||
+        sqlite3_bind_int(stmt, 3, limit) != SQLITE_OK) {
+        sqlite3_reset(stmt);
         return result;
     }
     while (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -287,14 +368,15 @@ static jt::Json get_messages_impl(sqlite3 *db, int64_t chat_id) {
         msg["frequency_penalty"] = sqlite3_column_double(stmt, 7);
         result.getArray().push_back(std::move(msg));
     }
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return result;
 }
 
-jt::Json get_messages(sqlite3 *db, int64_t chat_id) {
+// Returns newest messages of chat first, paginated like get_chats().
+jt::Json get_messages(sqlite3 *db, int64_t chat_id, int64_t before, int limit) {
     int cs;
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
-    jt::Json res = get_messages_impl(db, chat_id);
+    jt::Json res = get_messages_impl(db, chat_id, before, limit);
     pthread_setcancelstate(cs, 0);
     return res;
 }
@@ -304,11 +386,11 @@ static jt::Json get_chat_impl(sqlite3 *db, int64_t chat_id) {
     sqlite3_stmt *stmt;
     jt::Json result;
     result.setObject();
-    if (sqlite3_prepare_v2(db, query, -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!(stmt = prepare(db, query))) {
         return result;
     }
     if (sqlite3_bind_int64(stmt, 1, chat_id) != SQLITE_OK) {
-        sqlite3_finalize(stmt);
+        sqlite3_reset(stmt);
         return result;
     }
     if (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -317,7 +399,7 @@ static jt::Json get_chat_impl(sqlite3 *db, int64_t chat_id) {
         result["model"] = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
         result["title"] = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3));
     }
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return result;
 }
 
@@ -332,16 +414,15 @@ jt::Json get_chat(sqlite3 *db, int64_t chat_id) {
 static jt::Json get_message_impl(sqlite3 *db, int64_t message_id) {
     const char *query = "SELECT id, created_at, chat_id, role, content, temperature, top_p, "
                         "presence_penalty, frequency_penalty "
-                        "FROM messages WHERE id = ?"
-                        "ORDER BY created_at ASC;";
+                        "FROM messages WHERE id = ?;";
     sqlite3_stmt *stmt;
     jt::Json result;
     result.setObject();
-    if (sqlite3_prepare_v2(db, query, -1, &stmt, nullptr) != SQLITE_OK) {
+    if (!(stmt = prepare(db, query))) {
         return result;
     }
     if (sqlite3_bind_int64(stmt, 1, message_id) != SQLITE_OK) {
-        sqlite3_finalize(stmt);
+        sqlite3_reset(stmt);
         return result;
     }
     if (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -355,7 +436,7 @@ static jt::Json get_message_impl(sqlite3 *db, int64_t message_id) {
         result["presence_penalty"] = sqlite3_column_double(stmt, 7);
         result["frequency_penalty"] = sqlite3_column_double(stmt, 8);
     }
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return result;
 }
 
@@ -17,24 +17,35 @@
 
 #pragma once
 #include "json.h"
-#include <__fwd/string.h>
+#include <__fwd/vector.h>
+#include <string>
 
 struct sqlite3;
 
 namespace lf {
 namespace db {
 
+struct Message {
+    std::string role;
+    std::string content;
+    double temperature;
+    double top_p;
+    double presence_penalty;
+    double frequency_penalty;
+};
+
 sqlite3 *open();
 void close(sqlite3 *);
 int64_t add_chat(sqlite3 *, const std::string &, const std::string &);
 int64_t add_message(sqlite3 *, int64_t, const std::string &, const std::string &, double, double,
                     double, double);
+bool add_messages(sqlite3 *, int64_t, const std::vector<Message> &, std::vector<int64_t> *);
 bool update_title(sqlite3 *, int64_t, const std::string &);
 bool delete_message(sqlite3 *, int64_t);
 jt::Json get_chat(sqlite3 *, int64_t);
-jt::Json get_chats(sqlite3 *);
+jt::Json get_chats(sqlite3 *, int64_t, int);
 jt::Json get_message(sqlite3 *, int64_t);
-jt::Json get_messages(sqlite3 *, int64_t);
+jt::Json get_messages(sqlite3 *, int64_t, int64_t, int);
 
 } // namespace db
 } // namespace lf
@@ -49,6 +49,7 @@ bool FLAG_nocompile = false;
 bool FLAG_nologo = false;
 bool FLAG_precise = false;
 bool FLAG_recompile = false;
+bool FLAG_repack = false;
 bool FLAG_tinyblas = false;
 bool FLAG_trace = false;
 bool FLAG_unsecure = false;
@@ -59,9 +60,12 @@ const char *FLAG_db_startup_sql = "PRAGMA journal_mode=WAL;"
 const char *FLAG_file = nullptr;
 const char *FLAG_ip_header = nullptr;
 const char *FLAG_listen = "127.0.0.1:8080";
+const char *FLAG_lora = nullptr;
 const char *FLAG_mmproj = nullptr;
 const char *FLAG_model = nullptr;
+const char *FLAG_models = nullptr;
 const char *FLAG_prompt = nullptr;
+const char *FLAG_spill = nullptr;
 const char *FLAG_url_prefix = "";
 const char *FLAG_www_root = "/zip/www";
 double FLAG_token_rate = 1;
@@ -70,16 +74,27 @@ float FLAG_presence_penalty = 0;
 float FLAG_temperature = .8;
 float FLAG_top_p = .95;
 int FLAG_batch = 2048;
+int FLAG_cache_type_k = GGML_TYPE_F16;
+int FLAG_cache_type_v = GGML_TYPE_F16;
 int FLAG_ctx_size = 8192;
+int FLAG_draft = 0;
 int FLAG_flash_attn = false;
 int FLAG_gpu = 0;
 int FLAG_http_ibuf_size = 5 * 1024 * 1024;
 int FLAG_http_obuf_size = 1024 * 1024;
+int FLAG_image_cache = 256;
 int FLAG_keepalive = 5;
+int FLAG_kv_size = 0;
 int FLAG_main_gpu = 0;
+int FLAG_model_budget = 0;
 int FLAG_n_gpu_layers = -1;
+int FLAG_prefix_cache = 0;
+int FLAG_queue_depth = 16;
+int FLAG_queue_timeout = 30;
 int FLAG_slots = 1;
+int FLAG_spill_size = 4096;
 int FLAG_split_mode = LLAMA_SPLIT_MODE_LAYER;
+int FLAG_step_budget = 512;
 int FLAG_threads = MIN(cpu_get_num_math(), 20);
 int FLAG_threads_batch = cpu_get_num_math();
 int FLAG_token_burst = 100;
@@ -128,6 +143,28 @@ static wontreturn void unknown(const char *flag) {
     exit(1);
 }
 
+static int parse_cache_type(const char *flag, const char *value) {
+    if (!strcmp(value, "f32"))
+        return GGML_TYPE_F32;
+    if (!strcmp(value, "f16"))
+        return GGML_TYPE_F16;
+    if (!strcmp(value, "bf16"))
+        return GGML_TYPE_BF16;
+    if (!strcmp(value, "q8_0"))
+        return GGML_TYPE_Q8_0;
+    if (!strcmp(value, "q5_1"))
+        return GGML_TYPE_Q5_1;
+    if (!strcmp(value, "q5_0"))
+        return GGML_TYPE_Q5_0;
+    if (!strcmp(value, "q4_1"))
+        return GGML_TYPE_Q4_1;
+    if (!strcmp(value, "q4_0"))
+        return GGML_TYPE_Q4_0;
+    if (!strcmp(value, "iq4_nl"))
+        return GGML_TYPE_IQ4_NL;
+    bad(flag);
+}
+
 static bool is_valid_chat_template(const char *tmpl) {
     llama_chat_message chat[] = {{"user", "test"}};
     return llama_chat_apply_template(nullptr, tmpl, chat, 1, true, nullptr, 0) >= 0;
@@ -268,6 +305,24 @@ void llamafile_get_flags(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(flag, "--queue-depth")) {
+            if (i == argc)
+                missing("--queue-depth");
+            FLAG_queue_depth = atoi(argv[i++]);
+            if (FLAG_queue_depth < 1)
+                error("--queue-depth must be at least 1");
+            continue;
+        }
+
+        if (!strcmp(flag, "--queue-timeout")) {
+            if (i == argc)
+                missing("--queue-timeout");
+            FLAG_queue_timeout = atoi(argv[i++]);
+            if (FLAG_queue_timeout < 1)
+                error("--queue-timeout must be at least 1");
+            continue;
+        }
+
         if (!strcmp(flag, "--token-burst")) {
             if (i == argc)
                 missing("--token-burst");
@@ -386,6 +441,32 @@ void llamafile_get_flags(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(flag, "-ctk") || !strcmp(flag, "--cache-type-k")) {
+            if (i == argc)
+                missing("--cache-type-k");
+            FLAG_cache_type_k = parse_cache_type("--cache-type-k", argv[i++]);
+            continue;
+        }
+
+        if (!strcmp(flag, "-ctv") || !strcmp(flag, "--cache-type-v")) {
+            if (i == argc)
+                missing("--cache-type-v");
+            FLAG_cache_type_v = parse_cache_type("--cache-type-v", argv[i++]);
+            continue;
+        }
+
+        if (!strcmp(flag, "--kv-size")) {
+            char *ep;
+            if (i == argc)
+                missing("--kv-size");
+            FLAG_kv_size = strtol(argv[i++], &ep, 10);
+            if (*ep == 'k')
+                FLAG_kv_size *= 1024;
+            if (FLAG_kv_size < 0)
+                error("--kv-size can't be negative");
+            continue;
+        }
+
         if (!strcmp(flag, "--chat-template")) {
             if (i == argc)
                 missing("--chat-template");
@@ -409,6 +490,27 @@ void llamafile_get_flags(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(flag, "--models")) {
+            if (i == argc)
+                missing("--models");
+            FLAG_models = argv[i++];
+            continue;
+        }
+
+        if (!strcmp(flag, "--lora")) {
+            if (i == argc)
+                missing("--lora");
+            FLAG_lora = argv[i++];
+            continue;
+        }
+
+        if (!strcmp(flag, "--model-budget")) {
+            if (i == argc)
+                missing("--model-budget");
+            FLAG_model_budget = atoi(argv[i++]);
+            continue;
+        }
+
         if (!strcmp(flag, "-mm") || !strcmp(flag, "--mmproj")) {
             if (i == argc)
                 missing("--mmproj");
@@ -451,6 +553,48 @@ void llamafile_get_flags(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(flag, "--spill")) {
+            if (i == argc)
+                missing("--spill");
+            FLAG_spill = argv[i++];
+            continue;
+        }
+
+        if (!strcmp(flag, "--spill-size")) {
+            if (i == argc)
+                missing("--spill-size");
+            FLAG_spill_size = atoi(argv[i++]);
+            continue;
+        }
+
+        if (!strcmp(flag, "--draft")) {
+            if (i == argc)
+                missing("--draft");
+            FLAG_draft = atoi(argv[i++]);
+            continue;
+        }
+
+        if (!strcmp(flag, "--image-cache")) {
+            if (i == argc)
+                missing("--image-cache");
+            FLAG_image_cache = atoi(argv[i++]);
+            continue;
+        }
+
+        if (!strcmp(flag, "--prefix-cache")) {
+            if (i == argc)
+                missing("--prefix-cache");
+            FLAG_prefix_cache = atoi(argv[i++]);
+            continue;
+        }
+
+        if (!strcmp(flag, "--step-budget")) {
+            if (i == argc)
+                missing("--step-budget");
+            FLAG_step_budget = atoi(argv[i++]);
+            continue;
+        }
+
         if (!strcmp(flag, "-fa") || !strcmp(flag, "--flash-attn")) {
             if (i == argc)
                 missing("--flash-attn");
@@ -504,6 +648,11 @@ void llamafile_get_flags(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(flag, "--repack")) {
+            FLAG_repack = true;
+            continue;
+        }
+
         //////////////////////////////////////////////////////////////////////
         // gpu flags
 
@@ -590,6 +739,10 @@ void llamafile_get_flags(int argc, char **argv) {
     if (!FLAG_model)
         required("--model");
 
+    if (FLAG_cache_type_v != GGML_TYPE_F16 && FLAG_cache_type_v != GGML_TYPE_BF16 &&
+        FLAG_cache_type_v != GGML_TYPE_F32 && !FLAG_flash_attn)
+        error("quantized --cache-type-v requires --flash-attn");
+
     FLAGS_READY = true;
     FLAG_n_gpu_layers = llamafile_gpu_layers(FLAG_n_gpu_layers);
 }
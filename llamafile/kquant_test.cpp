@@ -0,0 +1,125 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llama.cpp/ggml-quants.h"
+#include "llama.cpp/ggml-vector.h"
+#include "llama.cpp/ggml.h"
+#include "numba.h"
+#include "sgemm.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+// checks llamafile_sgemm() on q4_K, q5_K and q6_K weights against the
+// dot products of the same rows after dequantize_row_q*_K().
+//
+// batches of 128+ columns are what tinyBLAS_K_AVX2 gets used for, on
+// x86 cpus without avx512 vnni. the shapes leave partial panels of RM
+// rows and tiles of RN columns. they also go beyond the KC super-blocks
+// that get unpacked at a time, and the NC columns swept per unpacking,
+// so results are accumulated over more than one pass.
+
+#define KC 8
+#define NC 256
+
+static const int kRows[] = {1, 3, 4, 7, 13};
+static const int kCols[] = {128, 129, 130, 131, 133, NC + 5};
+static const int kBlocks[] = {1, KC, KC + 1, KC * 2 + 4};
+static const int kThreads[] = {1, 3};
+
+typedef void dequantize_f(const void *, float *, int64_t);
+
+static const struct {
+    ggml_type type;
+    size_t size;
+    dequantize_f *dequantize;
+} kTypes[] = {
+    {GGML_TYPE_Q4_K, sizeof(block_q4_K), (dequantize_f *)dequantize_row_q4_K},
+    {GGML_TYPE_Q5_K, sizeof(block_q5_K), (dequantize_f *)dequantize_row_q5_K},
+    {GGML_TYPE_Q6_K, sizeof(block_q6_K), (dequantize_f *)dequantize_row_q6_K},
+};
+
+static int test(int t, int m, int n, int k) {
+    long K = (long)k * QK_K;
+    size_t sa = kTypes[t].size * k;
+    size_t sb = sizeof(block_q8_K) * k;
+    float *fa = new float[m * K];
+    float *fb = new float[n * K];
+    char *A = new char[m * sa];
+    char *B = new char[n * sb];
+    float *C = new float[m * n];
+    randomize(fa, m * K);
+    randomize(fb, n * K);
+    ggml_quantize_chunk(kTypes[t].type, fa, A, 0, m, K, nullptr);
+    for (int j = 0; j < n; ++j)
+        quantize_row_q8_K(fb + j * K, B + j * sb, K);
+    for (int i = 0; i < m; ++i)
+        kTypes[t].dequantize(A + i * sa, fa + i * K, K);
+    for (int j = 0; j < n; ++j)
+        dequantize_row_q8_K((const block_q8_K *)(B + j * sb), fb + j * K, K);
+
+    int rc = 0;
+    for (int nth : kThreads) {
+        for (int i = 0; i < m * n; ++i)
+            C[i] = NAN;
+        for (int ith = 0; ith < nth; ++ith)
+            if (!llamafile_sgemm(m, n, k, A, k, B, k, C, m, ith, nth, kTypes[t].type,
+                                 GGML_TYPE_Q8_K, GGML_TYPE_F32))
+                rc = -1; // not supported on this cpu
+        for (int j = 0; !rc && j < n; ++j) {
+            for (int i = 0; i < m; ++i) {
+                float want;
+                ggml_vec_dot_f32(K, &want, 0, fa + i * K, 0, fb + j * K, 0, 1);
+                float got = C[m * j + i];
+                if (!(std::fabs(got - want) <= 1e-3f * (1 + std::fabs(want)))) {
+                    fprintf(stderr,
+                            "%s:%d: %s m=%d n=%d k=%d nth=%d C[%d,%d] is %g but wanted %g\n",
+                            __FILE__, __LINE__, ggml_type_name(kTypes[t].type), m, n, k, nth, i,
+                            j, got, want);
+                    rc = 1;
+                    break;
+                }
+            }
+        }
+        if (rc)
+            break;
+    }
+
+    delete[] C;
+    delete[] B;
+    delete[] A;
+    delete[] fb;
+    delete[] fa;
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    for (int t = 0; t < (int)(sizeof(kTypes) / sizeof(*kTypes)); ++t)
+        for (int m : kRows)
+            for (int n : kCols)
+                for (int k : kBlocks)
+                    switch (test(t, m, n, k)) {
+                    case 0:
+                        break;
+                    case -1:
+                        fprintf(stderr, "%s: k-quant sgemm not supported on this cpu\n", argv[0]);
+                        return 0;
+                    default:
+                        return 1;
+                    }
+    return 0;
+}
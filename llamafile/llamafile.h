@@ -19,6 +19,7 @@ extern bool FLAG_nocompile;
 extern bool FLAG_nologo;
 extern bool FLAG_precise;
 extern bool FLAG_recompile;
+extern bool FLAG_repack;
 extern bool FLAG_tinyblas;
 extern bool FLAG_trace;
 extern bool FLAG_trap;
@@ -29,9 +30,12 @@ extern const char *FLAG_db_startup_sql;
 extern const char *FLAG_file;
 extern const char *FLAG_ip_header;
 extern const char *FLAG_listen;
+extern const char *FLAG_lora;
 extern const char *FLAG_mmproj;
 extern const char *FLAG_model;
+extern const char *FLAG_models;
 extern const char *FLAG_prompt;
+extern const char *FLAG_spill;
 extern const char *FLAG_url_prefix;
 extern const char *FLAG_www_root;
 extern double FLAG_token_rate;
@@ -40,17 +44,28 @@ extern float FLAG_presence_penalty;
 extern float FLAG_temperature;
 extern float FLAG_top_p;
 extern int FLAG_batch;
+extern int FLAG_cache_type_k;
+extern int FLAG_cache_type_v;
 extern int FLAG_ctx_size;
+extern int FLAG_draft;
 extern int FLAG_flash_attn;
 extern int FLAG_gpu;
 extern int FLAG_gpu;
 extern int FLAG_http_ibuf_size;
 extern int FLAG_http_obuf_size;
+extern int FLAG_image_cache;
 extern int FLAG_keepalive;
+extern int FLAG_kv_size;
 extern int FLAG_main_gpu;
+extern int FLAG_model_budget;
 extern int FLAG_n_gpu_layers;
+extern int FLAG_prefix_cache;
+extern int FLAG_queue_depth;
+extern int FLAG_queue_timeout;
 extern int FLAG_slots;
+extern int FLAG_spill_size;
 extern int FLAG_split_mode;
+extern int FLAG_step_budget;
 extern int FLAG_threads;
 extern int FLAG_threads_batch;
 extern int FLAG_token_burst;
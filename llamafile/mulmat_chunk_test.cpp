@@ -0,0 +1,211 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llama.cpp/cores.h"
+#include "llama.cpp/ggml.h"
+#include "numba.h"
+#include <algorithm>
+#include <atomic>
+#include <cosmo.h>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <unistd.h>
+
+// checks ggml_compute_forward_mul_mat() when threads finish out of order
+//
+// mul_mat ops hand out their jobs with a counter shared by all threads
+// in the graph, so each op has to reset it without losing the claims of
+// threads that are still working on the op before it. the results must
+// be bit identical to a single threaded run, since every job computes
+// the same elements no matter which thread claims it.
+//
+// the first graph precedes each mul_mat with an op where every thread
+// except 0 is busy, so thread 0 goes to sleep at the barrier and wakes
+// up last. the other threads will then have claimed jobs of the next
+// mul_mat before thread 0 gets to it.
+//
+// the second graph runs its mul_mats back to back, while a helper thread
+// keeps interrupting every thread except 0 with a signal whose handler
+// spins. thread 0 finishes its claims of each op first, while the rest
+// are still inside llamafile_sgemm() holding jobs they claimed.
+//
+// more threads are used than there are cpus so preemption helps too.
+
+#define ITERATIONS 50
+#define K 256
+#define N 24
+#define MAX_THREADS 256
+
+static const struct {
+    int m;
+    int batch;
+    ggml_type type;
+} kOps[] = {
+    {64, 1, GGML_TYPE_F32},  {200, 5, GGML_TYPE_F16}, {48, 2, GGML_TYPE_F32},
+    {520, 1, GGML_TYPE_F16}, {8, 7, GGML_TYPE_F32},   {128, 3, GGML_TYPE_F16},
+};
+
+constexpr int n_ops = sizeof(kOps) / sizeof(*kOps);
+
+static pthread_t g_workers[MAX_THREADS];
+static std::atomic_bool g_enlisted[MAX_THREADS];
+static std::atomic_bool g_stalling;
+static std::atomic_bool g_signaling;
+static std::atomic_bool g_done;
+
+static void spin(int micros) {
+    struct timespec deadline = timespec_add(timespec_mono(), timespec_frommicros(micros));
+    while (timespec_cmp(timespec_mono(), deadline) < 0) {
+    }
+}
+
+static void stall(ggml_tensor *dst, const ggml_tensor *a, int ith, int nth, void *userdata) {
+    long n = ggml_nrows(a);
+    for (long i = ith; i < n; i += nth)
+        memcpy((char *)dst->data + i * dst->nb[1], (char *)a->data + i * a->nb[1], a->nb[1]);
+    if (ith)
+        spin(500);
+}
+
+static void on_interrupt(int sig) {
+    spin(200);
+}
+
+// first op of the second graph. lets the helper thread know who to
+// interrupt, since ggml creates new threads for every graph it runs.
+static void enlist(ggml_tensor *dst, const ggml_tensor *a, int ith, int nth, void *userdata) {
+    if (ith && ith < MAX_THREADS) {
+        g_workers[ith] = pthread_self();
+        g_enlisted[ith] = true;
+    }
+}
+
+// last op of the second graph. waits for the helper thread to stop
+// signaling, so it never signals a thread that has exited.
+static void dismiss(ggml_tensor *dst, const ggml_tensor *a, int ith, int nth, void *userdata) {
+    if (!ith) {
+        g_stalling = false;
+        while (g_signaling) {
+        }
+        for (int i = 0; i < MAX_THREADS; ++i)
+            g_enlisted[i] = false;
+    }
+}
+
+static void *interrupter(void *arg) {
+    while (!g_done) {
+        g_signaling = true;
+        if (g_stalling)
+            for (int i = 1; i < MAX_THREADS; ++i)
+                if (g_enlisted[i])
+                    pthread_kill(g_workers[i], SIGUSR1);
+        g_signaling = false;
+        usleep(100);
+    }
+    return nullptr;
+}
+
+static void fill(ggml_tensor *t) {
+    long n = ggml_nelements(t);
+    if (t->type == GGML_TYPE_F16) {
+        for (long i = 0; i < n; ++i)
+            ((ggml_fp16_t *)t->data)[i] = ggml_fp32_to_fp16(numba());
+    } else {
+        for (long i = 0; i < n; ++i)
+            ((float *)t->data)[i] = numba();
+    }
+}
+
+static int test(bool back_to_back) {
+    ggml_init_params params = {256 * 1024 * 1024, nullptr, false};
+    ggml_context *ctx = ggml_init(params);
+    ggml_cgraph *gf = ggml_new_graph(ctx);
+    ggml_tensor *flag = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
+    ggml_tensor *out[n_ops];
+    float *want[n_ops];
+    if (back_to_back)
+        ggml_build_forward_expand(
+            gf, ggml_map_custom1(ctx, flag, enlist, GGML_N_TASKS_MAX, nullptr));
+    for (int i = 0; i < n_ops; ++i) {
+        ggml_tensor *w = ggml_new_tensor_3d(ctx, kOps[i].type, K, kOps[i].m, kOps[i].batch);
+        ggml_tensor *x = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, K, N, kOps[i].batch);
+        fill(w);
+        fill(x);
+        if (!back_to_back)
+            x = ggml_map_custom1(ctx, x, stall, GGML_N_TASKS_MAX, nullptr);
+        out[i] = ggml_mul_mat(ctx, w, x);
+        ggml_build_forward_expand(gf, out[i]);
+    }
+    if (back_to_back)
+        ggml_build_forward_expand(
+            gf, ggml_map_custom1(ctx, flag, dismiss, GGML_N_TASKS_MAX, nullptr));
+
+    if (ggml_graph_compute_with_ctx(ctx, gf, 1) != GGML_STATUS_SUCCESS)
+        return 1;
+    for (int i = 0; i < n_ops; ++i) {
+        want[i] = new float[ggml_nelements(out[i])];
+        memcpy(want[i], out[i]->data, ggml_nbytes(out[i]));
+    }
+
+    int rc = 0;
+    int nth = std::min(cpu_get_num_math() * 2, MAX_THREADS);
+    for (int it = 0; !rc && it < ITERATIONS; ++it) {
+        for (int i = 0; i < n_ops; ++i)
+            memset(out[i]->data, -1, ggml_nbytes(out[i])); // nan
+        g_stalling = back_to_back;
+        if (ggml_graph_compute_with_ctx(ctx, gf, nth) != GGML_STATUS_SUCCESS) {
+            rc = 2;
+            break;
+        }
+        for (int i = 0; !rc && i < n_ops; ++i) {
+            const float *got = (const float *)out[i]->data;
+            for (long j = 0; j < ggml_nelements(out[i]); ++j) {
+                if (memcmp(&got[j], &want[i][j], sizeof(float))) {
+                    fprintf(stderr, "%s:%d: op %d element %ld is %g but wanted %g (nth=%d%s)\n",
+                            __FILE__, __LINE__, i, j, got[j], want[i][j], nth,
+                            back_to_back ? ", back to back" : "");
+                    rc = 3;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < n_ops; ++i)
+        delete[] want[i];
+    ggml_free(ctx);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    int rc;
+    struct sigaction sa = {};
+    sa.sa_handler = on_interrupt;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, nullptr);
+    pthread_t th;
+    if (pthread_create(&th, nullptr, interrupter, nullptr))
+        return 4;
+    if (!(rc = test(false)))
+        rc = test(true);
+    g_done = true;
+    pthread_join(th, nullptr);
+    return rc;
+}
@@ -0,0 +1,107 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llama.cpp/ggml.h"
+#include "numba.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+// checks that ggml_repack_q4_0_8x8() weights multiply the same as the
+// q4_0 weights they came from. on x86 with avx2 this compares the
+// tinyBLAS_Q4_0_8X8_AVX2 kernel against tinyBLAS_Q0_AVX2. weights whose
+// row count isn't a multiple of 8 must be left alone.
+
+#define K 512
+#define NTH 4
+
+static const int kRows[] = {8, 13, 64, 100, 200, 1};
+static const int kCols[] = {1, 3, 7, 16, 33};
+
+static float *mul_mat(ggml_tensor *w, const float *x, int n) {
+    ggml_init_params params = {64 * 1024 * 1024, nullptr, false};
+    ggml_context *ctx = ggml_init(params);
+    ggml_tensor *b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, K, n);
+    memcpy(b->data, x, ggml_nbytes(b));
+    ggml_tensor *a = ggml_new_tensor_2d(ctx, w->type, K, w->ne[1]);
+    memcpy(a->data, w->data, ggml_nbytes(w));
+    ggml_tensor *c = ggml_mul_mat(ctx, a, b);
+    ggml_cgraph *gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, c);
+    float *res = nullptr;
+    if (ggml_graph_compute_with_ctx(ctx, gf, NTH) == GGML_STATUS_SUCCESS) {
+        res = new float[ggml_nelements(c)];
+        memcpy(res, c->data, ggml_nbytes(c));
+    }
+    ggml_free(ctx);
+    return res;
+}
+
+static int test(int m, int n) {
+    ggml_init_params params = {16 * 1024 * 1024, nullptr, false};
+    ggml_context *ctx = ggml_init(params);
+    float *w = new float[K * m];
+    float *x = new float[K * n];
+    randomize(w, K * m);
+    randomize(x, K * n);
+    ggml_tensor *q = ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, K, m);
+    ggml_quantize_chunk(GGML_TYPE_Q4_0, w, q->data, 0, m, K, nullptr);
+
+    int rc = 0;
+    float *want = mul_mat(q, x, n);
+    if (!want) {
+        rc = 1;
+    } else if (ggml_repack_q4_0_8x8(q)) {
+        if (m % 8 == 0 || q->type != GGML_TYPE_Q4_0) {
+            fprintf(stderr, "%s:%d: repack of %d rows failed\n", __FILE__, __LINE__, m);
+            rc = 2;
+        }
+    } else if (m % 8) {
+        fprintf(stderr, "%s:%d: repacked %d rows\n", __FILE__, __LINE__, m);
+        rc = 3;
+    } else if (q->type != GGML_TYPE_Q4_0_8_8) {
+        rc = 4;
+    } else {
+        float *got = mul_mat(q, x, n);
+        if (!got)
+            rc = 5;
+        for (int i = 0; got && i < m * n; ++i) {
+            if (!(std::fabs(got[i] - want[i]) <= 1e-3f * (1 + std::fabs(want[i])))) {
+                fprintf(stderr, "%s:%d: m=%d n=%d element %d is %g but wanted %g\n", __FILE__,
+                        __LINE__, m, n, i, got[i], want[i]);
+                rc = 6;
+                break;
+            }
+        }
+        delete[] got;
+    }
+
+    delete[] want;
+    delete[] x;
+    delete[] w;
+    ggml_free(ctx);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    int rc;
+    for (int m : kRows)
+        for (int n : kCols)
+            if ((rc = test(m, n)))
+                return rc;
+    return 0;
+}
@@ -22,3 +22,5 @@ CREATE TABLE messages (
     frequency_penalty REAL,
     FOREIGN KEY (chat_id) REFERENCES chats(id)
 );
+
+CREATE INDEX messages_chat_id ON messages (chat_id, id);
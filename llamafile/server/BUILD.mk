@@ -24,6 +24,7 @@ o/$(MODE)/llamafile/server/main:						\
 		o/$(MODE)/third_party/double-conversion/double-conversion.a	\
 		o/$(MODE)/third_party/stb/stb.a					\
 		o/$(MODE)/third_party/sqlite/sqlite3.a				\
+		o/$(MODE)/third_party/mbedtls/mbedtls.a				\
 		$(LLAMAFILE_SERVER_ASSETS:%=o/$(MODE)/%.zip.o)			\
 
 # turn /zip/llamafile/server/www/...
@@ -36,16 +37,30 @@ o/$(MODE)/llamafile/server/atom_test:						\
 		o/$(MODE)/llamafile/server/atom_test.o				\
 		o/$(MODE)/llamafile/server/atom.o				\
 		o/$(MODE)/llamafile/server/image.o				\
+		o/$(MODE)/third_party/mbedtls/mbedtls.a				\
 
 o/$(MODE)/llamafile/server/image_test:						\
 		o/$(MODE)/llamafile/server/image_test.o				\
 		o/$(MODE)/llamafile/server/image.o				\
+		o/$(MODE)/third_party/mbedtls/mbedtls.a				\
 
 o/$(MODE)/llamafile/server/fastjson_test:					\
 		o/$(MODE)/llamafile/server/fastjson_test.o			\
 		o/$(MODE)/llamafile/server/fastjson.o				\
 		o/$(MODE)/double-conversion/double-conversion.a			\
 
+o/$(MODE)/llamafile/server/fairqueue_test:					\
+		o/$(MODE)/llamafile/server/fairqueue_test.o			\
+		o/$(MODE)/llamafile/server/fairqueue.o				\
+
+o/$(MODE)/llamafile/server/histogram_test:					\
+		o/$(MODE)/llamafile/server/histogram_test.o			\
+		o/$(MODE)/llamafile/server/histogram.o				\
+
+o/$(MODE)/llamafile/server/stopmatcher_test:					\
+		o/$(MODE)/llamafile/server/stopmatcher_test.o			\
+		o/$(MODE)/llamafile/server/stopmatcher.o			\
+
 o/$(MODE)/llamafile/server/tokenbucket_test:					\
 		o/$(MODE)/llamafile/server/tokenbucket_test.o			\
 		o/$(MODE)/llamafile/server/tokenbucket.o			\
@@ -57,5 +72,8 @@ o/$(MODE)/llamafile/server:							\
 		o/$(MODE)/llamafile/server/main					\
 		o/$(MODE)/llamafile/server/atom_test.runs			\
 		o/$(MODE)/llamafile/server/fastjson_test.runs			\
+		o/$(MODE)/llamafile/server/fairqueue_test.runs			\
+		o/$(MODE)/llamafile/server/histogram_test.runs			\
 		o/$(MODE)/llamafile/server/image_test.runs			\
+		o/$(MODE)/llamafile/server/stopmatcher_test.runs		\
 		o/$(MODE)/llamafile/server/tokenbucket_test.runs		\
@@ -0,0 +1,120 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "client.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/server/atom.h"
+#include "llamafile/server/log.h"
+#include "llamafile/server/metrics.h"
+#include "llamafile/server/models.h"
+#include "llamafile/server/server.h"
+#include "llamafile/server/slots.h"
+#include "llamafile/server/worker.h"
+#include <cstdio>
+
+namespace lf {
+namespace server {
+
+// how many tokens we guess a completion will generate if unbounded
+#define DEFAULT_COMPLETION_TOKENS 256
+
+// returns name of whoever should be charged for this request
+//
+// api keys and the user field are only believed when the request came
+// from a trusted network, e.g. a gateway, since anyone else could make
+// up a new one for each request to get more than their fair share.
+std::string
+Client::tenant(std::string_view user)
+{
+    if (effective_ip_trusted_) {
+        std::string_view auth = get_header("Authorization");
+        if (auth.starts_with("Bearer ") && auth.size() > 7)
+            return "key:" + std::string(auth.substr(7));
+        if (!user.empty())
+            return "user:" + std::string(user);
+    }
+    char buf[32];
+    unsigned ip = effective_ip_;
+    if (FLAG_token_cidr < 32)
+        ip &= ~(0xffffffffu >> FLAG_token_cidr);
+    snprintf(buf,
+             sizeof(buf),
+             "ip:%u.%u.%u.%u/%d",
+             ip >> 24,
+             ip >> 16 & 255,
+             ip >> 8 & 255,
+             ip & 255,
+             FLAG_token_cidr);
+    return buf;
+}
+
+// sends 429 response telling client when to try again
+//
+// after this function is called, the handler must return control.
+bool
+Client::send_busy(int retry_after)
+{
+    SLOG("error 429 retry after %d seconds", retry_after);
+    metrics_count(kRejectedRequests, 1);
+    char* p = append_http_response_message(obuf_.p, 429);
+    p = stpcpy(p, "Retry-After: ");
+    p = FormatInt32(p, retry_after);
+    p = stpcpy(p, "\r\n");
+    (void)!send_response(obuf_.p, p, "Too Many Requests\r\n");
+    return false;
+}
+
+// waits until request is admitted, and takes `n` slots for it
+//
+// the request is charged for its prompt, plus `max_tokens` for each of
+// the `n` choices that'll be generated.
+//
+// @param user is the openai user field, which may be empty
+// @param max_tokens is the openai field, or negative if unbounded
+// @return false if an error response was sent or client hung up
+bool
+Client::admit(const std::vector<Atom>& atoms,
+              Slot** slots,
+              int n,
+              std::string_view user,
+              long max_tokens)
+{
+    if (max_tokens < 0)
+        max_tokens = DEFAULT_COMPLETION_TOKENS;
+    Ticket ticket;
+    ticket.tenant = tenant(user);
+    ticket.priority = priority_;
+    ticket.cost = atoms.size() + (double)n * max_tokens;
+    ticket.n = n;
+    ticket.fd = fd_;
+    ticket.deadline = Slots::deadline(priority_);
+    Slots* all = bound_->slots_;
+    switch (all->take(atoms, lora_, slots, &ticket)) {
+        case Slots::admitted:
+            return true;
+        case Slots::too_many_slots:
+            return send_error(400, "n can't exceed the number of slots");
+        case Slots::hung_up:
+            close_connection_ = true;
+            return false;
+        default:
+            return send_busy(all->retry_after());
+    }
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,154 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "assets.h"
+#include "llamafile/server/log.h"
+#include <cosmo.h>
+#include <sys/stat.h>
+#include <third_party/zlib/zlib.h>
+#include <unistd.h>
+
+namespace lf {
+namespace server {
+
+/**
+ * @fileoverview Cache of static assets embedded in the executable.
+ *
+ * The files under /zip/ can't change while the server is running, so
+ * the first request for one reads it into memory, computes its ETag,
+ * and precomputes a gzip encoding, which all later requests share. The
+ * web ui is served this way. Brotli isn't offered, since we don't have
+ * a brotli encoder available, and gzip gets most of the benefit.
+ */
+
+static std::string
+gzip(const std::string& data)
+{
+    z_stream zs = {};
+    std::string res;
+    if (deflateInit2(&zs,
+                     Z_BEST_COMPRESSION,
+                     Z_DEFLATED,
+                     MAX_WBITS + 16, // gzip header
+                     9,
+                     Z_DEFAULT_STRATEGY))
+        return res;
+    res.resize(deflateBound(&zs, data.size()));
+    zs.next_in = (Bytef*)data.data();
+    zs.avail_in = data.size();
+    zs.next_out = (Bytef*)res.data();
+    zs.avail_out = res.size();
+    if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+        res.resize(zs.total_out);
+    } else {
+        res.clear();
+    }
+    deflateEnd(&zs);
+    return res;
+}
+
+static bool
+read_fully(int fd, std::string* data, size_t size)
+{
+    data->resize(size);
+    for (size_t i = 0; i < size;) {
+        ssize_t got = pread(fd, data->data() + i, size - i, i);
+        if (got <= 0)
+            return false;
+        i += got;
+    }
+    return true;
+}
+
+Assets::Assets()
+{
+    pthread_mutex_init(&lock_, 0);
+}
+
+Assets::~Assets()
+{
+    pthread_mutex_destroy(&lock_);
+}
+
+// returns cached copy of file, loading it if needed
+//
+// assets are only loaded if there's room left in the cache for them, so
+// that requests for a file that won't be kept don't keep reading it and
+// compressing it all over again.
+//
+// @return asset or null if it won't fit in the cache
+std::shared_ptr<const Asset>
+Assets::get(const std::string& path, int fd, const struct stat& st)
+{
+    if ((size_t)st.st_size > kMaxFileSize)
+        return nullptr;
+
+    // check if we've already loaded this asset
+    std::shared_ptr<const Asset> res;
+    size_t room;
+    pthread_mutex_lock(&lock_);
+    room = kMaxCacheSize - bytes_;
+    auto it = cache_.find(path);
+    if (it != cache_.end()) {
+        if (it->second->mtime == st.st_mtime &&
+            it->second->data.size() == (size_t)st.st_size)
+            res = it->second;
+        else
+            room += it->second->data.size() + it->second->gzip.size();
+    }
+    pthread_mutex_unlock(&lock_);
+    if (res)
+        return res;
+    if ((size_t)st.st_size > room)
+        return nullptr;
+
+    // load asset without holding lock
+    std::shared_ptr<Asset> asset = std::make_shared<Asset>();
+    asset->mtime = st.st_mtime;
+    if (!read_fully(fd, &asset->data, st.st_size)) {
+        SLOG("failed to read %s: %m", path.c_str());
+        return nullptr;
+    }
+    char etag[32];
+    uint64_t hash = __fnv(asset->data.data(), asset->data.size());
+    snprintf(etag, sizeof(etag), "\"%016lx\"", (unsigned long)hash);
+    asset->etag = etag;
+    std::string z = gzip(asset->data);
+    if (z.size() < asset->data.size() - asset->data.size() / 10)
+        asset->gzip = std::move(z);
+
+    // insert into cache unless it's filled up in the meantime. the gzip
+    // encoding gets dropped if it's the only thing that doesn't fit.
+    pthread_mutex_lock(&lock_);
+    it = cache_.find(path);
+    if (it != cache_.end()) {
+        bytes_ -= it->second->data.size() + it->second->gzip.size();
+        cache_.erase(it);
+    }
+    if (bytes_ + asset->data.size() + asset->gzip.size() > kMaxCacheSize)
+        std::string().swap(asset->gzip);
+    size_t size = asset->data.size() + asset->gzip.size();
+    if (bytes_ + size <= kMaxCacheSize) {
+        bytes_ += size;
+        cache_[path] = asset;
+    }
+    pthread_mutex_unlock(&lock_);
+    return asset;
+}
+
+} // namespace server
+} // namespace lf
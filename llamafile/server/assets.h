@@ -0,0 +1,58 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <string>
+
+struct stat;
+
+namespace lf {
+namespace server {
+
+// immutable in-memory copy of static file
+struct Asset
+{
+    int64_t mtime;
+    std::string etag; // quoted
+    std::string data;
+    std::string gzip; // empty if compression didn't help
+};
+
+// cache of static files that can't change, e.g. those under /zip/
+struct Assets
+{
+    static constexpr size_t kMaxFileSize = 8 * 1024 * 1024;
+    static constexpr size_t kMaxCacheSize = 64 * 1024 * 1024;
+
+    Assets();
+    ~Assets();
+    std::shared_ptr<const Asset> get(const std::string&,
+                                     int,
+                                     const struct stat&);
+
+  private:
+    pthread_mutex_t lock_;
+    size_t bytes_ = 0;
+    std::map<std::string, std::shared_ptr<const Asset>> cache_;
+};
+
+} // namespace server
+} // namespace lf
@@ -21,7 +21,9 @@
 #include "llamafile/llamafile.h"
 #include "llamafile/server/cleanup.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/models.h"
 #include "llamafile/server/server.h"
+#include "llamafile/server/slots.h"
 #include "llamafile/server/time.h"
 #include "llamafile/server/tokenbucket.h"
 #include "llamafile/server/utils.h"
@@ -73,15 +75,6 @@ on_http_cancel(Client* client)
 
 static ThreadLocal<Client> g_http_cancel(on_http_cancel);
 
-static const char*
-pick_content_type(const std::string_view& path)
-{
-    const char* ct = FindContentType(path.data(), path.size());
-    if (!ct)
-        ct = "application/octet-stream";
-    return ct;
-}
-
 Client::Client(llama_model* model)
   : model_(model)
   , cleanups_(nullptr)
@@ -143,26 +136,71 @@ Client::defer_cleanup(void (*func)(void*), void* arg)
     cleanups_ = clean;
 }
 
-void
+static void
+cleanup_model(void* arg)
+{
+    Client* client = (Client*)arg;
+    Models* models = client->worker_->server_->models_;
+    models->release(client->bound_);
+    client->bound_ = nullptr;
+    client->lora_ = nullptr;
+    client->model_ = models->primary_->model_;
+}
+
+// routes request to model named by its `model` field
+//
+// the model gets loaded if it isn't already, and it's kept loaded for
+// as long as this request is being served.
+bool
+Client::use_model(std::string_view name)
+{
+    Models* models = worker_->server_->models_;
+    if (!(bound_ = models->acquire(name)))
+        return send_error(503, "failed to load model");
+    defer_cleanup(cleanup_model, this);
+    model_ = bound_->model_;
+    return true;
+}
+
+// chooses lora adapter for request
+//
+// adapters are named by the `lora` field. if it's absent, then the
+// `model` field may name one instead, for clients that can only set
+// the model. either way the base model is the one that serves it.
+bool
+Client::use_lora(std::string_view lora, std::string_view model)
+{
+    if (lora.empty()) {
+        lora_ = bound_->lora(model);
+    } else if (!(lora_ = bound_->lora(lora))) {
+        return send_error(400, "unknown lora adapter");
+    }
+    return true;
+}
+
+// serves requests on connection
+//
+// @return true if connection should be given back to the poller to
+//     wait for the next request, or false if it should be closed
+bool
 Client::run()
 {
-    ibuf_.n = 0;
     for (;;) {
 
         // read headers
         clear();
         if (!read_request())
-            break;
+            return false;
 
         // process message
         if (!transport())
-            break;
+            return false;
 
         // synchronize message stream
         if (close_connection_)
-            break;
+            return false;
         if (!read_payload())
-            break;
+            return false;
 
         // move pipelined bytes back to beginning
         if (ibuf_.n == ibuf_.i) {
@@ -171,6 +209,10 @@ Client::run()
             memmove(ibuf_.p, ibuf_.p + ibuf_.i, ibuf_.n - ibuf_.i);
             ibuf_.n -= ibuf_.i;
         }
+
+        // don't tie up this thread while connection is idle
+        if (worker_->server_->poller_)
+            return true;
     }
 }
 
@@ -228,15 +270,28 @@ Client::transport()
         }
     }
 
-    if (get_header("X-Priority") == "batch") {
-        worker_->deprioritize();
-    } else if (!effective_ip_trusted_) {
+    std::string_view priority = get_header("X-Priority");
+    if (priority == "batch") {
+        priority_ = kPriorityBatch;
+    } else if (priority == "interactive" && effective_ip_trusted_) {
+        priority_ = kPriorityInteractive;
+    } else {
+        priority_ = kPriorityNormal;
+    }
+    if (!effective_ip_trusted_) {
         if (tokenbucket_acquire(client_ip_) > FLAG_token_burst) {
             SLOG("deprioritizing");
-            worker_->deprioritize();
+            priority_ = kPriorityBatch;
         }
     }
 
+    // shed load rather than interrupting clients we're already serving
+    if (overloaded_) {
+        close_connection_ = true;
+        return send_busy(
+          worker_->server_->models_->primary_->slots_->retry_after());
+    }
+
     if (msg_.version > 11) {
         close_connection_ = true;
         return send_error(505);
@@ -653,7 +708,7 @@ Client::dispatcher()
         p = append_http_response_message(p, 204);
         p = stpcpy(p, "Accept: */*\r\n");
         p = stpcpy(p, "Accept-Charset: utf-8\r\n");
-        p = stpcpy(p, "Allow: GET, POST, OPTIONS\r\n");
+        p = stpcpy(p, "Allow: GET, HEAD, POST, OPTIONS\r\n");
         for (const auto& h : FLAG_headers) {
             p = (char*)mempcpy(p, h.data(), h.size());
             p = stpcpy(p, "\r\n");
@@ -691,6 +746,10 @@ Client::dispatcher()
         return slotz();
     if (p1 == "flagz")
         return flagz();
+    if (p1 == "latencyz")
+        return latencyz();
+    if (p1 == "metrics")
+        return metrics();
 
     if (p1 == "db/chats" || p1 == "db/chats/")
         return db_chats();
@@ -707,82 +766,11 @@ Client::dispatcher()
     if (p1.starts_with("db/message/")) {
         int64_t id = atoi(p1.substr(strlen("db/message/")));
         if (id != -1)
-            return db_messages(id);
+            return db_message(id);
     }
 
     // serve static endpoints
-    int infd;
-    size_t size;
-    resolved_ = resolve(FLAG_www_root, p1);
-    for (;;) {
-        infd = open(resolved_.c_str(), O_RDONLY);
-        if (infd == -1) {
-            if (errno == ENOENT || errno == ENOTDIR) {
-                SLOG("path not found: %s", resolved_.c_str());
-                return send_error(404);
-            } else if (errno == EPERM || errno == EACCES) {
-                SLOG("path not authorized: %s", resolved_.c_str());
-                return send_error(401);
-            } else {
-                SLOG("%s: %s", strerror(errno), resolved_.c_str());
-                return send_error(500);
-            }
-        }
-        struct stat st;
-        if (fstat(infd, &st)) {
-            SLOG("%s: %s", strerror(errno), resolved_.c_str());
-            ::close(infd);
-            return send_error(500);
-        }
-        size = st.st_size;
-        if (S_ISREG(st.st_mode)) {
-            break;
-        } else if (S_ISDIR(st.st_mode)) {
-            ::close(infd);
-            resolved_ = resolve(resolved_, "index.html");
-        } else {
-            ::close(infd);
-            SLOG("won't serve special file: %s", resolved_.c_str());
-            return send_error(500);
-        }
-    }
-    defer_cleanup(cleanup_fildes, (void*)(intptr_t)infd);
-    char* p = append_http_response_message(obuf_.p, 200, "OK");
-    p = stpcpy(p, "Content-Type: ");
-    p = stpcpy(p, pick_content_type(resolved_));
-    p = stpcpy(p, "\r\n");
-    p = stpcpy(p, "Content-Length: ");
-    p = FormatInt64(p, size);
-    p = stpcpy(p, "\r\n");
-    p = stpcpy(p, "\r\n");
-    should_send_error_if_canceled_ = false;
-    if (!send(std::string_view(obuf_.p, p - obuf_.p)))
-        return false;
-    char buf[512];
-    size_t i, chunk;
-    for (i = 0; i < size; i += chunk) {
-        chunk = size - i;
-        if (chunk > sizeof(buf))
-            chunk = sizeof(buf);
-        ssize_t got = pread(infd, buf, chunk, i);
-        if (got == -1) {
-            SLOG("static asset pread failed: %s", strerror(errno));
-            close_connection_ = true;
-            return false;
-        }
-        if (got != chunk) {
-            SLOG("couldn't read full amount reading static asset");
-            close_connection_ = true;
-            return false;
-        }
-        if (!send_binary(buf, chunk)) {
-            close_connection_ = true;
-            return false;
-        }
-    }
-    SLOG("served %s", resolved_.c_str());
-    cleanup();
-    return true;
+    return static_file(p1);
 }
 
 std::string_view
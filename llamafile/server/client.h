@@ -17,6 +17,7 @@
 
 #pragma once
 #include "buffer.h"
+#include "fairqueue.h"
 #include <ctime>
 #include <libc/fmt/itoa.h>
 #include <libc/str/slice.h>
@@ -25,6 +26,7 @@
 #include <optional>
 #include <string>
 #include <sys/resource.h>
+#include <vector>
 
 #define HasHeader(H) (!!msg_.headers[H].a)
 #define HeaderData(H) (ibuf_.p + msg_.headers[H].a)
@@ -35,12 +37,20 @@
     SlicesEqualCase(S, strlen(S), HeaderData(H), HeaderLength(H))
 
 struct llama_model;
+struct llama_lora_adapter;
+
+namespace jt {
+class Json;
+}
 
 namespace lf {
 namespace server {
 
+class Atom;
 struct Cleanup;
+struct Model;
 struct Slot;
+struct Embedder;
 struct Worker;
 struct TokenizeParams;
 struct EmbeddingParams;
@@ -55,11 +65,17 @@ struct Client
     bool client_ip_trusted_ = false;
     bool effective_ip_trusted_ = false;
     bool close_connection_ = false;
+    bool overloaded_ = false; // set if we took the last idle worker
     bool should_send_error_if_canceled_;
+    Priority priority_ = kPriorityNormal;
     size_t unread_ = 0;
     Worker* worker_; // borrowed
     Slot* slot_ = nullptr; // owned or null
+    std::vector<Slot*> forks_; // owned
+    Embedder* embedder_ = nullptr; // owned or null
     llama_model* model_; // borrowed
+    Model* bound_ = nullptr; // model serving request, or null
+    llama_lora_adapter* lora_ = nullptr; // adapter for request, or null
     timespec message_started_;
     HttpMessage msg_;
     Url url_ = {};
@@ -74,7 +90,7 @@ struct Client
 
     explicit Client(llama_model*);
 
-    void run();
+    bool run();
     int close();
     void clear();
     void cleanup();
@@ -88,6 +104,11 @@ struct Client
     bool send_binary(const void*, size_t) __wur;
     void defer_cleanup(void (*)(void*), void*);
     bool send_error(int, const char* = nullptr);
+    bool send_busy(int);
+    bool use_model(std::string_view) __wur;
+    bool use_lora(std::string_view, std::string_view) __wur;
+    bool admit(const std::vector<Atom>&, Slot**, int, std::string_view, long);
+    std::string tenant(std::string_view);
     char* append_http_response_message(char*, int, const char* = nullptr);
     bool send_response(char*, char*, const std::string_view) __wur;
     bool send_response_start(char*, char*) __wur;
@@ -98,6 +119,9 @@ struct Client
     bool has_at_most_this_element(int, const std::string_view);
     std::string_view get_header(const std::string_view&);
     bool fun() __wur;
+    bool static_file(std::string_view) __wur;
+    bool send_file(int, long, long) __wur;
+    bool is_not_modified(const std::string_view&, int64_t);
 
     std::string_view path();
     std::optional<std::string_view> param(std::string_view);
@@ -119,6 +143,10 @@ struct Client
 
     bool slotz() __wur;
     bool flagz() __wur;
+    bool latencyz() __wur;
+    bool metrics() __wur;
+    bool get_page(int64_t*, int*) __wur;
+    bool send_page(jt::Json&, int) __wur;
     bool db_chat(int64_t) __wur;
     bool db_chats() __wur;
     bool db_message(int64_t) __wur;
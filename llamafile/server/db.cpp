@@ -20,25 +20,89 @@
 #include "llama.cpp/llama.h"
 #include "llamafile/llamafile.h"
 #include "llamafile/string.h"
+#include "llamafile/server/worker.h"
+#include <cctype>
 #include <string>
+#include <vector>
 
 namespace lf {
 namespace server {
 
+// default and maximum number of rows returned by a listing endpoint
+#define PAGE_LIMIT 100
+#define PAGE_LIMIT_MAX 1000
+
+static bool
+parse_int64(std::string_view s, int64_t* out)
+{
+    if (s.empty() || s.size() > 19)
+        return false;
+    int64_t x = 0;
+    for (char c : s) {
+        if (!isdigit(c))
+            return false;
+        x = x * 10 + (c - '0');
+    }
+    *out = x;
+    return true;
+}
+
+// reads `?before=ID&limit=N` query parameters of a listing endpoint
+bool
+Client::get_page(int64_t* before, int* limit)
+{
+    int64_t x;
+    *before = 0;
+    *limit = PAGE_LIMIT;
+    if (auto s = param("before")) {
+        if (!parse_int64(*s, &x))
+            return send_error(400, "before must be a row id");
+        *before = x;
+    }
+    if (auto s = param("limit")) {
+        if (!parse_int64(*s, &x) || !x || x > PAGE_LIMIT_MAX)
+            return send_error(400, "limit must be between 1 and 1000");
+        *limit = x;
+    }
+    return true;
+}
+
+// sends page of rows, linking to the next one if it might exist
+bool
+Client::send_page(jt::Json& rows, int limit)
+{
+    dump_ = rows.toStringPretty();
+    dump_ += '\n';
+    char* p = append_http_response_message(obuf_.p, 200);
+    p = stpcpy(p, "Content-Type: application/json\r\n");
+    if (rows.isArray() && rows.getArray().size() == (size_t)limit) {
+        jt::Json& last = rows.getArray().back();
+        if (last["id"].isLong()) {
+            p = stpcpy(p, "Link: <");
+            p = stpcpy(p, std::string(path()).c_str());
+            p = stpcpy(p, "?before=");
+            p = FormatInt64(p, last["id"].getLong());
+            p = stpcpy(p, "&limit=");
+            p = FormatInt32(p, limit);
+            p = stpcpy(p, ">; rel=\"next\"\r\n");
+        }
+    }
+    return send_response(obuf_.p, p, dump_);
+}
+
 bool
 Client::db_chats()
 {
     if (msg_.method == kHttpGet) {
-        sqlite3* db = db::open();
+        int limit;
+        int64_t before;
+        if (!get_page(&before, &limit))
+            return false;
+        sqlite3* db = worker_->db();
         if (!db)
             return send_error(500, "db::open failed");
-        jt::Json json = db::get_chats(db);
-        db::close(db);
-        dump_ = json.toStringPretty();
-        dump_ += '\n';
-        char* p = append_http_response_message(obuf_.p, 200);
-        p = stpcpy(p, "Content-Type: application/json\r\n");
-        return send_response(obuf_.p, p, dump_);
+        jt::Json json = db::get_chats(db, before, limit);
+        return send_page(json, limit);
     } else if (msg_.method == kHttpPut) {
         if (!HasHeader(kHttpContentType) ||
             !IsMimeType(HeaderData(kHttpContentType),
@@ -55,17 +119,14 @@ Client::db_chats()
             return send_error(400, "JSON body must be an object");
         if (!json["title"].isString())
             return send_error(400, "title must be a string");
-        sqlite3* db = db::open();
+        sqlite3* db = worker_->db();
         if (!db)
             return send_error(500, "db::open failed");
         int64_t chat_id =
           db::add_chat(db, FLAG_model, json["title"].getString());
-        if (chat_id == -1) {
-            db::close(db);
+        if (chat_id == -1)
             return send_error(500, "db::add_chat failed");
-        }
         jt::Json json2 = db::get_chat(db, chat_id);
-        db::close(db);
         dump_ = json2.toStringPretty();
         dump_ += '\n';
         char* p = append_http_response_message(obuf_.p, 200);
@@ -80,11 +141,10 @@ bool
 Client::db_chat(int64_t id)
 {
     if (msg_.method == kHttpGet) {
-        sqlite3* db = db::open();
+        sqlite3* db = worker_->db();
         if (!db)
             return send_error(500, "db::open failed");
         jt::Json json = db::get_chat(db, id);
-        db::close(db);
         dump_ = json.toStringPretty();
         dump_ += '\n';
         char* p = append_http_response_message(obuf_.p, 200);
@@ -106,15 +166,12 @@ Client::db_chat(int64_t id)
             return send_error(400, "JSON body must be an object");
         if (!json["title"].isString())
             return send_error(400, "title must be a string");
-        sqlite3* db = db::open();
+        sqlite3* db = worker_->db();
         if (!db)
             return send_error(500, "db::open failed");
-        if (!db::update_title(db, id, json["title"].getString())) {
-            db::close(db);
+        if (!db::update_title(db, id, json["title"].getString()))
             return send_error(500, "db::update_title failed");
-        }
         jt::Json json2 = db::get_chat(db, id);
-        db::close(db);
         dump_ = json2.toStringPretty();
         dump_ += '\n';
         char* p = append_http_response_message(obuf_.p, 200);
@@ -125,20 +182,45 @@ Client::db_chat(int64_t id)
     }
 }
 
+static const char*
+get_message(jt::Json& json, db::Message* msg)
+{
+    if (!json.isObject())
+        return "message must be an object";
+    if (!json["role"].isString())
+        return "role must be a string";
+    if (!json["content"].isString())
+        return "content must be a string";
+    if (!json["temperature"].isNumber())
+        return "temperature must be a number";
+    if (!json["top_p"].isNumber())
+        return "top_p must be a number";
+    if (!json["presence_penalty"].isNumber())
+        return "presence_penalty must be a number";
+    if (!json["frequency_penalty"].isNumber())
+        return "frequency_penalty must be a number";
+    msg->role = json["role"].getString();
+    msg->content = json["content"].getString();
+    msg->temperature = json["temperature"].getNumber();
+    msg->top_p = json["top_p"].getNumber();
+    msg->presence_penalty = json["presence_penalty"].getNumber();
+    msg->frequency_penalty = json["frequency_penalty"].getNumber();
+    return nullptr;
+}
+
 bool
 Client::db_messages(int64_t chat_id)
 {
     if (msg_.method == kHttpGet) {
-        sqlite3* db = db::open();
+        int limit;
+        int64_t before;
+        if (!get_page(&before, &limit))
+            return false;
+        sqlite3* db = worker_->db();
         if (!db)
             return send_error(500, "db::open failed");
-        jt::Json json = db::get_messages(db, chat_id);
-        db::close(db);
-        dump_ = json.toStringPretty();
-        dump_ += '\n';
-        char* p = append_http_response_message(obuf_.p, 200);
-        p = stpcpy(p, "Content-Type: application/json\r\n");
-        return send_response(obuf_.p, p, dump_);
+        jt::Json json = db::get_messages(db, chat_id, before, limit);
+        return send_page(json, limit);
     } else if (msg_.method == kHttpPut) {
         if (!HasHeader(kHttpContentType) ||
             !IsMimeType(HeaderData(kHttpContentType),
@@ -151,38 +233,54 @@ Client::db_messages(int64_t chat_id)
         auto [status, json] = jt::Json::parse(std::string(payload_));
         if (status != jt::Json::success)
             return send_error(400, jt::Json::StatusToString(status));
-        if (!json.isObject())
-            return send_error(400, "JSON body must be an object");
-        if (!json["role"].isString())
-            return send_error(400, "role must be a string");
-        if (!json["content"].isString())
-            return send_error(400, "content must be a string");
-        if (!json["temperature"].isNumber())
-            return send_error(400, "temperature must be a number");
-        if (!json["top_p"].isNumber())
-            return send_error(400, "top_p must be a number");
-        if (!json["presence_penalty"].isNumber())
-            return send_error(400, "presence_penalty must be a number");
-        if (!json["frequency_penalty"].isNumber())
-            return send_error(400, "frequency_penalty must be a number");
-        sqlite3* db = db::open();
+
+        // an array of messages is inserted in a single transaction
+        std::vector<db::Message> msgs;
+        if (json.isArray()) {
+            if (json.getArray().empty())
+                return send_error(400, "JSON array must not be empty");
+            if (json.getArray().size() > PAGE_LIMIT_MAX)
+                return send_error(400, "too many messages");
+            for (jt::Json& item : json.getArray()) {
+                const char* err;
+                msgs.emplace_back();
+                if ((err = get_message(item, &msgs.back())))
+                    return send_error(400, err);
+            }
+        } else if (json.isObject()) {
+            const char* err;
+            msgs.emplace_back();
+            if ((err = get_message(json, &msgs.back())))
+                return send_error(400, err);
+        } else {
+            return send_error(400, "JSON body must be an object or array");
+        }
+
+        sqlite3* db = worker_->db();
         if (!db)
             return send_error(500, "db::open failed");
-        int64_t chat_id =
-          db::add_message(db,
-                          chat_id,
-                          json["role"].getString(),
-                          json["content"].getString(),
-                          json["temperature"].getNumber(),
-                          json["top_p"].getNumber(),
-                          json["presence_penalty"].getNumber(),
-                          json["frequency_penalty"].getNumber());
-        if (chat_id == -1) {
-            db::close(db);
-            return send_error(500, "db::add_chat failed");
+        jt::Json json2;
+        if (json.isArray()) {
+            std::vector<int64_t> ids;
+            if (!db::add_messages(db, chat_id, msgs, &ids))
+                return send_error(500, "db::add_messages failed");
+            json2.setArray();
+            for (int64_t id : ids)
+                json2.getArray().push_back(db::get_message(db, id));
+        } else {
+            const db::Message& m = msgs[0];
+            int64_t message_id = db::add_message(db,
+                                                 chat_id,
+                                                 m.role,
+                                                 m.content,
+                                                 m.temperature,
+                                                 m.top_p,
+                                                 m.presence_penalty,
+                                                 m.frequency_penalty);
+            if (message_id == -1)
+                return send_error(500, "db::add_message failed");
+            json2 = db::get_message(db, message_id);
         }
-        jt::Json json2 = db::get_chat(db, chat_id);
-        db::close(db);
         dump_ = json2.toStringPretty();
         dump_ += '\n';
         char* p = append_http_response_message(obuf_.p, 200);
@@ -197,25 +295,21 @@ bool
 Client::db_message(int64_t id)
 {
     if (msg_.method == kHttpGet) {
-        sqlite3* db = db::open();
+        sqlite3* db = worker_->db();
         if (!db)
             return send_error(500, "db::open failed");
         jt::Json json = db::get_message(db, id);
-        db::close(db);
         dump_ = json.toStringPretty();
         dump_ += '\n';
         char* p = append_http_response_message(obuf_.p, 200);
         p = stpcpy(p, "Content-Type: application/json\r\n");
         return send_response(obuf_.p, p, dump_);
     } else if (msg_.method == kHttpDelete) {
-        sqlite3* db = db::open();
+        sqlite3* db = worker_->db();
         if (!db)
             return send_error(500, "db::open failed");
-        if (!db::delete_message(db, id)) {
-            db::close(db);
+        if (!db::delete_message(db, id))
             return send_error(500, "db::delete_message failed");
-        }
-        db::close(db);
         char* p = append_http_response_message(obuf_.p, 200);
         return send_response(obuf_.p, p, "");
     } else {
@@ -0,0 +1,219 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "drafter.h"
+#include "llama.cpp/llama.h"
+#include "llama.cpp/sampling.h"
+#include "llamafile/server/atom.h"
+#include "llamafile/server/slot.h"
+#include <algorithm>
+#include <pthread.h>
+
+// n-gram sizes used for lookup
+#define NGRAM_MIN 1
+#define NGRAM_MAX 4
+
+// shared cache is thrown away once it gets this big
+#define DYNAMIC_MAX 1000000
+
+namespace lf {
+namespace server {
+
+static pthread_mutex_t g_dynamic_lock = PTHREAD_MUTEX_INITIALIZER;
+static llama_ngram_cache g_dynamic;
+
+Drafter::Drafter(int n_draft) : n_draft_(n_draft)
+{
+}
+
+// contributes generated tokens to the shared cache
+Drafter::~Drafter()
+{
+    int cs;
+    if (!n_new_)
+        return;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+    pthread_mutex_lock(&g_dynamic_lock);
+    if (g_dynamic.size() > DYNAMIC_MAX)
+        g_dynamic.clear();
+    llama_ngram_cache_update(
+      g_dynamic, NGRAM_MIN, NGRAM_MAX, inp_, n_new_, false);
+    pthread_mutex_unlock(&g_dynamic_lock);
+    pthread_setcancelstate(cs, 0);
+}
+
+// learns the n-grams of a prompt
+//
+// only the tokens after the last image are considered, since drafting
+// across an image wouldn't make sense.
+void
+Drafter::start(const std::vector<Atom>& atoms)
+{
+    inp_.clear();
+    context_.clear();
+    for (const Atom& atom : atoms) {
+        if (atom.is_token()) {
+            inp_.emplace_back(atom.token());
+        } else if (atom.is_image()) {
+            inp_.clear();
+        }
+    }
+    llama_ngram_cache_update(
+      context_, NGRAM_MIN, NGRAM_MAX, inp_, inp_.size(), false);
+    n_new_ = 0;
+}
+
+// learns token that got appended to the conversation
+void
+Drafter::add(int token)
+{
+    inp_.emplace_back(token);
+    llama_ngram_cache_update(context_, NGRAM_MIN, NGRAM_MAX, inp_, 1, false);
+    ++n_new_;
+}
+
+// appends up to `max` guesses of what comes after added tokens
+void
+Drafter::draft(std::vector<int>* out, int max)
+{
+    int cs;
+    max = std::min(max, n_draft_);
+    if (max <= 0 || inp_.empty())
+        return;
+    std::vector<llama_token> draft = { inp_.back() };
+    llama_ngram_cache none; // we don't have corpus statistics to validate
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+    pthread_mutex_lock(&g_dynamic_lock);
+    llama_ngram_cache_draft(inp_,
+                            draft,
+                            max,
+                            NGRAM_MIN,
+                            NGRAM_MAX,
+                            context_,
+                            g_dynamic,
+                            none);
+    pthread_mutex_unlock(&g_dynamic_lock);
+    pthread_setcancelstate(cs, 0);
+    out->insert(out->end(), draft.begin() + 1, draft.end());
+}
+
+// evaluates the token speculate() left pending, if there is one
+//
+// this is for when a completion ends, since otherwise that token gets
+// evaluated along with the next draft.
+//
+// @return 0 on success, otherwise negative error code
+int
+Drafter::flush(Slot* slot)
+{
+    int rc;
+    if (pending_ == -1)
+        return 0;
+    llama_token id = pending_;
+    pending_ = -1;
+    if ((rc = slot->eval_token(id)) < 0)
+        return rc;
+    return 0;
+}
+
+// forgets the token speculate() left pending, e.g. on a stop sequence
+//
+// @return 1 if a token was pending, otherwise 0
+int
+Drafter::drop()
+{
+    if (pending_ == -1)
+        return 0;
+    pending_ = -1;
+    return 1;
+}
+
+// samples the next tokens of a completion and evaluates them
+//
+// the last token output by the previous call is evaluated, along with
+// whatever the drafter guesses comes after it, in a single step. each
+// guess is checked by sampling from logits of the token before it, and
+// guesses are accepted until the first one the sampler disagrees with.
+// what the sampler chose instead is output too, and the rejected guesses
+// are rewound. so the sampler draws exactly once per token that's
+// output, from the logits at its position, and the output is what it'd
+// be without speculation.
+//
+// the last token that was sampled is left pending in the drafter, so it
+// can lead the next step, rather than being evaluated on its own. on
+// the first call it's sampled from the logits of the slot instead. use
+// Drafter::flush() when the completion ends.
+//
+// at most `max` tokens are produced. they're appended to `ids`.
+//
+// @return number of tokens appended to ids, otherwise negative error
+int
+speculate(Slot* slot,
+          llama_sampling_context* sampler,
+          Drafter* drafter,
+          int max,
+          bool apply_grammar,
+          std::vector<int>* ids)
+{
+    int rc;
+    llama_token id;
+    std::vector<int> out;
+    if (drafter->pending_ == -1) {
+        id = llama_sampling_sample_logits(
+          sampler, slot->ctx_, slot->logits_.data());
+        llama_sampling_accept(sampler, slot->ctx_, id, apply_grammar);
+        drafter->add(id);
+        out.emplace_back(id);
+        if (llama_token_is_eog(slot->model_, id) || max <= 1) {
+            drafter->pending_ = id;
+            ids->insert(ids->end(), out.begin(), out.end());
+            return out.size();
+        }
+    } else {
+        id = drafter->pending_;
+        drafter->pending_ = -1;
+    }
+    std::vector<int> tokens = { id };
+    int room = std::min(max - (int)out.size(),
+                        slot->ctx_size() - slot->ctx_used());
+    drafter->draft(&tokens, room - 1);
+    if ((rc = slot->eval_draft(tokens, &drafter->logits_)) < 0)
+        return rc;
+    int accepted = 1;
+    int drafted = tokens.size();
+    size_t n_vocab = slot->logits_.size();
+    for (;;) {
+        float* row = drafter->logits_.data() + (accepted - 1) * n_vocab;
+        id = llama_sampling_sample_logits(sampler, slot->ctx_, row);
+        llama_sampling_accept(sampler, slot->ctx_, id, apply_grammar);
+        drafter->add(id);
+        out.emplace_back(id);
+        if (accepted == drafted || id != tokens[accepted]) {
+            drafter->pending_ = id;
+            break;
+        }
+        ++accepted;
+        if (llama_token_is_eog(slot->model_, id))
+            break;
+    }
+    slot->rewind(drafted - accepted);
+    ids->insert(ids->end(), out.begin(), out.end());
+    return out.size();
+}
+
+} // namespace server
+} // namespace lf
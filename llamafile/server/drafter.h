@@ -0,0 +1,65 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "llama.cpp/ngram-cache.h"
+#include <vector>
+
+struct llama_sampling_context;
+
+namespace lf {
+namespace server {
+
+class Atom;
+struct Slot;
+
+// proposes tokens that are likely to come next in a completion
+//
+// this implements prompt lookup decoding. the n-grams of a conversation
+// are counted as it grows, and whenever its most recent tokens match an
+// n-gram that's been seen before, whatever followed it becomes a draft.
+// this works well for things like code editing and rag, where answers
+// quote heavily from the prompt. there's also an n-gram cache that all
+// requests share, which remembers what earlier completions generated.
+struct Drafter
+{
+    int n_draft_;
+    int n_new_ = 0; // tokens not yet added to shared cache
+    int pending_ = -1; // token that was output but not yet evaluated
+    std::vector<int> inp_;
+    std::vector<float> logits_;
+    llama_ngram_cache context_;
+
+    explicit Drafter(int);
+    ~Drafter();
+    void start(const std::vector<Atom>&);
+    void add(int);
+    void draft(std::vector<int>*, int);
+    int flush(Slot*);
+    int drop();
+};
+
+int
+speculate(Slot*,
+          llama_sampling_context*,
+          Drafter*,
+          int,
+          bool,
+          std::vector<int>*);
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,100 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "embedcache.h"
+#include "image.h"
+
+#define ENTRY(e) DLL_CONTAINER(EmbedCache::Entry, elem_, e)
+
+namespace lf {
+namespace server {
+
+static std::string
+key_of(const Image& image)
+{
+    return std::string((const char*)image.hash(), Image::kHashSize);
+}
+
+static size_t
+size_of(const ImageEmbed& embed)
+{
+    return embed.data.size() * sizeof(float);
+}
+
+EmbedCache::EmbedCache(size_t budget) : budget_(budget)
+{
+    pthread_mutex_init(&lock_, 0);
+}
+
+EmbedCache::~EmbedCache()
+{
+    while (!dll_is_empty(lru_))
+        evict(ENTRY(dll_last(lru_)));
+    pthread_mutex_destroy(&lock_);
+}
+
+// returns embedding of image if it's been computed before, or null
+std::shared_ptr<const ImageEmbed>
+EmbedCache::get(const Image& image)
+{
+    std::shared_ptr<const ImageEmbed> res;
+    pthread_mutex_lock(&lock_);
+    auto it = entries_.find(key_of(image));
+    if (it != entries_.end()) {
+        Entry* entry = it->second;
+        dll_remove(&lru_, &entry->elem_);
+        dll_make_first(&lru_, &entry->elem_);
+        res = entry->embed;
+    }
+    pthread_mutex_unlock(&lock_);
+    return res;
+}
+
+// remembers embedding of image, evicting older ones to stay in budget
+void
+EmbedCache::put(const Image& image, std::shared_ptr<const ImageEmbed> embed)
+{
+    size_t size = size_of(*embed);
+    if (size > budget_)
+        return;
+    std::string key = key_of(image);
+    pthread_mutex_lock(&lock_);
+    if (!entries_.count(key)) {
+        while (used_ + size > budget_)
+            evict(ENTRY(dll_last(lru_)));
+        Entry* entry = new Entry;
+        dll_init(&entry->elem_);
+        entry->key = key;
+        entry->embed = std::move(embed);
+        used_ += size;
+        entries_[key] = entry;
+        dll_make_first(&lru_, &entry->elem_);
+    }
+    pthread_mutex_unlock(&lock_);
+}
+
+void
+EmbedCache::evict(Entry* entry)
+{
+    used_ -= size_of(*entry->embed);
+    entries_.erase(entry->key);
+    dll_remove(&lru_, &entry->elem_);
+    delete entry;
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,69 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <cosmo.h>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace lf {
+namespace server {
+
+class Image;
+
+// output of the vision model for a single image
+struct ImageEmbed
+{
+    std::vector<float> data; // n * n_embd floats
+    int n; // number of positions it occupies in context
+};
+
+// lru cache of image embeddings keyed by image content hash
+//
+// running an image through clip takes much longer than evaluating its
+// embedding, and agents tend to send the same screenshots repeatedly.
+// entries are reference counted, so a slot that's still evaluating an
+// embedding isn't bothered if it gets evicted in the meantime.
+struct EmbedCache
+{
+    struct Entry
+    {
+        Dll elem_;
+        std::string key;
+        std::shared_ptr<const ImageEmbed> embed;
+    };
+
+    size_t budget_;
+    size_t used_ = 0;
+    Dll* lru_ = nullptr; // most recently used first
+    std::unordered_map<std::string, Entry*> entries_;
+    pthread_mutex_t lock_;
+
+    explicit EmbedCache(size_t);
+    ~EmbedCache();
+    std::shared_ptr<const ImageEmbed> get(const Image&);
+    void put(const Image&, std::shared_ptr<const ImageEmbed>);
+
+  private:
+    void evict(Entry*);
+};
+
+} // namespace server
+} // namespace lf
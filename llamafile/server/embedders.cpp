@@ -0,0 +1,132 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "embedders.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/macros.h"
+#include "llamafile/server/log.h"
+
+namespace lf {
+namespace server {
+
+// creates context for computing embeddings
+//
+// @param n_ctx is max tokens across all sequences in one decode
+// @param n_seq is max sequences in one decode
+llama_context*
+create_embedding_context(llama_model* model, int n_ctx, int n_seq)
+{
+    llama_context_params cparams = {};
+    cparams.embeddings = true;
+    cparams.embeddings_only = true;
+    cparams.logits_all = true;
+    cparams.seed = _rand64();
+    cparams.n_ctx = n_ctx;
+    cparams.n_batch = n_ctx;
+    cparams.n_ubatch = n_ctx;
+    cparams.n_seq_max = n_seq;
+    cparams.n_threads = 8;
+    cparams.n_threads_batch = 8;
+    cparams.attention_type = LLAMA_ATTENTION_TYPE_UNSPECIFIED;
+    cparams.rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_NONE;
+    cparams.pooling_type = LLAMA_POOLING_TYPE_NONE;
+    cparams.type_k = GGML_TYPE_F16;
+    cparams.type_v = GGML_TYPE_F16;
+    cparams.flash_attn = FLAG_flash_attn;
+    return llama_new_context_with_model(model, cparams);
+}
+
+Embedder::~Embedder()
+{
+    if (ctx_) {
+        llama_batch_free(batch_);
+        llama_free(ctx_);
+    }
+}
+
+Embedders::Embedders(llama_model* model)
+  : model_(model)
+  , n_ctx_(MIN(2048, llama_n_ctx_train(model)))
+  , n_seq_(kMaxSequences)
+{
+    pthread_cond_init(&cond_, 0);
+    pthread_mutex_init(&lock_, 0);
+}
+
+Embedders::~Embedders()
+{
+    while (!dll_is_empty(free_)) {
+        Dll* e = dll_first(free_);
+        dll_remove(&free_, e);
+        delete EMBEDDER(e);
+    }
+    pthread_mutex_destroy(&lock_);
+    pthread_cond_destroy(&cond_);
+}
+
+// borrows embedding context from pool
+//
+// if all contexts are in use and the pool is at capacity, then this
+// function waits for one to be relinquished.
+//
+// @return embedder whose kv cache is empty, or null on error
+Embedder*
+Embedders::take()
+{
+    pthread_mutex_lock(&lock_);
+    for (;;) {
+        if (!dll_is_empty(free_)) {
+            Dll* e = dll_first(free_);
+            dll_remove(&free_, e);
+            pthread_mutex_unlock(&lock_);
+            Embedder* embedder = EMBEDDER(e);
+            llama_kv_cache_clear(embedder->ctx_);
+            return embedder;
+        }
+        if (made_ < kMaxContexts) {
+            ++made_;
+            pthread_mutex_unlock(&lock_);
+            Embedder* embedder = new Embedder;
+            dll_init(&embedder->elem_);
+            if (!(embedder->ctx_ =
+                    create_embedding_context(model_, n_ctx_, n_seq_))) {
+                SLOG("failed to create embedding context");
+                delete embedder;
+                pthread_mutex_lock(&lock_);
+                --made_;
+                pthread_cond_signal(&cond_);
+                pthread_mutex_unlock(&lock_);
+                return nullptr;
+            }
+            embedder->batch_ = llama_batch_init(n_ctx_, 0, 1);
+            return embedder;
+        }
+        pthread_cond_wait(&cond_, &lock_);
+    }
+}
+
+void
+Embedders::give(Embedder* embedder)
+{
+    unassert(embedder);
+    pthread_mutex_lock(&lock_);
+    dll_make_first(&free_, &embedder->elem_);
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+}
+
+} // namespace server
+} // namespace lf
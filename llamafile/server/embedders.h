@@ -0,0 +1,64 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "llama.cpp/llama.h"
+#include <cosmo.h>
+#include <pthread.h>
+
+#define EMBEDDER(e) DLL_CONTAINER(Embedder, elem_, e)
+
+namespace lf {
+namespace server {
+
+// context for computing embeddings of many sequences at once
+struct Embedder
+{
+    Dll elem_;
+    llama_context* ctx_ = nullptr;
+    llama_batch batch_ = {};
+
+    ~Embedder();
+};
+
+// pool of embedding contexts that get reused across requests
+//
+// contexts are created lazily, up to a maximum. each one can hold up
+// to `n_seq_` sequences whose sum of tokens is at most `n_ctx_`.
+struct Embedders
+{
+    static constexpr int kMaxContexts = 4;
+    static constexpr int kMaxSequences = 64;
+
+    llama_model* model_;
+    int n_ctx_;
+    int n_seq_;
+    int made_ = 0;
+    Dll* free_ = nullptr;
+    pthread_cond_t cond_;
+    pthread_mutex_t lock_;
+
+    explicit Embedders(llama_model*);
+    ~Embedders();
+    Embedder* take();
+    void give(Embedder*);
+};
+
+llama_context*
+create_embedding_context(llama_model*, int, int);
+
+} // namespace server
+} // namespace lf
@@ -16,14 +16,20 @@
 // limitations under the License.
 
 #include "client.h"
+#include "llama.cpp/base64.h"
 #include "llama.cpp/llama.h"
 #include "llamafile/json.h"
 #include "llamafile/server/cleanup.h"
+#include "llamafile/server/embedders.h"
 #include "llamafile/server/fastjson.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/models.h"
+#include "llamafile/server/server.h"
 #include "llamafile/server/utils.h"
+#include "llamafile/server/worker.h"
 #include <cmath>
 #include <cstring>
+#include <iterator>
 #include <sys/resource.h>
 #include <vector>
 
@@ -32,15 +38,41 @@ using jt::Json;
 namespace lf {
 namespace server {
 
+enum EmbeddingFormat
+{
+    FORMAT_FLOAT, // json array of numbers
+    FORMAT_BASE64, // json string of base64 encoded bytes
+    FORMAT_RAW, // http message body is bytes
+};
+
+enum EmbeddingType
+{
+    TYPE_FLOAT32,
+    TYPE_FLOAT16,
+    TYPE_INT8, // symmetric with scale
+    TYPE_BINARY, // sign bits, msb first
+};
+
 struct EmbeddingParams
 {
     bool add_special;
     bool parse_special;
-    std::string_view prompt;
-    std::string content;
+    bool is_array = false;
+    int format = FORMAT_FLOAT;
+    int dtype = TYPE_FLOAT32;
+    int dimensions = 0;
+    std::vector<std::string_view> prompts;
+    std::vector<std::string> contents;
     std::string model;
 };
 
+struct EmbeddingState
+{
+    std::vector<std::vector<llama_token>> toks;
+    std::vector<int> used;
+    std::vector<float> embeddings;
+};
+
 void
 normalize_embeddings(const float* inp, float* out, int n)
 {
@@ -53,6 +85,87 @@ normalize_embeddings(const float* inp, float* out, int n)
         out[i] = inp[i] * norm;
 }
 
+static int
+parse_encoding_format(const std::string_view& s)
+{
+    if (s == "float")
+        return FORMAT_FLOAT;
+    if (s == "base64")
+        return FORMAT_BASE64;
+    return -1;
+}
+
+static int
+parse_embedding_type(const std::string_view& s)
+{
+    if (s == "float32")
+        return TYPE_FLOAT32;
+    if (s == "float16")
+        return TYPE_FLOAT16;
+    if (s == "int8")
+        return TYPE_INT8;
+    if (s == "binary")
+        return TYPE_BINARY;
+    return -1;
+}
+
+static const char*
+describe_embedding_type(int dtype)
+{
+    switch (dtype) {
+        case TYPE_FLOAT32:
+            return "float32";
+        case TYPE_FLOAT16:
+            return "float16";
+        case TYPE_INT8:
+            return "int8";
+        case TYPE_BINARY:
+            return "binary";
+        default:
+            __builtin_unreachable();
+    }
+}
+
+// appends embedding to `b` as little-endian bytes of type
+//
+// @return scale needed to dequantize int8, otherwise 1
+static float
+pack_embedding(std::string* b, const float* x, int n, int dtype)
+{
+    switch (dtype) {
+        case TYPE_FLOAT32:
+            b->append((const char*)x, n * sizeof(float));
+            return 1;
+        case TYPE_FLOAT16:
+            for (int i = 0; i < n; ++i) {
+                ggml_fp16_t h = ggml_fp32_to_fp16(x[i]);
+                b->append((const char*)&h, sizeof(h));
+            }
+            return 1;
+        case TYPE_INT8: {
+            float amax = 0;
+            for (int i = 0; i < n; ++i)
+                amax = std::max(amax, std::fabs(x[i]));
+            float scale = amax / 127;
+            float inv = scale ? 1 / scale : 0;
+            for (int i = 0; i < n; ++i)
+                *b += (char)(signed char)lrintf(x[i] * inv);
+            return scale;
+        }
+        case TYPE_BINARY:
+            for (int i = 0; i < n; i += 8) {
+                unsigned char byte = 0;
+                for (int j = 0; j < 8; ++j)
+                    if (i + j < n && x[i + j] > 0)
+                        byte |= 128 >> j;
+                *b += (char)byte;
+            }
+            return 1;
+        default:
+            __builtin_unreachable();
+    }
+}
+
 static void
 add_token_to_batch(struct llama_batch& batch,
                    llama_token id,
@@ -75,11 +188,88 @@ cleanup_embedding_params(void* arg)
     delete (EmbeddingParams*)arg;
 }
 
+static void
+cleanup_embedding_state(void* arg)
+{
+    delete (EmbeddingState*)arg;
+}
+
+static void
+cleanup_embedder(void* arg)
+{
+    Client* client = (Client*)arg;
+    if (client->embedder_) {
+        client->bound_->embedders_->give(client->embedder_);
+        client->embedder_ = nullptr;
+    }
+}
+
+// evaluates sequences in batch and stores their embeddings
+//
+// the final token of each sequence must have its logits flag set. the
+// embedding for sequence `i` is written to `out + owner[i] * n_embd`.
+// the kv cache is cleared afterwards so the context can be reused.
+static bool
+decode_embeddings(llama_context* ctx,
+                  llama_batch& batch,
+                  const std::vector<int>& owner,
+                  float* out,
+                  int n_embd)
+{
+    bool ok = true;
+    if (llama_decode(ctx, batch) < 0) {
+        SLOG("llama_decode failed");
+        ok = false;
+    }
+    for (int i = 0; ok && i < batch.n_tokens; i++) {
+        if (!batch.logits[i])
+            continue;
+        const float* embd = llama_get_embeddings_ith(ctx, i);
+        if (!embd) {
+            SLOG("llama_get_embeddings_ith failed");
+            ok = false;
+            break;
+        }
+        normalize_embeddings(
+          embd, out + owner[batch.seq_id[i][0]] * n_embd, n_embd);
+    }
+    llama_kv_cache_clear(ctx);
+    batch.n_tokens = 0;
+    return ok;
+}
+
+// computes embedding for text too big for pooled contexts
+static bool
+embed_oversized(llama_model* model,
+                const std::vector<llama_token>& toks,
+                int count,
+                float* out)
+{
+    llama_context* ctx = create_embedding_context(model, count, 1);
+    if (!ctx) {
+        SLOG("llama_new_context_with_model failed");
+        return false;
+    }
+    llama_batch batch = llama_batch_init(count, 0, 1);
+    for (int i = 0; i < count; ++i)
+        add_token_to_batch(batch, toks[i], i, { 0 }, i == count - 1);
+    bool ok = decode_embeddings(ctx, batch, { 0 }, out, llama_n_embd(model));
+    llama_batch_free(batch);
+    llama_free(ctx);
+    return ok;
+}
+
 bool
 Client::get_embedding_params(EmbeddingParams* params)
 {
     params->add_special = atob(or_empty(param("add_special")), true);
     params->parse_special = atob(or_empty(param("parse_special")), false);
+    std::string dimensions = std::string(or_empty(param("dimensions")));
+    params->dimensions = atoi(dimensions.c_str());
+    if (param("encoding_format").has_value())
+        params->format = parse_encoding_format(*param("encoding_format"));
+    if (param("dtype").has_value())
+        params->dtype = parse_embedding_type(*param("dtype"));
 
     // try obtaining prompt (or its aliases) from request-uri
     std::optional<std::string_view> prompt = param("content");
@@ -98,7 +288,7 @@ Client::get_embedding_params(EmbeddingParams* params)
     if (prompt.has_value()) {
         // [simple mode] if the prompt was supplied in the request-uri
         //               then we don't bother looking for a json body.
-        params->prompt = prompt.value();
+        params->prompts.emplace_back(prompt.value());
     } else if (HasHeader(kHttpContentType)) {
         // [standard mode] if the prompt wasn't specified as a
         //                 request-uri parameter, then it must be in the
@@ -106,7 +296,7 @@ Client::get_embedding_params(EmbeddingParams* params)
         if (IsMimeType(HeaderData(kHttpContentType),
                        HeaderLength(kHttpContentType),
                        "text/plain")) {
-            params->prompt = payload_;
+            params->prompts.emplace_back(payload_);
         } else if (IsMimeType(HeaderData(kHttpContentType),
                               HeaderLength(kHttpContentType),
                               "application/json")) {
@@ -116,27 +306,57 @@ Client::get_embedding_params(EmbeddingParams* params)
                 return send_error(400, Json::StatusToString(json.first));
             if (!json.second.isObject())
                 return send_error(400, "JSON body must be an object");
-            if (json.second["content"].isString())
-                params->content = json.second["content"].getString();
-            else if (json.second["prompt"].isString())
-                params->content = json.second["prompt"].getString();
-            else if (json.second["input"].isString())
-                params->content = json.second["input"].getString();
-            else
+            if (json.second["content"].isString()) {
+                params->contents.emplace_back(
+                  json.second["content"].getString());
+            } else if (json.second["prompt"].isString()) {
+                params->contents.emplace_back(
+                  json.second["prompt"].getString());
+            } else if (json.second["input"].isString()) {
+                params->contents.emplace_back(
+                  json.second["input"].getString());
+            } else if (json.second["input"].isArray()) {
+                params->is_array = true;
+                for (Json& input : json.second["input"].getArray()) {
+                    if (!input.isString())
+                        return send_error(400, "input array must hold strings");
+                    params->contents.emplace_back(input.getString());
+                }
+                if (params->contents.empty())
+                    return send_error(400, "input array is empty");
+            } else {
                 return send_error(400, "JSON missing content/prompt/input key");
-            params->prompt = params->content;
+            }
+            for (const std::string& content : params->contents)
+                params->prompts.emplace_back(content);
             if (json.second["add_special"].isBool())
                 params->add_special = json.second["add_special"].getBool();
             if (json.second["parse_special"].isBool())
                 params->parse_special = json.second["parse_special"].getBool();
             if (json.second["model"].isString())
                 params->model = json.second["model"].getString();
+            Json& format = json.second["encoding_format"];
+            if (format.isString())
+                params->format = parse_encoding_format(format.getString());
+            Json& dtype = json.second["dtype"];
+            if (dtype.isString())
+                params->dtype = parse_embedding_type(dtype.getString());
+            Json& dimensions = json.second["dimensions"];
+            if (dimensions.isLong())
+                params->dimensions = dimensions.getLong();
+            else if (!dimensions.isNull())
+                return send_error(400, "dimensions must be integer");
         } else {
             return send_error(501, "Content Type Not Implemented");
         }
     } else {
-        params->prompt = payload_;
+        params->prompts.emplace_back(payload_);
     }
+
+    if (params->format == -1)
+        return send_error(400, "encoding_format must be float or base64");
+    if (params->dtype == -1)
+        return send_error(400, "dtype must be float32, float16, int8, binary");
     return true;
 }
 
@@ -154,6 +374,15 @@ Client::embedding()
     defer_cleanup(cleanup_embedding_params, params);
     if (!get_embedding_params(params))
         return false;
+    if (!use_model(params->model))
+        return false;
+    if (params->dimensions < 0 || params->dimensions > llama_n_embd(model_))
+        return send_error(400, "dimensions out of range");
+    if (HasHeader(kHttpAccept) &&
+        IsMimeType(HeaderData(kHttpAccept),
+                   HeaderLength(kHttpAccept),
+                   "application/octet-stream"))
+        params->format = FORMAT_RAW;
 
     // setup statistics
     rusage rustart = {};
@@ -161,156 +390,253 @@ Client::embedding()
     timespec started = timespec_real();
 
     // turn text into tokens
-    auto toks = new std::vector<llama_token>(params->prompt.size() + 16);
-    defer_cleanup(cleanup_token_vector, toks);
-    int count = llama_tokenize(model_,
-                               params->prompt.data(),
-                               params->prompt.size(),
-                               &(*toks)[0],
-                               toks->size(),
-                               params->add_special,
-                               params->parse_special);
-    if (count < 0) {
-        SLOG("llama_tokenize failed");
-        return send_error(405);
-    }
-    toks->resize(count);
-
-    if (toks->empty())
-        return send_error(400, "completely empty prompt disallowed");
-
-    // truncate if exceeds model context size
+    auto state = new EmbeddingState;
+    defer_cleanup(cleanup_embedding_state, state);
     const int n_ctx_train = llama_n_ctx_train(model_);
-    if (count > n_ctx_train)
-        count = n_ctx_train;
-
-    // initialize context
-    llama_context_params cparams = {};
-    cparams.embeddings = true;
-    cparams.embeddings_only = true;
-    cparams.logits_all = true;
-    cparams.seed = _rand64();
-    cparams.n_ctx = count;
-    cparams.n_batch = count;
-    cparams.n_ubatch = count;
-    cparams.n_seq_max = 1;
-    cparams.n_threads = 8;
-    cparams.n_threads_batch = 8;
-    cparams.attention_type = LLAMA_ATTENTION_TYPE_UNSPECIFIED;
-    cparams.rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_NONE;
-    cparams.pooling_type = LLAMA_POOLING_TYPE_NONE;
-    cparams.type_k = GGML_TYPE_F16;
-    cparams.type_v = GGML_TYPE_F16;
-    cparams.flash_attn = FLAG_flash_attn;
-    llama_context* ctx = llama_new_context_with_model(model_, cparams);
-    if (!ctx) {
-        SLOG("llama_new_context_with_model failed");
-        return send_error(500);
+    size_t tokens_provided = 0;
+    size_t tokens_used = 0;
+    for (const std::string_view& prompt : params->prompts) {
+        std::vector<llama_token>& toks = state->toks.emplace_back();
+        toks.resize(prompt.size() + 16);
+        int count = llama_tokenize(model_,
+                                   prompt.data(),
+                                   prompt.size(),
+                                   &toks[0],
+                                   toks.size(),
+                                   params->add_special,
+                                   params->parse_special);
+        if (count < 0) {
+            SLOG("llama_tokenize failed");
+            return send_error(405);
+        }
+        toks.resize(count);
+        if (toks.empty())
+            return send_error(400, "completely empty prompt disallowed");
+
+        // truncate if exceeds model context size
+        if (count > n_ctx_train)
+            count = n_ctx_train;
+        state->used.emplace_back(count);
+        tokens_provided += toks.size();
+        tokens_used += count;
     }
-    defer_cleanup(cleanup_llama_context, ctx);
 
-    // initialize batch
-    const int n_embd = llama_n_embd(model_);
-    llama_batch* batch = new llama_batch;
-    *batch = llama_batch_init(count, 0, 1);
-    defer_cleanup(cleanup_llama_batch, batch);
-    for (size_t i = 0; i < count; ++i)
-        add_token_to_batch(*batch, (*toks)[i], i, { 0 }, i == count - 1);
+    // borrow context from pool
+    Embedders* embedders = bound_->embedders_;
+    if (!(embedder_ = embedders->take()))
+        return send_error(500);
+    defer_cleanup(cleanup_embedder, this);
 
     // inference time
-    if (llama_decode(ctx, *batch) < 0) {
-        SLOG("llama_decode failed");
-        return send_error(500);
-    }
-    auto embeddings = new std::vector<float>(n_embd, 0);
-    defer_cleanup(cleanup_float_vector, embeddings);
-    for (int i = 0; i < batch->n_tokens; i++) {
-        if (!batch->logits[i])
+    //
+    // as many texts as possible are packed into each batch, with each
+    // one being its own sequence, so that short texts don't leave our
+    // matrix multiplications starved for work.
+    const int n_embd = llama_n_embd(model_);
+    const int n_prompts = params->prompts.size();
+    state->embeddings.resize((size_t)n_prompts * n_embd);
+    float* out = state->embeddings.data();
+    llama_batch& batch = embedder_->batch_;
+    std::vector<int> owner;
+    batch.n_tokens = 0;
+    for (int i = 0; i < n_prompts; ++i) {
+        int count = state->used[i];
+        if (count > embedders->n_ctx_) {
+            float* dst = out + (size_t)i * n_embd;
+            if (!embed_oversized(model_, state->toks[i], count, dst))
+                return send_error(500);
             continue;
-        const float* embd = llama_get_embeddings_ith(ctx, i);
-        if (!embd) {
-            SLOG("llama_get_embeddings_ith failed");
+        }
+        if (batch.n_tokens + count > embedders->n_ctx_ ||
+            (int)owner.size() == embedders->n_seq_) {
+            if (!decode_embeddings(embedder_->ctx_, batch, owner, out, n_embd))
+                return send_error(500);
+            owner.clear();
+        }
+        int seq = owner.size();
+        owner.emplace_back(i);
+        for (int j = 0; j < count; ++j)
+            add_token_to_batch(
+              batch, state->toks[i][j], j, { seq }, j == count - 1);
+    }
+    if (batch.n_tokens)
+        if (!decode_embeddings(embedder_->ctx_, batch, owner, out, n_embd))
             return send_error(500);
+    cleanup_embedder(this);
+
+    // truncate matryoshka embeddings
+    //
+    // models trained this way put the most important information in the
+    // leading dimensions, so a prefix can be used as a smaller embedding
+    // once it's been normalized again.
+    int dims = n_embd;
+    if (params->dimensions && params->dimensions < n_embd) {
+        dims = params->dimensions;
+        for (int i = 0; i < n_prompts; ++i) {
+            float* embd = out + (size_t)i * n_embd;
+            normalize_embeddings(embd, embd, dims);
         }
-        normalize_embeddings(
-          embd, embeddings->data() + batch->seq_id[i][0] * n_embd, n_embd);
     }
 
     // determine how output json should look
     bool in_openai_mode = path() == "/v1/embeddings";
+    std::string& b = dump_;
+    b.clear();
 
-    // serialize tokens to json
-    char* p = obuf_.p;
-    p = stpcpy(p, "{\n");
-
-    // Here's what an OpenAI /v1/embedding response looks like:
+    // serialize embeddings as raw bytes
     //
-    //     {
-    //       "object": "list",
-    //       "data": [
-    //         {
-    //           "object": "embedding",
-    //           "index": 0,
-    //           "embedding": [
-    //             -0.006929283495992422,
-    //             -0.005336422007530928,
-    //             ... (omitted for spacing)
-    //             -4.547132266452536e-05,
-    //             -0.024047505110502243
-    //           ],
-    //         }
-    //       ],
-    //       "model": "text-embedding-3-small",
-    //       "usage": {
-    //         "prompt_tokens": 5,
-    //         "total_tokens": 5
-    //       }
-    //     }
+    // the message body is each embedding in order, little endian, with
+    // no padding. int8 embeddings are each preceded by a float32 scale.
+    if (params->format == FORMAT_RAW) {
+        for (int i = 0; i < n_prompts; ++i) {
+            const float* embd = out + (size_t)i * n_embd;
+            if (params->dtype == TYPE_INT8) {
+                size_t off = b.size();
+                b.append(sizeof(float), 0);
+                float scale = pack_embedding(&b, embd, dims, params->dtype);
+                memcpy(&b[off], &scale, sizeof(scale));
+            } else {
+                pack_embedding(&b, embd, dims, params->dtype);
+            }
+        }
+    }
+
+    // serialize embeddings to json
     //
+    // the response can easily be larger than our output buffer, since
+    // many texts may be embedded at once, so it's assembled in dump_
+    char buf[64];
+    std::string packed;
+    if (params->format != FORMAT_RAW) {
+        b.reserve((size_t)n_prompts * dims * 24 + 512);
+        b += "{\n";
 
-    if (in_openai_mode) {
-        p = stpcpy(p, "  \"object\": \"list\",\n");
-        p = stpcpy(p, "  \"model\": ");
-        p = encode_json(p, params->model);
-        p = stpcpy(p, ",\n");
-        p = stpcpy(p, "  \"usage\": {\n");
-        p = stpcpy(p, "    \"prompt_tokens\": ");
-        p = encode_json(p, count);
-        p = stpcpy(p, ",\n");
-        p = stpcpy(p, "    \"total_tokens\": ");
-        p = encode_json(p, toks->size());
-        p = stpcpy(p, "\n  },\n");
-        p = stpcpy(p, "  \"data\": [{\n");
-        p = stpcpy(p, "  \"object\": \"embedding\",\n");
-        p = stpcpy(p, "  \"index\": 0,\n");
-    } else {
-        p = stpcpy(p, "  \"add_special\": ");
-        p = encode_bool(p, params->add_special);
-        p = stpcpy(p, ",\n");
-        p = stpcpy(p, "  \"parse_special\": ");
-        p = encode_bool(p, params->parse_special);
-        p = stpcpy(p, ",\n");
-        p = stpcpy(p, "  \"tokens_provided\": ");
-        p = encode_json(p, toks->size());
-        p = stpcpy(p, ",\n");
-        p = stpcpy(p, "  \"tokens_used\": ");
-        p = encode_json(p, count);
-        p = stpcpy(p, ",\n");
-    }
+        // Here's what an OpenAI /v1/embedding response looks like:
+        //
+        //     {
+        //       "object": "list",
+        //       "data": [
+        //         {
+        //           "object": "embedding",
+        //           "index": 0,
+        //           "embedding": [
+        //             -0.006929283495992422,
+        //             -0.005336422007530928,
+        //             ... (omitted for spacing)
+        //             -4.547132266452536e-05,
+        //             -0.024047505110502243
+        //           ],
+        //         }
+        //       ],
+        //       "model": "text-embedding-3-small",
+        //       "usage": {
+        //         "prompt_tokens": 5,
+        //         "total_tokens": 5
+        //       }
+        //     }
+        //
+
+        if (in_openai_mode) {
+            b += "  \"object\": \"list\",\n";
+            b += "  \"model\": ";
+            b.append(buf, encode_json(buf, params->model) - buf);
+            b += ",\n";
+            b += "  \"usage\": {\n";
+            b += "    \"prompt_tokens\": ";
+            b.append(buf, encode_json(buf, tokens_used) - buf);
+            b += ",\n";
+            b += "    \"total_tokens\": ";
+            b.append(buf, encode_json(buf, tokens_provided) - buf);
+            b += "\n  },\n";
+            b += "  \"data\": [";
+        } else {
+            b += "  \"add_special\": ";
+            b.append(buf, encode_bool(buf, params->add_special) - buf);
+            b += ",\n";
+            b += "  \"parse_special\": ";
+            b.append(buf, encode_bool(buf, params->parse_special) - buf);
+            b += ",\n";
+            b += "  \"tokens_provided\": ";
+            b.append(buf, encode_json(buf, tokens_provided) - buf);
+            b += ",\n";
+            b += "  \"tokens_used\": ";
+            b.append(buf, encode_json(buf, tokens_used) - buf);
+            b += ",\n";
+            if (params->dtype != TYPE_FLOAT32) {
+                b += "  \"dtype\": \"";
+                b += describe_embedding_type(params->dtype);
+                b += "\",\n";
+            }
+            if (params->is_array)
+                b += "  \"embeddings\": [";
+        }
+
+        for (int i = 0; i < n_prompts; ++i) {
+            if (i)
+                b += ',';
+            if (in_openai_mode) {
+                b += "{\n";
+                b += "  \"object\": \"embedding\",\n";
+                b += "  \"index\": ";
+                b.append(buf, encode_json(buf, i) - buf);
+                b += ",\n";
+            } else if (params->is_array) {
+                b += "\n    {";
+            }
+
+            // quantize embedding
+            const float* embd = out + (size_t)i * n_embd;
+            packed.clear();
+            float scale = pack_embedding(&packed, embd, dims, params->dtype);
+            if (params->dtype == TYPE_INT8) {
+                b += "  \"scale\": ";
+                b.append(buf, encode_json(buf, scale) - buf);
+                b += ",\n";
+            }
 
-    p = stpcpy(p, "  \"embedding\": [");
-    for (size_t i = 0; i < embeddings->size(); ++i) {
-        if (i) {
-            *p++ = ',';
-            *p++ = ' ';
+            // encode embedding
+            b += "  \"embedding\": ";
+            if (params->format == FORMAT_BASE64) {
+                b += '"';
+                base64::encode(
+                  packed.begin(), packed.end(), std::back_inserter(b));
+                b += '"';
+            } else {
+                b += '[';
+                const char* q = packed.data();
+                int n = params->dtype == TYPE_INT8 ||
+                            params->dtype == TYPE_BINARY
+                          ? packed.size()
+                          : dims;
+                for (int j = 0; j < n; ++j) {
+                    if (j)
+                        b += ", ";
+                    char* e;
+                    if (params->dtype == TYPE_FLOAT32) {
+                        e = encode_json(buf, embd[j]);
+                    } else if (params->dtype == TYPE_FLOAT16) {
+                        ggml_fp16_t h;
+                        memcpy(&h, q + j * sizeof(h), sizeof(h));
+                        e = encode_json(buf, ggml_fp16_to_fp32(h));
+                    } else if (params->dtype == TYPE_INT8) {
+                        e = encode_json(buf, (int)(signed char)q[j]);
+                    } else {
+                        e = encode_json(buf, (int)(unsigned char)q[j]);
+                    }
+                    b.append(buf, e - buf);
+                }
+                b += ']';
+            }
+            if (in_openai_mode)
+                b += "\n  }";
+            else if (params->is_array)
+                b += '}';
         }
-        p = encode_json(p, (*embeddings)[i]);
+        if (in_openai_mode || params->is_array)
+            b += ']';
+        b += "\n}\n";
     }
-    p = stpcpy(p, "]\n");
-    if (in_openai_mode)
-        p = stpcpy(p, "  }]\n");
-    p = stpcpy(p, "}\n");
-    std::string_view content(obuf_.p, p - obuf_.p);
+    std::string_view content(b);
 
     // collect statistics
     rusage ruend = {};
@@ -324,9 +650,22 @@ Client::embedding()
     long system_us = timeval_tomicros(system);
 
     // send response
-    char* headers = p;
-    p = append_http_response_message(p, 200);
-    p = stpcpy(p, "Content-Type: application/json\r\n");
+    char* headers = obuf_.p;
+    char* p = append_http_response_message(headers, 200);
+    if (params->format == FORMAT_RAW) {
+        p = stpcpy(p, "Content-Type: application/octet-stream\r\n");
+        p = stpcpy(p, "X-Embedding-Count: ");
+        p = FormatInt64(p, n_prompts);
+        p = stpcpy(p, "\r\nX-Embedding-Dimensions: ");
+        p = FormatInt64(p, dims);
+        p = stpcpy(p, "\r\nX-Embedding-Dtype: ");
+        p = stpcpy(p, describe_embedding_type(params->dtype));
+        p = stpcpy(p, "\r\nX-Prompt-Tokens: ");
+        p = FormatInt64(p, tokens_used);
+        p = stpcpy(p, "\r\n");
+    } else {
+        p = stpcpy(p, "Content-Type: application/json\r\n");
+    }
     p = stpcpy(p, "X-Wall-Micros: ");
     p = FormatInt64(p, wall_us);
     p = stpcpy(p, "\r\nX-User-Micros: ");
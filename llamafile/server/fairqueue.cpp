@@ -0,0 +1,124 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fairqueue.h"
+#include <algorithm>
+#include <cassert>
+
+namespace lf {
+namespace server {
+
+double
+FairQueue::weight(Priority priority)
+{
+    switch (priority) {
+        case kPriorityInteractive:
+            return 4;
+        case kPriorityNormal:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// enqueues ticket
+//
+// the ticket's virtual start time is whichever is later: now, or when
+// the tenant's previous ticket finishes. the caller must remove() it
+// once it's been served or abandoned.
+//
+// @param max_queued is how many tickets one tenant may have waiting
+// @return false if tenant already has too many tickets waiting
+bool
+FairQueue::push(Ticket* ticket, int max_queued)
+{
+    Tenant& tenant = tenants_[ticket->tenant];
+    if (tenant.queued >= max_queued) {
+        if (!tenant.queued)
+            tenants_.erase(ticket->tenant);
+        return false;
+    }
+    ticket->start = std::max(vtime_, tenant.finish);
+    ticket->finish = ticket->start + ticket->cost / weight(ticket->priority);
+    tenant.finish = ticket->finish;
+    ++tenant.queued;
+    ++size_;
+    dll_init(&ticket->elem_);
+    dll_make_last(&tickets_, &ticket->elem_);
+    return true;
+}
+
+// removes ticket from queue
+//
+// when a served ticket leaves, virtual time advances to its start, so
+// tenants who were idle don't get to bank credit. when an abandoned
+// ticket was its tenant's last, the tenant gets its charge back.
+void
+FairQueue::remove(Ticket* ticket)
+{
+    auto it = tenants_.find(ticket->tenant);
+    unassert(it != tenants_.end());
+    if (ticket == head())
+        vtime_ = std::max(vtime_, ticket->start);
+    else if (it->second.finish == ticket->finish)
+        it->second.finish = ticket->start;
+    dll_remove(&tickets_, &ticket->elem_);
+    --size_;
+    if (!--it->second.queued && it->second.finish <= vtime_)
+        tenants_.erase(it);
+    if (!size_) {
+        tenants_.clear();
+        vtime_ = 0;
+    }
+}
+
+// returns ticket that should be served next, or null if empty
+Ticket*
+FairQueue::head() const
+{
+    Ticket* best = nullptr;
+    for (Dll* e = dll_first(tickets_); e; e = dll_next(tickets_, e))
+        if (!best || TICKET(e)->finish < best->finish)
+            best = TICKET(e);
+    return best;
+}
+
+// returns sum of estimated costs of tickets that'll be served first
+double
+FairQueue::cost_ahead(const Ticket* ticket) const
+{
+    double cost = 0;
+    for (Dll* e = dll_first(tickets_); e; e = dll_next(tickets_, e))
+        if (TICKET(e)->finish < ticket->finish)
+            cost += TICKET(e)->cost;
+    return cost;
+}
+
+int
+FairQueue::size() const
+{
+    return size_;
+}
+
+bool
+FairQueue::empty() const
+{
+    return !size_;
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,85 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <cosmo.h>
+#include <ctime>
+#include <map>
+#include <string>
+
+#define TICKET(e) DLL_CONTAINER(Ticket, elem_, e)
+
+namespace lf {
+namespace server {
+
+// classes of service chosen by the X-Priority header
+enum Priority
+{
+    kPriorityInteractive,
+    kPriorityNormal,
+    kPriorityBatch,
+    kPriorities,
+};
+
+// request that's waiting to be admitted
+struct Ticket
+{
+    Dll elem_;
+    std::string tenant; // who gets charged for this work
+    Priority priority = kPriorityNormal;
+    double cost = 1; // estimated number of tokens
+    int n = 1; // how many slots are wanted
+    int fd = -1; // connection of client, or -1
+    timespec deadline; // when we give up with 429
+    double start = 0; // virtual start time
+    double finish = 0; // virtual finish time
+};
+
+// weighted fair queue for admitting requests
+//
+// each tenant is charged the estimated token cost of its requests,
+// divided by the weight of their priority class, and the ticket with
+// the earliest virtual finish time is served first. that way a tenant
+// sending many big requests can't starve one sending a few small ones,
+// and batch work still makes progress behind interactive work. this
+// class isn't thread safe; its owner is expected to hold a lock.
+class FairQueue
+{
+  public:
+    static double weight(Priority);
+    bool push(Ticket*, int);
+    void remove(Ticket*);
+    Ticket* head() const;
+    double cost_ahead(const Ticket*) const;
+    int size() const;
+    bool empty() const;
+
+  private:
+    struct Tenant
+    {
+        double finish = 0;
+        int queued = 0;
+    };
+
+    Dll* tickets_ = nullptr;
+    std::map<std::string, Tenant> tenants_;
+    double vtime_ = 0;
+    int size_ = 0;
+};
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,161 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llamafile/server/fairqueue.h"
+#include <cstdlib>
+
+namespace lf {
+namespace server {
+namespace {
+
+void
+make(Ticket* t, const char* tenant, Priority priority, double cost)
+{
+    t->tenant = tenant;
+    t->priority = priority;
+    t->cost = cost;
+}
+
+void
+test_small_tenant_isnt_starved()
+{
+    FairQueue q;
+    Ticket a1, a2, a3, b1;
+    make(&a1, "a", kPriorityNormal, 100);
+    make(&a2, "a", kPriorityNormal, 100);
+    make(&a3, "a", kPriorityNormal, 100);
+    make(&b1, "b", kPriorityNormal, 100);
+    if (!q.push(&a1, 16) || !q.push(&a2, 16) || !q.push(&a3, 16))
+        exit(1);
+    if (!q.push(&b1, 16))
+        exit(2);
+    if (q.head() != &a1)
+        exit(3);
+    q.remove(&a1);
+    if (q.head() != &b1)
+        exit(4);
+    q.remove(&b1);
+    if (q.head() != &a2)
+        exit(5);
+    q.remove(&a2);
+    q.remove(&a3);
+    if (!q.empty() || q.head())
+        exit(6);
+}
+
+void
+test_cheap_requests_go_first()
+{
+    FairQueue q;
+    Ticket big, small;
+    make(&big, "a", kPriorityNormal, 4000);
+    make(&small, "b", kPriorityNormal, 10);
+    q.push(&big, 16);
+    q.push(&small, 16);
+    if (q.head() != &small)
+        exit(10);
+    q.remove(&small);
+    q.remove(&big);
+}
+
+void
+test_priority_weights()
+{
+    FairQueue q;
+    Ticket batch, normal, interactive;
+    make(&batch, "a", kPriorityBatch, 100);
+    make(&normal, "b", kPriorityNormal, 100);
+    make(&interactive, "c", kPriorityInteractive, 100);
+    q.push(&batch, 16);
+    q.push(&normal, 16);
+    q.push(&interactive, 16);
+    if (q.head() != &interactive)
+        exit(20);
+    q.remove(&interactive);
+    if (q.head() != &normal)
+        exit(21);
+    q.remove(&normal);
+    if (q.head() != &batch)
+        exit(22);
+    q.remove(&batch);
+}
+
+void
+test_queue_depth_is_per_tenant()
+{
+    FairQueue q;
+    Ticket a1, a2, a3, b1;
+    make(&a1, "a", kPriorityNormal, 1);
+    make(&a2, "a", kPriorityNormal, 1);
+    make(&a3, "a", kPriorityNormal, 1);
+    make(&b1, "b", kPriorityNormal, 1);
+    if (!q.push(&a1, 2) || !q.push(&a2, 2))
+        exit(30);
+    if (q.push(&a3, 2))
+        exit(31);
+    if (!q.push(&b1, 2))
+        exit(32);
+    if (q.size() != 3)
+        exit(33);
+    q.remove(&a2);
+    if (!q.push(&a3, 2))
+        exit(34);
+    q.remove(&a1);
+    q.remove(&b1);
+    q.remove(&a3);
+}
+
+void
+test_abandoned_ticket_is_refunded()
+{
+    FairQueue q;
+    Ticket a1, a2, a3, b1;
+    make(&a1, "a", kPriorityNormal, 100);
+    make(&a2, "a", kPriorityNormal, 100);
+    make(&b1, "b", kPriorityNormal, 250);
+    make(&a3, "a", kPriorityNormal, 100);
+    q.push(&a1, 16);
+    q.push(&a2, 16);
+    q.push(&b1, 16);
+    q.remove(&a2); // client hung up
+    q.push(&a3, 16);
+    q.remove(&a1);
+    if (q.head() != &a3)
+        exit(40);
+    q.remove(&a3);
+    q.remove(&b1);
+}
+
+void
+fairqueue_test()
+{
+    test_small_tenant_isnt_starved();
+    test_cheap_requests_go_first();
+    test_priority_weights();
+    test_queue_depth_is_per_tenant();
+    test_abandoned_ticket_is_refunded();
+}
+
+} // namespace
+} // namespace server
+} // namespace lf
+
+int
+main()
+{
+    lf::server::fairqueue_test();
+}
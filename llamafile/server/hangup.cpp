@@ -0,0 +1,59 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils.h"
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+
+namespace lf {
+namespace server {
+
+// returns true if peer has closed or reset the connection
+//
+// this never blocks. data the client may have pipelined is left in the
+// socket for the next request to read.
+bool
+is_hung_up(int fd)
+{
+    char b;
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+#ifdef POLLRDHUP
+    pfd.events |= POLLRDHUP;
+#endif
+    if (poll(&pfd, 1, 0) <= 0)
+        return false;
+    if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))
+        return true;
+#ifdef POLLRDHUP
+    if (pfd.revents & POLLRDHUP)
+        return true;
+#endif
+    if (!(pfd.revents & POLLIN))
+        return false;
+    ssize_t got = recv(fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (!got)
+        return true;
+    if (got < 0)
+        return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+    return false;
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,112 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "histogram.h"
+#include <cmath>
+
+namespace lf {
+namespace server {
+
+// returns index of bucket holding `x`
+//
+// values less than 2**kSubBits get a bucket of their own. beyond that
+// we use the position of the leading bit as the exponent, and the next
+// kSubBits bits beneath it as the mantissa.
+int
+Histogram::bucket(uint64_t x)
+{
+    if (x < (1u << kSubBits))
+        return x;
+    int e = 63 - __builtin_clzll(x);
+    int m = (x >> (e - kSubBits)) & ((1u << kSubBits) - 1);
+    return ((e - kSubBits + 1) << kSubBits) + m;
+}
+
+// returns smallest value that maps to bucket `i`
+uint64_t
+Histogram::lower_bound(int i)
+{
+    if (i < (1 << kSubBits))
+        return i;
+    int e = (i >> kSubBits) + kSubBits - 1;
+    uint64_t m = i & ((1u << kSubBits) - 1);
+    return (1ull << e) | (m << (e - kSubBits));
+}
+
+void
+Histogram::record(uint64_t x)
+{
+    buckets_[bucket(x)].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(x, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+// adds counts recorded by another histogram to this one
+void
+Histogram::add(const Histogram& other)
+{
+    for (int i = 0; i < kBuckets; ++i)
+        buckets_[i].fetch_add(other.buckets_[i].load(std::memory_order_relaxed),
+                              std::memory_order_relaxed);
+    sum_.fetch_add(other.sum(), std::memory_order_relaxed);
+    count_.fetch_add(other.count(), std::memory_order_relaxed);
+}
+
+uint64_t
+Histogram::count() const
+{
+    return count_.load(std::memory_order_relaxed);
+}
+
+uint64_t
+Histogram::sum() const
+{
+    return sum_.load(std::memory_order_relaxed);
+}
+
+// estimates value at quantile `q`, e.g. .99 for p99
+//
+// the result is the midpoint of the bucket where the quantile lands,
+// or zero if nothing has been recorded yet.
+uint64_t
+Histogram::percentile(double q) const
+{
+    uint64_t total = 0;
+    uint64_t counts[kBuckets];
+    for (int i = 0; i < kBuckets; ++i)
+        total += counts[i] = buckets_[i].load(std::memory_order_relaxed);
+    if (!total)
+        return 0;
+    uint64_t rank = std::ceil(q * total);
+    if (rank < 1)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+        if ((seen += counts[i]) >= rank) {
+            uint64_t lo = lower_bound(i);
+            if (i + 1 == kBuckets)
+                return lo;
+            uint64_t hi = lower_bound(i + 1);
+            return lo + (hi - lo) / 2;
+        }
+    }
+    __builtin_unreachable();
+}
+
+} // namespace server
+} // namespace lf
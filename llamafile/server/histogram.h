@@ -0,0 +1,50 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+namespace lf {
+namespace server {
+
+// lock-free latency histogram
+//
+// values are bucketed log-linearly, with eight buckets per power of
+// two, so percentiles are accurate to within ~12% across the full
+// uint64 range. recording is a single relaxed atomic increment, which
+// means it's cheap enough to call for every token that gets generated
+struct Histogram
+{
+    static constexpr int kSubBits = 3;
+    static constexpr int kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+    std::atomic_ulong count_ = ATOMIC_VAR_INIT(0);
+    std::atomic_ulong sum_ = ATOMIC_VAR_INIT(0);
+    std::atomic_ulong buckets_[kBuckets] = {};
+
+    void record(uint64_t);
+    void add(const Histogram&);
+    uint64_t count() const;
+    uint64_t sum() const;
+    uint64_t percentile(double) const;
+
+    static int bucket(uint64_t);
+    static uint64_t lower_bound(int);
+};
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,102 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "histogram.h"
+#include <cstdlib>
+
+namespace lf {
+namespace server {
+namespace {
+
+void
+test_histogram_buckets()
+{
+    // every bucket must begin where the previous one ends
+    for (int i = 1; i < Histogram::kBuckets; ++i)
+        if (Histogram::lower_bound(i) <= Histogram::lower_bound(i - 1))
+            exit(1);
+
+    // values must land in the bucket whose range contains them
+    for (int i = 0; i + 1 < Histogram::kBuckets; ++i) {
+        uint64_t lo = Histogram::lower_bound(i);
+        uint64_t hi = Histogram::lower_bound(i + 1);
+        if (Histogram::bucket(lo) != i)
+            exit(2);
+        if (Histogram::bucket(hi - 1) != i)
+            exit(3);
+    }
+    if (Histogram::bucket(-1ull) != Histogram::kBuckets - 1)
+        exit(4);
+}
+
+void
+test_histogram_percentile()
+{
+    Histogram h;
+    if (h.percentile(.5) != 0)
+        exit(5);
+    for (int i = 1; i <= 1000; ++i)
+        h.record(i);
+    if (h.count() != 1000)
+        exit(6);
+    if (h.sum() != 500500)
+        exit(7);
+    uint64_t p50 = h.percentile(.50);
+    uint64_t p99 = h.percentile(.99);
+    if (p50 < 450 || p50 > 550)
+        exit(8);
+    if (p99 < 900 || p99 > 1100)
+        exit(9);
+    if (h.percentile(0) != 1)
+        exit(10);
+}
+
+void
+test_histogram_add()
+{
+    Histogram a, b, sum;
+    for (int i = 1; i <= 500; ++i)
+        a.record(i);
+    for (int i = 501; i <= 1000; ++i)
+        b.record(i);
+    sum.add(a);
+    sum.add(b);
+    if (sum.count() != 1000)
+        exit(11);
+    if (sum.sum() != 500500)
+        exit(12);
+    uint64_t p50 = sum.percentile(.50);
+    if (p50 < 450 || p50 > 550)
+        exit(13);
+}
+
+void
+histogram_test()
+{
+    test_histogram_buckets();
+    test_histogram_percentile();
+    test_histogram_add();
+}
+
+} // namespace
+} // namespace server
+} // namespace lf
+
+int
+main()
+{
+    lf::server::histogram_test();
+}
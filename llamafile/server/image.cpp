@@ -17,27 +17,52 @@
 
 #include "image.h"
 #include "llamafile/llamafile.h"
+#include "third_party/mbedtls/sha256.h"
 #include <cassert>
+#include <cstring>
 #include <utility>
 
 namespace lf {
 namespace server {
 
+/**
+ * @fileoverview Image content of a context window.
+ *
+ * Images are identified by the SHA-256 of their encoded bytes, which is
+ * computed once when the image is decoded from the request. Comparisons
+ * only look at the hash, so matching a chat history against the slots
+ * costs the same whether the image is a favicon or a 4k screenshot. The
+ * bytes themselves are immutable and shared by every copy.
+ */
+
 Image::~Image() = default;
 
-Image::Image(const Image& old) : Image(old.bytes_, old.ctx_used_)
+Image::Image(const Image& old) : Image(old, old.ctx_used_)
+{
+}
+
+Image::Image(const Image& old, int ctx_used)
+  : bytes_(old.bytes_), ctx_used_(ctx_used)
 {
+    memcpy(hash_, old.hash_, kHashSize);
 }
 
 Image::Image(const std::string_view& bytes, int ctx_used)
-  : bytes_(bytes), ctx_used_(ctx_used)
+  : bytes_(std::make_shared<const std::string>(bytes)), ctx_used_(ctx_used)
 {
+    mbedtls_sha256_ret(bytes.data(), bytes.size(), hash_, false);
 }
 
 const std::string&
 Image::bytes() const
 {
-    return bytes_;
+    return *bytes_;
+}
+
+const unsigned char*
+Image::hash() const
+{
+    return hash_;
 }
 
 int
@@ -63,13 +88,13 @@ Image::ctx_used() const
 bool
 operator<(const Image& lhs, const Image& rhs)
 {
-    return lhs.bytes() < rhs.bytes();
+    return memcmp(lhs.hash(), rhs.hash(), Image::kHashSize) < 0;
 }
 
 bool
 operator==(const Image& lhs, const Image& rhs)
 {
-    return lhs.bytes() == rhs.bytes();
+    return !memcmp(lhs.hash(), rhs.hash(), Image::kHashSize);
 }
 
 } // namespace server
@@ -16,6 +16,7 @@
 // limitations under the License.
 
 #pragma once
+#include <memory>
 #include <string>
 
 namespace lf {
@@ -24,14 +25,19 @@ namespace server {
 class Image
 {
   public:
+    static constexpr int kHashSize = 32;
+
     ~Image();
     Image(const Image&);
+    Image(const Image&, int);
     Image(const std::string_view&, int);
     const std::string& bytes() const;
+    const unsigned char* hash() const;
     int ctx_used() const;
 
   private:
-    std::string bytes_;
+    std::shared_ptr<const std::string> bytes_;
+    unsigned char hash_[kHashSize];
     int ctx_used_;
 };
 
@@ -103,11 +103,31 @@ test_image_operator_eq()
                     exit(8);
 }
 
+void
+test_image_sharing()
+{
+    // copies share bytes, even when ctx_used changes
+    Image a("hello", -1);
+    Image b(a, 5);
+    if (&a.bytes() != &b.bytes())
+        exit(9);
+    if (!(a == b) || b.ctx_used() != 5)
+        exit(10);
+
+    // separately decoded images with same content are equal
+    Image c(std::string("hello"), 1);
+    if (!(a == c) || &a.bytes() == &c.bytes())
+        exit(11);
+    if (a == Image("hellp", 1))
+        exit(12);
+}
+
 void
 image_test()
 {
     test_image_operator_lt();
     test_image_operator_eq();
+    test_image_sharing();
 }
 
 } // namespace
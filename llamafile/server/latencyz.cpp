@@ -0,0 +1,59 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "client.h"
+#include "histogram.h"
+#include "llamafile/json.h"
+#include "metrics.h"
+#include "server.h"
+#include "worker.h"
+
+namespace lf {
+namespace server {
+
+static jt::Json
+describe(const Histogram& h)
+{
+    jt::Json json;
+    uint64_t count = h.count();
+    json["count"] = (long)count;
+    json["mean_us"] = count ? (long)(h.sum() / count) : 0l;
+    json["p50_us"] = (long)h.percentile(.50);
+    json["p90_us"] = (long)h.percentile(.90);
+    json["p99_us"] = (long)h.percentile(.99);
+    json["p999_us"] = (long)h.percentile(.999);
+    return json;
+}
+
+bool
+Client::latencyz()
+{
+    jt::Json json;
+    uint64_t counters[kCounters];
+    Histogram* timers = new Histogram[kTimers];
+    metrics_merge(counters, timers);
+    json["time_to_first_token"] = describe(timers[kTimeToFirstToken]);
+    json["inter_token_latency"] = describe(timers[kInterTokenLatency]);
+    delete[] timers;
+    dump_ = json.toStringPretty();
+    dump_ += '\n';
+    char* p = append_http_response_message(obuf_.p, 200);
+    p = stpcpy(p, "Content-Type: application/json\r\n");
+    return send_response(obuf_.p, p, dump_);
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,84 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils.h"
+#include "llama.cpp/ggml-vector.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace lf {
+namespace server {
+
+// returns log of the sum of exp(logits)
+//
+// the log probability of any token is its logit minus this number. it
+// needs to look at the entire vocabulary, which can have 150k+ tokens,
+// so it's computed using the same simd kernels ggml uses for softmax.
+double
+logits_logsumexp(const float* logits, int n_vocab)
+{
+    float max;
+    ggml_vec_max_f32(n_vocab, &max, logits);
+    return max + std::log(ggml_vec_soft_max_f32(n_vocab, nullptr, logits, max));
+}
+
+// returns natural log of probability the model assigned to `token`
+//
+// this is the log softmax of the raw logits, which is what openai means
+// when it talks about logprobs. sampler settings like temperature have
+// no bearing on this number.
+double
+token_logprob(const float* logits, int n_vocab, int token)
+{
+    return logits[token] - logits_logsumexp(logits, n_vocab);
+}
+
+// finds the `k` tokens with the highest logits, highest first
+//
+// a min heap of the best tokens seen so far is maintained, so most of
+// the vocabulary costs one comparison against the worst of them, and
+// nothing ever gets sorted besides the k winners.
+void
+top_tokens(const float* logits, int n_vocab, int k, std::vector<int>* out)
+{
+    out->clear();
+    k = std::min(k, n_vocab);
+    if (k <= 0)
+        return;
+    std::vector<std::pair<float, int>> heap;
+    heap.reserve(k);
+    auto cmp = std::greater<std::pair<float, int>>();
+    for (int i = 0; i < k; ++i)
+        heap.emplace_back(logits[i], i);
+    std::make_heap(heap.begin(), heap.end(), cmp);
+    for (int i = k; i < n_vocab; ++i) {
+        if (logits[i] > heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end(), cmp);
+            heap.back() = { logits[i], i };
+            std::push_heap(heap.begin(), heap.end(), cmp);
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end(), cmp);
+    for (const auto& [logit, token] : heap)
+        out->emplace_back(token);
+}
+
+} // namespace server
+} // namespace lf
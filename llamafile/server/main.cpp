@@ -19,9 +19,9 @@
 #include "llamafile/llamafile.h"
 #include "llamafile/pool.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/models.h"
 #include "llamafile/server/server.h"
 #include "llamafile/server/signals.h"
-#include "llamafile/server/slots.h"
 #include "llamafile/server/time.h"
 #include "llamafile/server/tokenbucket.h"
 #include "llamafile/server/utils.h"
@@ -67,33 +67,12 @@ main(int argc, char* argv[])
     // otherwise pthread_cancel() will cause deadlocks
     FLAG_log_disable = true;
 
-    // load model
-    llama_model_params mparams = {
-        .n_gpu_layers = FLAG_n_gpu_layers,
-        .split_mode = (enum llama_split_mode)FLAG_split_mode,
-        .main_gpu = FLAG_main_gpu,
-        .tensor_split = nullptr,
-        .rpc_servers = nullptr,
-        .progress_callback = nullptr,
-        .progress_callback_user_data = nullptr,
-        .kv_overrides = nullptr,
-        .vocab_only = false,
-        .use_mmap = true,
-        .use_mlock = false,
-        .check_tensors = false,
-    };
-    llama_model* model = llama_load_model_from_file(FLAG_model, mparams);
-    if (!model) {
-        fprintf(stderr, "%s: failed to load model\n", FLAG_model);
+    // load model, and create its slots and embedding contexts
+    // other models are registered to be loaded when they're requested
+    Models* models = new Models;
+    if (!models->start(
+          FLAG_model, FLAG_models, (size_t)FLAG_model_budget << 20))
         exit(1);
-    }
-
-    // create slots
-    Slots* slots = new Slots(model);
-    if (!slots->start(FLAG_slots)) {
-        SLOG("no slots could be created");
-        exit(1);
-    }
 
     // create server
     if (FLAG_workers <= 0)
@@ -101,15 +80,18 @@ main(int argc, char* argv[])
     if (FLAG_workers <= 0)
         FLAG_workers = 16;
     set_thread_name("server");
-    g_server = new Server(create_listening_socket(FLAG_listen), slots, model);
+    g_server = new Server(create_listening_socket(FLAG_listen), models);
+    g_server->start_poller();
     for (int i = 0; i < FLAG_workers; ++i)
         npassert(!g_server->spawn());
 
     // install security
+    // loading models on demand needs to be able to open files
     if (!FLAG_unsecure) {
         if (pledge(0, 0)) {
             SLOG("warning: this OS doesn't support pledge() security");
-        } else if (pledge("stdio anet", 0)) {
+        } else if (pledge(FLAG_models ? "stdio anet rpath" : "stdio anet",
+                          0)) {
             perror("pledge");
             exit(1);
         }
@@ -127,8 +109,7 @@ main(int argc, char* argv[])
     g_server->shutdown();
     g_server->close();
     delete g_server;
-    delete slots;
-    llama_free_model(model);
+    delete models;
     tokenbucket_destroy();
     time_destroy();
     SLOG("exit");
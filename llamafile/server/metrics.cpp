@@ -0,0 +1,105 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "metrics.h"
+#include "llamafile/threadlocal.h"
+#include <pthread.h>
+
+namespace lf {
+namespace server {
+
+static pthread_mutex_t g_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static Metrics* g_metrics_all;
+static Metrics* g_metrics_free;
+static thread_local Metrics* t_metrics;
+
+static void
+give_metrics(Metrics* metrics)
+{
+    pthread_mutex_lock(&g_metrics_lock);
+    metrics->next_free = g_metrics_free;
+    g_metrics_free = metrics;
+    pthread_mutex_unlock(&g_metrics_lock);
+}
+
+static ThreadLocal<Metrics> g_metrics_owner(give_metrics);
+
+static Metrics*
+take_metrics()
+{
+    Metrics* metrics;
+    pthread_mutex_lock(&g_metrics_lock);
+    if ((metrics = g_metrics_free)) {
+        g_metrics_free = metrics->next_free;
+    } else {
+        metrics = new Metrics;
+        metrics->next = g_metrics_all;
+        g_metrics_all = metrics;
+    }
+    pthread_mutex_unlock(&g_metrics_lock);
+    g_metrics_owner.set(metrics);
+    return metrics;
+}
+
+static Metrics*
+my_metrics()
+{
+    if (!t_metrics)
+        t_metrics = take_metrics();
+    return t_metrics;
+}
+
+// adds `n` to counter
+//
+// only this thread writes to its counters, so this doesn't need to be
+// an atomic read-modify-write. readers may see a slightly stale value.
+void
+metrics_count(Counter counter, uint64_t n)
+{
+    std::atomic_ulong& c = my_metrics()->counters[counter];
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// records duration in microseconds
+void
+metrics_time(Timer timer, uint64_t micros)
+{
+    my_metrics()->timers[timer].record(micros);
+}
+
+// sums metrics of all threads
+//
+// @param counters receives kCounters values
+// @param timers must be kTimers empty histograms
+void
+metrics_merge(uint64_t* counters, Histogram* timers)
+{
+    for (int i = 0; i < kCounters; ++i)
+        counters[i] = 0;
+    pthread_mutex_lock(&g_metrics_lock);
+    Metrics* all = g_metrics_all;
+    pthread_mutex_unlock(&g_metrics_lock);
+    for (Metrics* m = all; m; m = m->next) {
+        for (int i = 0; i < kCounters; ++i)
+            counters[i] += m->counters[i].load(std::memory_order_relaxed);
+        for (int i = 0; i < kTimers; ++i)
+            timers[i].add(m->timers[i]);
+    }
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,71 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "histogram.h"
+#include <atomic>
+#include <cstdint>
+
+namespace lf {
+namespace server {
+
+enum Counter
+{
+    kPromptTokens, // tokens in prompts that were prefilled
+    kReusedTokens, // prompt tokens that were already in the kv cache
+    kPrefillTokens, // tokens evaluated by prefills
+    kPrefillMicros, // time spent evaluating them
+    kDecodeTokens, // completion tokens generated
+    kDecodeMicros, // time spent generating them
+    kRejectedRequests, // requests turned away with 429
+    kCounters,
+};
+
+enum Timer
+{
+    kQueueWait, // request waiting for a worker
+    kSlotWait, // request waiting for slots
+    kTimeToFirstToken, // request waiting for its first completion token
+    kInterTokenLatency, // time between completion tokens
+    kTimers,
+};
+
+// metrics recorded by one thread
+//
+// every thread that records metrics gets its own instance, so counting
+// something never bounces a cache line between cores. instances are
+// summed when metrics are scraped. when a thread exits its instance is
+// handed down to the next new thread, so nothing recorded gets lost.
+struct Metrics
+{
+    std::atomic_ulong counters[kCounters] = {};
+    Histogram timers[kTimers];
+    Metrics* next = nullptr; // next instance of all
+    Metrics* next_free = nullptr; // next instance of unowned
+};
+
+void
+metrics_count(Counter, uint64_t);
+
+void
+metrics_time(Timer, uint64_t);
+
+void
+metrics_merge(uint64_t*, Histogram*);
+
+} // namespace server
+} // namespace lf
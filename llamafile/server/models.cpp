@@ -0,0 +1,328 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "models.h"
+#include "llama.cpp/llama.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/server/embedders.h"
+#include "llamafile/server/log.h"
+#include "llamafile/server/scheduler.h"
+#include "llamafile/server/slots.h"
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+
+namespace lf {
+namespace server {
+
+static std::string_view
+name_of_path(std::string_view path)
+{
+    size_t i = path.rfind('/');
+    if (i != std::string_view::npos)
+        path = path.substr(i + 1);
+    for (std::string_view ext : { ".gguf", ".llamafile" })
+        if (path.size() > ext.size() && path.ends_with(ext))
+            return path.substr(0, path.size() - ext.size());
+    return path;
+}
+
+// parses comma separated list of NAME=PATH
+static bool
+parse_pairs(const char* flag,
+            const char* list,
+            std::vector<std::pair<std::string_view, std::string_view>>* out)
+{
+    for (std::string_view s = list ? list : ""; !s.empty();) {
+        size_t i = s.find(',');
+        std::string_view spec = s.substr(0, i);
+        s = i == std::string_view::npos ? "" : s.substr(i + 1);
+        size_t eq = spec.find('=');
+        if (eq == std::string_view::npos || !eq || eq + 1 == spec.size()) {
+            SLOG("%s wants NAME=PATH but got %.*s",
+                 flag,
+                 (int)spec.size(),
+                 spec.data());
+            return false;
+        }
+        out->emplace_back(spec.substr(0, eq), spec.substr(eq + 1));
+    }
+    return true;
+}
+
+// loads lora adapters that were specified for this model
+//
+// adapters are loaded once and shared by every slot. they're freed by
+// llama.cpp along with the model.
+static bool
+load_loras(Model* model, const char* list)
+{
+    std::vector<std::pair<std::string_view, std::string_view>> pairs;
+    if (!parse_pairs("--lora", list, &pairs))
+        return false;
+    for (const auto& [name, path] : pairs) {
+        std::string spath(path);
+        llama_lora_adapter* lora;
+        if (!(lora = llama_lora_adapter_init(model->model_, spath.c_str()))) {
+            SLOG("%s: failed to load lora adapter", spath.c_str());
+            return false;
+        }
+        model->loras_.emplace_back(name, lora);
+    }
+    return true;
+}
+
+bool
+Model::load()
+{
+    llama_model_params mparams = {
+        .n_gpu_layers = FLAG_n_gpu_layers,
+        .split_mode = (enum llama_split_mode)FLAG_split_mode,
+        .main_gpu = FLAG_main_gpu,
+        .tensor_split = nullptr,
+        .rpc_servers = nullptr,
+        .progress_callback = nullptr,
+        .progress_callback_user_data = nullptr,
+        .kv_overrides = nullptr,
+        .vocab_only = false,
+        .use_mmap = true,
+        .use_mlock = false,
+        .check_tensors = false,
+    };
+    if (!(model_ = llama_load_model_from_file(path_.c_str(), mparams))) {
+        SLOG("%s: failed to load model", path_.c_str());
+        return false;
+    }
+    slots_ = new Slots(model_);
+    if (!slots_->start(FLAG_slots, primary_)) {
+        SLOG("no slots could be created for %s", name_.c_str());
+        unload();
+        return false;
+    }
+    if (primary_ && !load_loras(this, FLAG_lora)) {
+        unload();
+        return false;
+    }
+    embedders_ = new Embedders(model_);
+    size_ = llama_model_size(model_) +
+            llama_context_size(slots_->scheduler_->ctx_);
+    // embedding contexts are made lazily, so one is made now to learn
+    // how much memory the whole pool of them could end up needing
+    if (Embedder* embedder = embedders_->take()) {
+        size_ += llama_context_size(embedder->ctx_) * Embedders::kMaxContexts;
+        embedders_->give(embedder);
+    }
+    return true;
+}
+
+void
+Model::unload()
+{
+    delete embedders_;
+    embedders_ = nullptr;
+    delete slots_;
+    slots_ = nullptr;
+    loras_.clear();
+    llama_free_model(model_);
+    model_ = nullptr;
+}
+
+// returns lora adapter with name, or null if there's none
+llama_lora_adapter*
+Model::lora(std::string_view name)
+{
+    for (const auto& [lora_name, lora] : loras_)
+        if (lora_name == name)
+            return lora;
+    return nullptr;
+}
+
+Models::Models()
+{
+    pthread_cond_init(&cond_, 0);
+    pthread_mutex_init(&lock_, 0);
+}
+
+Models::~Models()
+{
+    for (auto& model : models_)
+        if (model->model_)
+            model->unload();
+    pthread_mutex_destroy(&lock_);
+    pthread_cond_destroy(&cond_);
+}
+
+// registers model without loading it
+bool
+Models::add(std::string_view name, std::string_view path)
+{
+    if (find(name)) {
+        SLOG("model %.*s registered twice", (int)name.size(), name.data());
+        return false;
+    }
+    struct stat st;
+    std::string spath(path);
+    if (stat(spath.c_str(), &st)) {
+        SLOG("%s: %s", spath.c_str(), strerror(errno));
+        return false;
+    }
+    Model* model = new Model;
+    dll_init(&model->elem_);
+    model->name_ = name;
+    model->path_ = spath;
+    model->size_ = st.st_size; // estimate until first loaded
+    models_.emplace_back(model);
+    return true;
+}
+
+// loads primary model and registers the others
+//
+// @param primary is path of model that serves unknown names
+// @param extra is comma separated list of NAME=PATH or null
+// @param budget is max bytes of weights and contexts to keep loaded, or 0
+bool
+Models::start(const char* primary, const char* extra, size_t budget)
+{
+    budget_ = budget;
+    if (!add(name_of_path(primary), primary))
+        return false;
+    primary_ = models_.back().get();
+    primary_->primary_ = true;
+    std::vector<std::pair<std::string_view, std::string_view>> pairs;
+    if (!parse_pairs("--models", extra, &pairs))
+        return false;
+    for (const auto& [name, path] : pairs)
+        if (!add(name, path))
+            return false;
+    if (!primary_->load())
+        return false;
+    loaded_ = primary_->size_;
+    return true;
+}
+
+Model*
+Models::find(std::string_view name)
+{
+    for (auto& model : models_)
+        if (model->name_ == name)
+            return model.get();
+    return nullptr;
+}
+
+// chooses idle models to unload so `need` more bytes fit the budget
+//
+// the caller must hold the lock. the victims are marked busy, so the
+// caller can unload them after releasing the lock.
+std::vector<Model*>
+Models::evict(size_t need)
+{
+    std::vector<Model*> victims;
+    if (!budget_)
+        return victims;
+    for (Dll* e = dll_last(lru_); e && loaded_ + need > budget_;) {
+        Dll* prev = dll_prev(lru_, e);
+        Model* model = MODEL(e);
+        if (!model->refs_) {
+            dll_remove(&lru_, e);
+            model->busy_ = true;
+            loaded_ -= model->size_;
+            victims.push_back(model);
+        }
+        e = prev;
+    }
+    if (loaded_ + need > budget_)
+        SLOG("models in use exceed budget by %zu mb",
+             (loaded_ + need - budget_) >> 20);
+    return victims;
+}
+
+// returns loaded model for request, loading it if necessary
+//
+// names that aren't registered resolve to the primary model, since
+// clients often send whatever name their sdk uses by default. models
+// returned by this function must be passed to release() afterwards.
+//
+// @return model, or null if it failed to load
+Model*
+Models::acquire(std::string_view name)
+{
+    pthread_mutex_lock(&lock_);
+    Model* model = find(name);
+    if (!model)
+        model = primary_;
+    while (model->busy_)
+        pthread_cond_wait(&cond_, &lock_);
+    if (model->model_) {
+        ++model->refs_;
+        if (!model->primary_) {
+            dll_remove(&lru_, &model->elem_);
+            dll_make_first(&lru_, &model->elem_);
+        }
+        pthread_mutex_unlock(&lock_);
+        return model;
+    }
+    model->busy_ = true;
+    std::vector<Model*> victims = evict(model->size_);
+    pthread_mutex_unlock(&lock_);
+
+    for (Model* victim : victims) {
+        SLOG("unloading model %s", victim->name_.c_str());
+        victim->unload();
+    }
+    SLOG("loading model %s", model->name_.c_str());
+    bool ok = model->load();
+
+    // the size we evicted for was only an estimate if this model wasn't
+    // loaded before, since its contexts weren't known until now
+    pthread_mutex_lock(&lock_);
+    for (Model* victim : victims)
+        victim->busy_ = false;
+    if (ok) {
+        loaded_ += model->size_;
+        ++model->refs_;
+        dll_make_first(&lru_, &model->elem_);
+        victims = evict(0);
+    } else {
+        victims.clear();
+    }
+    pthread_mutex_unlock(&lock_);
+
+    for (Model* victim : victims) {
+        SLOG("unloading model %s", victim->name_.c_str());
+        victim->unload();
+    }
+
+    pthread_mutex_lock(&lock_);
+    for (Model* victim : victims)
+        victim->busy_ = false;
+    model->busy_ = false;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&lock_);
+    return ok ? model : nullptr;
+}
+
+void
+Models::release(Model* model)
+{
+    pthread_mutex_lock(&lock_);
+    unassert(model->refs_ > 0);
+    --model->refs_;
+    pthread_mutex_unlock(&lock_);
+}
+
+} // namespace server
+} // namespace lf
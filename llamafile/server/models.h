@@ -0,0 +1,92 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <cosmo.h>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#define MODEL(e) DLL_CONTAINER(Model, elem_, e)
+
+struct llama_model;
+struct llama_lora_adapter;
+
+namespace lf {
+namespace server {
+
+struct Slots;
+struct Embedders;
+
+// weights that can be served, along with their slots and embedders
+//
+// everything except the name and path is null while it isn't loaded.
+struct Model
+{
+    Dll elem_;
+    std::string name_;
+    std::string path_;
+    bool primary_ = false; // never unloaded
+    bool busy_ = false; // being loaded or unloaded
+    int refs_ = 0; // clients that are using this
+    size_t size_ = 0; // bytes of weights and contexts
+    llama_model* model_ = nullptr;
+    Slots* slots_ = nullptr;
+    Embedders* embedders_ = nullptr;
+    std::vector<std::pair<std::string, llama_lora_adapter*>> loras_;
+
+    bool load();
+    void unload();
+    llama_lora_adapter* lora(std::string_view);
+};
+
+// registry of models that requests are routed to by name
+//
+// the primary model is loaded on startup and stays resident. the rest
+// are loaded upon first use and unloaded in least recently used order
+// when the sum of their sizes would exceed the budget. the size of a
+// model counts its weights, plus the kv cache and compute buffers of
+// its slots and embedders, since those can be bigger than the weights.
+// weights are mapped into memory, so reloading a model is cheap if its
+// pages are still in the page cache.
+struct Models
+{
+    std::vector<std::unique_ptr<Model>> models_;
+    Model* primary_ = nullptr;
+    size_t budget_ = 0; // zero means unlimited
+    size_t loaded_ = 0; // bytes of models loaded
+    Dll* lru_ = nullptr; // first elements are most recently used
+    pthread_cond_t cond_;
+    pthread_mutex_t lock_;
+
+    Models();
+    ~Models();
+    bool start(const char*, const char*, size_t);
+    Model* acquire(std::string_view);
+    void release(Model*);
+
+  private:
+    bool add(std::string_view, std::string_view);
+    Model* find(std::string_view);
+    std::vector<Model*> evict(size_t);
+};
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,443 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "poller.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/macros.h"
+#include "llamafile/server/log.h"
+#include "llamafile/server/server.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <net/http/http.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace lf {
+namespace server {
+
+/**
+ * @fileoverview Event driven front end for HTTP connections.
+ *
+ * A worker thread used to own each connection for its whole life, so
+ * an idle keep-alive connection cost as much as a busy one. Now there's
+ * one poller thread which uses epoll to watch the listening socket and
+ * every connection that's between requests. Once all the bytes of some
+ * request have arrived, the poller hands that connection to a worker.
+ * After the worker has sent its response, it parks the connection back
+ * with the poller. That way, thousands of load balancer connections
+ * cost only a file descriptor and a few bytes of memory each, and the
+ * workers are only ever busy doing actual work.
+ *
+ * On platforms without epoll, workers accept() connections themselves
+ * like they always have.
+ */
+
+#define MAX_EVENTS 256
+#define READ_CHUNK 65536
+
+static size_t
+capacity()
+{
+    // same as Client::ibuf_.c
+    return FLAG_http_ibuf_size - getpagesize();
+}
+
+static void
+unlock_mutex(void* arg)
+{
+    pthread_mutex_unlock((pthread_mutex_t*)arg);
+}
+
+static void
+free_conns(Dll** list)
+{
+    Dll* e;
+    while ((e = dll_first(*list))) {
+        dll_remove(list, e);
+        ::close(CONN(e)->fd);
+        delete CONN(e);
+    }
+}
+
+Poller::Poller(Server* server) : server_(server)
+{
+}
+
+Poller::~Poller()
+{
+    unassert(!started_);
+    free_conns(&idle_);
+    free_conns(&ready_);
+    free_conns(&parked_);
+    for (Conn* conn : dead_)
+        delete conn;
+    if (epfd_ != -1)
+        ::close(epfd_);
+    if (pipe_[0] != -1) {
+        ::close(pipe_[0]);
+        ::close(pipe_[1]);
+    }
+    pthread_mutex_destroy(&lock_);
+    pthread_cond_destroy(&cond_);
+}
+
+// returns true if buffer holds an entire http request message
+//
+// requests whose body isn't delimited by a content length, or which
+// expect a 100 continue, are considered complete once the header is,
+// since the worker needs to take it from there. requests that are too
+// big, or malformed, are also considered complete, so a worker will
+// report the error.
+bool
+Poller::is_complete(const char* p, size_t n)
+{
+    if (!n)
+        return false;
+    bool res = true;
+    HttpMessage msg;
+    InitHttpMessage(&msg, kHttpRequest);
+    int hdrlen = ParseHttpMessage(&msg, p, n, capacity());
+    if (!hdrlen) {
+        res = false;
+    } else if (hdrlen > 0 && //
+               !msg.headers[kHttpExpect].a &&
+               !msg.headers[kHttpTransferEncoding].a &&
+               msg.headers[kHttpContentLength].a) {
+        const HttpSlice& h = msg.headers[kHttpContentLength];
+        int64_t cl = ParseContentLength(p + h.a, h.b - h.a);
+        if (cl > 0 && (size_t)(hdrlen + cl) <= capacity())
+            res = (size_t)(hdrlen + cl) <= n;
+    }
+    DestroyHttpMessage(&msg);
+    return res;
+}
+
+bool
+Poller::start()
+{
+    unassert(!started_);
+    if (!IsLinux())
+        return false;
+
+    // thousands of idle connections need thousands of file descriptors
+    struct rlimit rl;
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if ((epfd_ = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        SLOG("epoll_create1 failed %m");
+        return false;
+    }
+    if (pipe2(pipe_, O_NONBLOCK | O_CLOEXEC)) {
+        SLOG("pipe2 failed %m");
+        return false;
+    }
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = this;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, pipe_[0], &ev)) {
+        SLOG("epoll_ctl failed %m");
+        return false;
+    }
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, server_->fd, &ev)) {
+        SLOG("epoll_ctl failed %m");
+        return false;
+    }
+    fcntl(server_->fd, F_SETFL, fcntl(server_->fd, F_GETFL) | O_NONBLOCK);
+
+    errno_t err;
+    chunk_.resize(READ_CHUNK);
+    if ((err = pthread_create(&th_, 0, thread, this))) {
+        SLOG("pthread_create failed %s", strerror(err));
+        fcntl(server_->fd, F_SETFL, fcntl(server_->fd, F_GETFL) & ~O_NONBLOCK);
+        return false;
+    }
+    started_ = true;
+    return true;
+}
+
+void
+Poller::stop()
+{
+    if (!started_)
+        return;
+    stopping_.store(true, std::memory_order_release);
+    char b = 0;
+    write(pipe_[1], &b, 1);
+    pthread_join(th_, 0);
+    started_ = false;
+    pthread_mutex_lock(&lock_);
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&lock_);
+}
+
+// waits for connection that has a complete request
+//
+// this is called by workers. it's a cancelation point.
+//
+// @return connection owned by caller, or null if shutting down
+Conn*
+Poller::take()
+{
+    Conn* conn = nullptr;
+    pthread_mutex_lock(&lock_);
+    pthread_cleanup_push(unlock_mutex, &lock_);
+    while (!ready_ && !stopping_.load(std::memory_order_acquire))
+        pthread_cond_wait(&cond_, &lock_);
+    if (ready_) {
+        Dll* e = dll_first(ready_);
+        dll_remove(&ready_, e);
+        conn = CONN(e);
+    }
+    pthread_cleanup_pop(true);
+    return conn;
+}
+
+// gives keep-alive connection back, after worker has responded
+//
+// if the client pipelined its next request, then it goes straight to
+// the next worker. otherwise it waits in epoll until more bytes come.
+void
+Poller::park(Conn* conn)
+{
+    if (stopping_.load(std::memory_order_acquire)) {
+        ::close(conn->fd);
+        delete conn;
+        return;
+    }
+    bool complete = is_complete(conn->buf.data(), conn->buf.size());
+    if (complete)
+        conn->ready = timespec_real();
+    pthread_mutex_lock(&lock_);
+    if (complete) {
+        dll_make_last(&ready_, &conn->elem_);
+        pthread_cond_signal(&cond_);
+    } else {
+        dll_make_last(&parked_, &conn->elem_);
+    }
+    pthread_mutex_unlock(&lock_);
+    if (!complete) {
+        char b = 0;
+        write(pipe_[1], &b, 1);
+    }
+}
+
+void*
+Poller::thread(void* arg)
+{
+    set_thread_name("poller");
+    ((Poller*)arg)->run();
+    return 0;
+}
+
+void
+Poller::run()
+{
+    epoll_event events[MAX_EVENTS];
+    while (!stopping_.load(std::memory_order_acquire)) {
+        int timeout = listen_paused_ ? 100 : -1;
+        int n = epoll_wait(epfd_, events, MAX_EVENTS, timeout);
+        if (n == -1) {
+            if (errno != EINTR)
+                SLOG("epoll_wait failed %m");
+            continue;
+        }
+        if (listen_paused_) {
+            epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.ptr = nullptr;
+            if (!epoll_ctl(epfd_, EPOLL_CTL_ADD, server_->fd, &ev))
+                listen_paused_ = false;
+        }
+        for (int i = 0; i < n; ++i) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == this) {
+                char buf[64];
+                while (read(pipe_[0], buf, sizeof(buf)) > 0) {
+                }
+                add_parked();
+            } else if (!ptr) {
+                accept_all();
+            } else {
+                receive((Conn*)ptr);
+            }
+        }
+        for (Conn* conn : dead_)
+            delete conn;
+        dead_.clear();
+    }
+    free_conns(&idle_);
+}
+
+void
+Poller::accept_all()
+{
+    for (;;) {
+        unsigned ip;
+        int fd = server_->accept(&ip);
+        set_thread_name("poller");
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                if (evict_oldest())
+                    continue;
+                SLOG("out of file descriptors; pausing accept");
+                epoll_ctl(epfd_, EPOLL_CTL_DEL, server_->fd, 0);
+                listen_paused_ = true;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                SLOG("accept failed %m");
+            }
+            return;
+        }
+        Conn* conn = new Conn;
+        dll_init(&conn->elem_);
+        conn->fd = fd;
+        conn->ip = ip;
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev)) {
+            SLOG("epoll_ctl failed %m");
+            ::close(fd);
+            delete conn;
+            continue;
+        }
+        dll_make_last(&idle_, &conn->elem_);
+    }
+}
+
+// reads whatever bytes are available on idle connection
+void
+Poller::receive(Conn* conn)
+{
+    if (conn->fd == -1)
+        return; // evicted earlier in this batch
+    bool eof = false;
+    for (;;) {
+        size_t want = MIN(chunk_.size(), capacity() - conn->buf.size());
+        if (!want)
+            break;
+        ssize_t got = recv(conn->fd, chunk_.data(), want, MSG_DONTWAIT);
+        if (got > 0) {
+            conn->buf.append(chunk_.data(), got);
+        } else if (!got) {
+            eof = true;
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            eof = true;
+            break;
+        }
+    }
+    if (is_complete(conn->buf.data(), conn->buf.size())) {
+        hand_off(conn);
+    } else if (conn->buf.size() >= capacity()) {
+        // a message whose content length fits is complete by the time
+        // the buffer fills up, so it must be the header that won't fit
+        SLOG("request header exceeds %zu bytes", capacity());
+        static const char kTooBig[] =
+          "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+          "Connection: close\r\n"
+          "Content-Length: 0\r\n"
+          "\r\n";
+        send(conn->fd, kTooBig, sizeof(kTooBig) - 1, MSG_DONTWAIT);
+        drop(conn);
+    } else if (eof) {
+        if (!conn->buf.empty())
+            SLOG("unexpected eof after %zu bytes", conn->buf.size());
+        drop(conn);
+    } else {
+        dll_remove(&idle_, &conn->elem_);
+        dll_make_last(&idle_, &conn->elem_);
+    }
+}
+
+// moves connection with complete request onto ready queue
+void
+Poller::hand_off(Conn* conn)
+{
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, conn->fd, 0);
+    dll_remove(&idle_, &conn->elem_);
+    conn->ready = timespec_real();
+    pthread_mutex_lock(&lock_);
+    dll_make_last(&ready_, &conn->elem_);
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+}
+
+// closes idle connection
+//
+// memory is freed later, since the connection might still be mentioned
+// by other events in the batch we're processing.
+void
+Poller::drop(Conn* conn)
+{
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, conn->fd, 0);
+    dll_remove(&idle_, &conn->elem_);
+    ::close(conn->fd);
+    conn->fd = -1;
+    dead_.emplace_back(conn);
+}
+
+// closes least recently used idle connection
+bool
+Poller::evict_oldest()
+{
+    Dll* e;
+    if (!(e = dll_first(idle_)))
+        return false;
+    SLOG("too many connections; closing oldest idle one");
+    drop(CONN(e));
+    return true;
+}
+
+// starts watching connections that workers gave back
+void
+Poller::add_parked()
+{
+    pthread_mutex_lock(&lock_);
+    Dll* list = parked_;
+    parked_ = nullptr;
+    pthread_mutex_unlock(&lock_);
+    Dll* e;
+    while ((e = dll_first(list))) {
+        dll_remove(&list, e);
+        Conn* conn = CONN(e);
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd_, EPOLL_CTL_ADD, conn->fd, &ev)) {
+            SLOG("epoll_ctl failed %m");
+            ::close(conn->fd);
+            delete conn;
+            continue;
+        }
+        dll_make_last(&idle_, &conn->elem_);
+    }
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,79 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <atomic>
+#include <cosmo.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#define CONN(e) DLL_CONTAINER(Conn, elem_, e)
+
+namespace lf {
+namespace server {
+
+struct Server;
+
+// connection that isn't currently being served by a worker
+struct Conn
+{
+    Dll elem_;
+    int fd;
+    unsigned ip;
+    std::string buf; // bytes received so far
+    timespec ready; // when request became complete
+};
+
+struct Poller
+{
+    explicit Poller(Server*);
+    ~Poller();
+    bool start();
+    void stop();
+    Conn* take();
+    void park(Conn*);
+    static bool is_complete(const char*, size_t);
+
+  private:
+    static void* thread(void*);
+    void run();
+    void accept_all();
+    void receive(Conn*);
+    void hand_off(Conn*);
+    void drop(Conn*);
+    bool evict_oldest();
+    void add_parked();
+
+    Server* server_;
+    int epfd_ = -1;
+    int pipe_[2] = { -1, -1 };
+    pthread_t th_;
+    bool started_ = false;
+    bool listen_paused_ = false;
+    std::atomic_bool stopping_ = ATOMIC_VAR_INIT(false);
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER;
+    Dll* idle_ = nullptr; // only touched by poller thread, lru order
+    Dll* ready_ = nullptr; // complete requests waiting for worker
+    Dll* parked_ = nullptr; // keep-alive connections returned by workers
+    std::vector<Conn*> dead_; // freed after each batch of events
+    std::string chunk_;
+};
+
+} // namespace server
+} // namespace lf
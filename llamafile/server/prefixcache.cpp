@@ -0,0 +1,295 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "prefixcache.h"
+#include "llama.cpp/llama.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/macros.h"
+#include "llamafile/server/log.h"
+#include "llamafile/server/scheduler.h"
+
+#define NODE(e) DLL_CONTAINER(PrefixCache::Node, elem_, e)
+
+namespace lf {
+namespace server {
+
+static int
+count_tokens(const std::vector<Atom>& atoms, int i, int j)
+{
+    int tokens = 0;
+    for (; i < j; ++i)
+        tokens += atoms[i].ctx_used();
+    return tokens;
+}
+
+static std::vector<Atom>
+slice(const std::vector<Atom>& atoms, int i, int j)
+{
+    return std::vector<Atom>(atoms.begin() + i, atoms.begin() + j);
+}
+
+static std::vector<Atom>
+concat(const std::vector<Atom>& a, const std::vector<Atom>& b)
+{
+    std::vector<Atom> r;
+    r.reserve(a.size() + b.size());
+    for (const Atom& atom : a)
+        r.emplace_back(atom);
+    for (const Atom& atom : b)
+        r.emplace_back(atom);
+    return r;
+}
+
+// creates prefix cache
+//
+// @param scheduler owns the shared context
+// @param first_seq is first spare sequence id we're allowed to use
+// @param n_seqs is how many spare sequence ids we're allowed to use
+// @param budget is max number of unique tokens to retain
+PrefixCache::PrefixCache(Scheduler* scheduler,
+                         int first_seq,
+                         int n_seqs,
+                         int budget)
+  : scheduler_(scheduler), budget_(budget)
+{
+    pthread_mutex_init(&lock_, 0);
+    for (int i = n_seqs; i--;)
+        free_seqs_.emplace_back(first_seq + i);
+}
+
+PrefixCache::~PrefixCache()
+{
+    for (auto& kid : root_.kids)
+        destroy(kid.second);
+    pthread_mutex_destroy(&lock_);
+}
+
+void
+PrefixCache::destroy(Node* node)
+{
+    for (auto& kid : node->kids)
+        destroy(kid.second);
+    delete node;
+}
+
+// walks tree as far as the first `n` atoms allow
+PrefixCache::Match
+PrefixCache::find(const std::vector<Atom>& atoms, int n)
+{
+    int i = 0;
+    int tokens = 0;
+    Node* node = &root_;
+    while (i < n) {
+        auto it = node->kids.find(atoms[i]);
+        if (it == node->kids.end())
+            break;
+        int j = 0;
+        Node* kid = it->second;
+        int m = kid->edge.size();
+        while (j < m && i < n && kid->edge[j] == atoms[i]) {
+            tokens += atoms[i].ctx_used();
+            ++i;
+            ++j;
+        }
+        if (j < m)
+            return { kid, i, tokens, j };
+        node = kid;
+    }
+    return { node, i, tokens, (int)node->edge.size() };
+}
+
+// returns some leaf beneath node
+//
+// every leaf beneath a node contains its prefix, so it doesn't matter
+// which one we choose. interior nodes always have at least one kid.
+PrefixCache::Node*
+PrefixCache::leaf(Node* node)
+{
+    while (node->seq_id == -1)
+        node = node->kids.begin()->second;
+    return node;
+}
+
+void
+PrefixCache::touch(Node* node)
+{
+    dll_remove(&lru_, &node->elem_);
+    dll_make_first(&lru_, &node->elem_);
+}
+
+// removes leaf from tree and releases its kv cells
+//
+// removing a leaf might leave its parent with no kids, in which case
+// it gets removed too. if the parent is left with a single kid, then
+// the two are merged, so the tree stays compressed.
+void
+PrefixCache::evict(Node* node)
+{
+    unassert(node->seq_id != -1);
+    llama_context* ctx = scheduler_->ctx_;
+    scheduler_->lock_kv();
+    llama_kv_cache_seq_rm(ctx, node->seq_id, -1, -1);
+    scheduler_->unlock_kv();
+    free_seqs_.emplace_back(node->seq_id);
+    dll_remove(&lru_, &node->elem_);
+    for (;;) {
+        Node* parent = node->parent;
+        used_ -= node->tokens;
+        parent->kids.erase(node->edge[0]);
+        delete node;
+        if (parent == &root_ || parent->seq_id != -1)
+            break;
+        if (parent->kids.empty()) {
+            node = parent;
+            continue;
+        }
+        if (parent->kids.size() == 1) {
+            Node* kid = parent->kids.begin()->second;
+            Node* grandparent = parent->parent;
+            kid->edge = concat(parent->edge, kid->edge);
+            kid->tokens += parent->tokens;
+            kid->parent = grandparent;
+            grandparent->kids.erase(parent->edge[0]);
+            grandparent->kids.emplace(kid->edge[0], kid);
+            delete parent;
+        }
+        break;
+    }
+}
+
+// shares longest cached prefix into sequence
+//
+// if the longest prefix of `atoms` we have cached needs more than
+// `min_tokens` cells, then `seq_id` is cleared and replaced with it.
+// only the first `max_atoms` atoms are considered.
+//
+// @return number of atoms restored, or zero if nothing changed
+int
+PrefixCache::restore(const std::vector<Atom>& atoms,
+                     int max_atoms,
+                     int min_tokens,
+                     int seq_id)
+{
+    int cs;
+    int got = 0;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+    pthread_mutex_lock(&lock_);
+    Match m = find(atoms, MIN(max_atoms, (int)atoms.size()));
+    if (m.tokens > min_tokens) {
+        Node* node = leaf(m.node);
+        touch(node);
+        llama_context* ctx = scheduler_->ctx_;
+        scheduler_->lock_kv();
+        llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+        llama_kv_cache_seq_cp(ctx, node->seq_id, seq_id, 0, m.tokens);
+        scheduler_->unlock_kv();
+        got = m.atoms;
+    }
+    pthread_mutex_unlock(&lock_);
+    pthread_setcancelstate(cs, 0);
+    if (got && FLAG_verbose)
+        SLOG("restored %d tokens from prefix cache", m.tokens);
+    return got;
+}
+
+// adds prompt that's been evaluated in sequence to the cache
+//
+// the kv cells of `seq_id` are shared with a spare sequence, so no
+// computation is needed. if an existing leaf is a prefix of `atoms`
+// then it's extended, since it would otherwise be redundant.
+void
+PrefixCache::insert(const std::vector<Atom>& atoms, int seq_id)
+{
+    int cs;
+    int n = atoms.size();
+    int total = count_tokens(atoms, 0, n);
+    if (!n || total > budget_)
+        return;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+    pthread_mutex_lock(&lock_);
+
+    // make room, noting evictions can change what matches
+    Match m;
+    for (;;) {
+        m = find(atoms, n);
+        if (m.atoms == n) {
+            touch(leaf(m.node));
+            pthread_mutex_unlock(&lock_);
+            pthread_setcancelstate(cs, 0);
+            return;
+        }
+        bool extends = m.node->seq_id != -1 && //
+                       m.edge == (int)m.node->edge.size();
+        if (used_ + total - m.tokens <= budget_ &&
+            (extends || !free_seqs_.empty()))
+            break;
+        unassert(lru_);
+        evict(NODE(dll_last(lru_)));
+    }
+
+    // share cells from slot into a spare sequence
+    Node* node;
+    int new_seq;
+    int old_seq = -1;
+    if (m.node->seq_id != -1 && m.edge == (int)m.node->edge.size()) {
+        // extend leaf that's a prefix of atoms
+        node = m.node;
+        old_seq = node->seq_id;
+        node->edge = concat(node->edge, slice(atoms, m.atoms, n));
+        node->tokens += total - m.tokens;
+        touch(node);
+    } else {
+        Node* parent = m.node;
+        if (m.edge < (int)m.node->edge.size()) {
+            // split edge where atoms diverge
+            Node* kid = m.node;
+            parent = new Node;
+            parent->parent = kid->parent;
+            parent->edge = slice(kid->edge, 0, m.edge);
+            parent->tokens = count_tokens(kid->edge, 0, m.edge);
+            kid->parent->kids.erase(kid->edge[0]);
+            kid->parent->kids.emplace(parent->edge[0], parent);
+            kid->edge = slice(kid->edge, m.edge, kid->edge.size());
+            kid->tokens -= parent->tokens;
+            kid->parent = parent;
+            parent->kids.emplace(kid->edge[0], kid);
+        }
+        node = new Node;
+        node->parent = parent;
+        node->edge = slice(atoms, m.atoms, n);
+        node->tokens = total - m.tokens;
+        dll_init(&node->elem_);
+        dll_make_first(&lru_, &node->elem_);
+        parent->kids.emplace(node->edge[0], node);
+    }
+    if ((new_seq = old_seq) == -1) {
+        new_seq = free_seqs_.back();
+        free_seqs_.pop_back();
+    }
+    node->seq_id = new_seq;
+    used_ += total - m.tokens;
+    llama_context* ctx = scheduler_->ctx_;
+    scheduler_->lock_kv();
+    llama_kv_cache_seq_rm(ctx, new_seq, -1, -1);
+    llama_kv_cache_seq_cp(ctx, seq_id, new_seq, 0, total);
+    scheduler_->unlock_kv();
+
+    pthread_mutex_unlock(&lock_);
+    pthread_setcancelstate(cs, 0);
+}
+
+} // namespace server
+} // namespace lf
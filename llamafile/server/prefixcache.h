@@ -0,0 +1,81 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "atom.h"
+#include <cosmo.h>
+#include <map>
+#include <pthread.h>
+#include <vector>
+
+namespace lf {
+namespace server {
+
+struct Scheduler;
+
+// radix tree of prompt prefixes whose kv cache cells are kept alive
+//
+// every leaf of the tree owns a spare sequence id in the scheduler's
+// shared context. when a slot needs a prefix that some leaf contains,
+// the cells get shared into the slot's sequence by reference with the
+// llama_kv_cache_seq_cp() function, which costs nothing to compute.
+// leaves are evicted in lru order to keep the number of unique tokens
+// held by the tree within budget.
+struct PrefixCache
+{
+    static constexpr int kMaxEntries = 32;
+
+    struct Node
+    {
+        Dll elem_;
+        Node* parent = nullptr;
+        std::vector<Atom> edge;
+        std::map<Atom, Node*> kids;
+        int tokens = 0; // kv cells needed by edge
+        int seq_id = -1; // only for leaves
+    };
+
+    struct Match
+    {
+        Node* node;
+        int atoms; // atoms matched from start of query
+        int tokens; // kv cells needed by matched atoms
+        int edge; // atoms matched from start of node's edge
+    };
+
+    Scheduler* scheduler_;
+    int budget_;
+    int used_ = 0;
+    Node root_;
+    Dll* lru_ = nullptr; // most recently used first
+    std::vector<int> free_seqs_;
+    pthread_mutex_t lock_;
+
+    PrefixCache(Scheduler*, int, int, int);
+    ~PrefixCache();
+    int restore(const std::vector<Atom>&, int, int, int);
+    void insert(const std::vector<Atom>&, int);
+
+  private:
+    Match find(const std::vector<Atom>&, int);
+    Node* leaf(Node*);
+    void touch(Node*);
+    void evict(Node*);
+    void destroy(Node*);
+};
+
+} // namespace server
+} // namespace lf
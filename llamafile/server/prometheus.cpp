@@ -0,0 +1,212 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "client.h"
+#include "llamafile/server/fairqueue.h"
+#include "llamafile/server/metrics.h"
+#include "llamafile/server/models.h"
+#include "llamafile/server/server.h"
+#include "llamafile/server/slots.h"
+#include "llamafile/server/worker.h"
+#include <cstdio>
+#include <string>
+
+namespace lf {
+namespace server {
+
+// smallest and largest histogram buckets we report, as powers of two
+// microseconds. they're powers of two since Histogram's buckets are.
+#define MIN_BUCKET 6
+#define MAX_BUCKET 35
+
+static void
+append_metric(std::string* out,
+              const char* name,
+              const char* type,
+              const char* help,
+              double value)
+{
+    char buf[64];
+    *out += "# HELP ";
+    *out += name;
+    *out += ' ';
+    *out += help;
+    *out += "\n# TYPE ";
+    *out += name;
+    *out += ' ';
+    *out += type;
+    *out += '\n';
+    *out += name;
+    snprintf(buf, sizeof(buf), " %.17g\n", value);
+    *out += buf;
+}
+
+// appends histogram of microseconds as prometheus histogram of seconds
+static void
+append_histogram(std::string* out,
+                 const char* name,
+                 const char* help,
+                 const Histogram& h)
+{
+    char buf[128];
+    *out += "# HELP ";
+    *out += name;
+    *out += ' ';
+    *out += help;
+    *out += "\n# TYPE ";
+    *out += name;
+    *out += " histogram\n";
+    int i = 0;
+    uint64_t seen = 0;
+    for (int e = MIN_BUCKET; e <= MAX_BUCKET; ++e) {
+        int end = Histogram::bucket(1ull << e);
+        for (; i < end; ++i)
+            seen += h.buckets_[i].load(std::memory_order_relaxed);
+        snprintf(buf,
+                 sizeof(buf),
+                 "%s_bucket{le=\"%.6g\"} %llu\n",
+                 name,
+                 (1ull << e) * 1e-6,
+                 (unsigned long long)seen);
+        *out += buf;
+    }
+    snprintf(buf,
+             sizeof(buf),
+             "%s_bucket{le=\"+Inf\"} %llu\n"
+             "%s_sum %.6f\n"
+             "%s_count %llu\n",
+             name,
+             (unsigned long long)h.count(),
+             name,
+             h.sum() * 1e-6,
+             name,
+             (unsigned long long)h.count());
+    *out += buf;
+}
+
+// exports metrics in prometheus text format
+//
+// rates, e.g. prefill tokens per second, or the fraction of prompt
+// tokens that were reused from the kv cache, are meant to be computed
+// by dividing the rate() of one counter by another.
+bool
+Client::metrics()
+{
+    uint64_t counters[kCounters];
+    Histogram* timers = new Histogram[kTimers];
+    metrics_merge(counters, timers);
+
+    Server* server = worker_->server_;
+    int active_workers = 0;
+    server->lock();
+    for (Dll* e = dll_first(server->active_workers); e;
+         e = dll_next(server->active_workers, e))
+        ++active_workers;
+    server->unlock();
+
+    Slots* slots = server->models_->primary_->slots_;
+    pthread_mutex_lock(&slots->lock_);
+    int busy_slots = slots->slots_.size() - slots->free_count_;
+    int queued = slots->queue_.size();
+    pthread_mutex_unlock(&slots->lock_);
+
+    dump_.clear();
+    append_metric(&dump_,
+                  "llamafiler_workers",
+                  "gauge",
+                  "Number of HTTP worker threads.",
+                  server->worker_count.load(std::memory_order_acquire));
+    append_metric(&dump_,
+                  "llamafiler_active_workers",
+                  "gauge",
+                  "Number of worker threads serving a request.",
+                  active_workers);
+    append_metric(&dump_,
+                  "llamafiler_slots",
+                  "gauge",
+                  "Number of slots for completions.",
+                  slots->slots_.size());
+    append_metric(&dump_,
+                  "llamafiler_busy_slots",
+                  "gauge",
+                  "Number of slots being used by a request.",
+                  busy_slots);
+    append_metric(&dump_,
+                  "llamafiler_queued_requests",
+                  "gauge",
+                  "Number of requests waiting to be admitted.",
+                  queued);
+    append_metric(&dump_,
+                  "llamafiler_rejected_requests_total",
+                  "counter",
+                  "Requests turned away because the server was busy.",
+                  counters[kRejectedRequests]);
+    append_metric(&dump_,
+                  "llamafiler_prompt_tokens_total",
+                  "counter",
+                  "Tokens in prompts that were prefilled.",
+                  counters[kPromptTokens]);
+    append_metric(&dump_,
+                  "llamafiler_prompt_tokens_reused_total",
+                  "counter",
+                  "Prompt tokens that were already in the KV cache.",
+                  counters[kReusedTokens]);
+    append_metric(&dump_,
+                  "llamafiler_prefill_tokens_total",
+                  "counter",
+                  "Tokens evaluated by prefills.",
+                  counters[kPrefillTokens]);
+    append_metric(&dump_,
+                  "llamafiler_prefill_seconds_total",
+                  "counter",
+                  "Time spent evaluating prefills.",
+                  counters[kPrefillMicros] * 1e-6);
+    append_metric(&dump_,
+                  "llamafiler_decode_tokens_total",
+                  "counter",
+                  "Completion tokens generated.",
+                  counters[kDecodeTokens]);
+    append_metric(&dump_,
+                  "llamafiler_decode_seconds_total",
+                  "counter",
+                  "Time spent generating completion tokens.",
+                  counters[kDecodeMicros] * 1e-6);
+    append_histogram(&dump_,
+                     "llamafiler_queue_wait_seconds",
+                     "Time requests waited for a worker thread.",
+                     timers[kQueueWait]);
+    append_histogram(&dump_,
+                     "llamafiler_slot_wait_seconds",
+                     "Time requests waited to be given slots.",
+                     timers[kSlotWait]);
+    append_histogram(&dump_,
+                     "llamafiler_time_to_first_token_seconds",
+                     "Time until the first completion token.",
+                     timers[kTimeToFirstToken]);
+    append_histogram(&dump_,
+                     "llamafiler_inter_token_latency_seconds",
+                     "Time between completion tokens.",
+                     timers[kInterTokenLatency]);
+    delete[] timers;
+
+    char* p = append_http_response_message(obuf_.p, 200);
+    p = stpcpy(p, "Content-Type: text/plain; version=0.0.4\r\n");
+    return send_response(obuf_.p, p, dump_);
+}
+
+} // namespace server
+} // namespace lf
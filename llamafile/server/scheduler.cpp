@@ -0,0 +1,476 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "scheduler.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/macros.h"
+#include "llamafile/server/log.h"
+#include "llamafile/server/utils.h"
+#include "llamafile/version.h"
+#include <cassert>
+#include <cstring>
+
+namespace lf {
+namespace server {
+
+/**
+ * @fileoverview Continuous batching for chat completion slots.
+ *
+ * Every slot owns a sequence id inside one shared `llama_context`. When
+ * a slot wants to evaluate something, it submits a `Work` and blocks in
+ * decode(). The first thread to find the scheduler idle becomes leader,
+ * packs everything that's pending into a single `llama_batch`, decodes
+ * it, and then copies each requester's logits row out of the context.
+ * Threads that arrive while a decode is running get packed into the one
+ * that happens next. That way N concurrent chats cost one pass over the
+ * weights per token, rather than N passes, and we don't need a thread.
+ *
+ * Each step evaluates at most `--step-budget` tokens. Slots that are in
+ * the middle of generating only need a token or two, so they're always
+ * scheduled first. The remaining budget goes to prompt prefills, which
+ * may be much larger than the budget, in which case the leader slices
+ * off as much as fits and leaves the rest pending for later steps. This
+ * bounds the inter-token latency of streaming clients, regardless of
+ * how big the prompts are that other clients are sending.
+ *
+ * Sequences draw cells from the kv cache as they grow, so it needn't
+ * be big enough for every slot to use its whole context at once. Steps
+ * are limited to the cells that are free. Free cells aren't always in
+ * one piece, so a step that doesn't fit defragments the cache, or else
+ * shrinks, before anything fails. Work that can't get any cell fails,
+ * so its slot can give up, rather than waiting forever.
+ *
+ * A step that runs for a while is watched, so that if every client it
+ * is working for hangs up, the graph gets aborted midway. Steps shared
+ * with anyone who's still connected always run to completion.
+ */
+
+// work this small is considered to be generating rather than prefilling
+#define DECODE_MAX 8
+
+// how long a step runs before we start checking for hangups
+#define POLL_INTERVAL_MS 100
+
+static std::string
+generate_system_fingerprint(const llama_context_params* cparams)
+{
+    uint64_t h = 0;
+    h ^= __fnv(LLAMAFILE_VERSION_STRING, sizeof(LLAMAFILE_VERSION_STRING));
+    h ^= __fnv(cparams, sizeof(*cparams));
+    std::string b = "fp_";
+    for (int j = 0; j < 64 / 5; ++j) {
+        b += "abcdefghijklmnopqrstuvwxyz012345"[h & 31];
+        h >>= 5;
+    }
+    return b;
+}
+
+Scheduler::Scheduler(llama_model* model) : model_(model)
+{
+    pthread_cond_init(&cond_, 0);
+    pthread_mutex_init(&lock_, 0);
+}
+
+Scheduler::~Scheduler()
+{
+    unassert(dll_is_empty(pending_));
+    if (ctx_) {
+        llama_batch_free(embds_);
+        llama_batch_free(tokens_);
+        llama_free(ctx_);
+    }
+    pthread_mutex_destroy(&lock_);
+    pthread_cond_destroy(&cond_);
+}
+
+// creates context shared by `n_seq` sequences of up to `n_ctx` tokens
+//
+// the sequences share a pool of `n_kv` cells. `n_spare_seq` additional
+// sequence ids are reserved, along with room for `n_spare_ctx` more
+// cells, for use by the prefix cache. if the pool is smaller than what
+// every sequence could use, then kv defragmentation gets turned on, so
+// cells freed by one sequence can be reused by big steps of another.
+bool
+Scheduler::start(int n_seq,
+                 int n_ctx,
+                 int n_kv,
+                 int n_spare_seq,
+                 int n_spare_ctx)
+{
+    unassert(!ctx_);
+    llama_context_params cparams = {};
+    cparams.embeddings = false;
+    cparams.embeddings_only = false;
+    cparams.logits_all = false;
+    cparams.seed = 12345;
+    cparams.n_ctx = n_kv + n_spare_ctx;
+    cparams.n_batch = FLAG_batch;
+    cparams.n_ubatch = FLAG_ubatch;
+    cparams.n_seq_max = n_seq + n_spare_seq;
+    cparams.n_threads = MIN(FLAG_threads, 20);
+    cparams.n_threads_batch = FLAG_threads_batch;
+    cparams.rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED;
+    cparams.pooling_type = LLAMA_POOLING_TYPE_UNSPECIFIED;
+    cparams.attention_type = LLAMA_ATTENTION_TYPE_UNSPECIFIED;
+    cparams.rope_freq_base = 0;
+    cparams.yarn_ext_factor = -1;
+    cparams.yarn_attn_factor = 1;
+    cparams.yarn_beta_fast = 32;
+    cparams.yarn_beta_slow = 1;
+    cparams.yarn_orig_ctx = 0;
+    cparams.defrag_thold = n_kv < (long)n_ctx * n_seq ? .1 : -1;
+    cparams.offload_kqv = true;
+    cparams.type_k = (ggml_type)FLAG_cache_type_k;
+    cparams.type_v = (ggml_type)FLAG_cache_type_v;
+    cparams.flash_attn = FLAG_flash_attn;
+    system_fingerprint_ = generate_system_fingerprint(&cparams);
+    if (!(ctx_ = llama_new_context_with_model(model_, cparams)))
+        return false;
+    n_ctx_ = n_ctx;
+    n_kv_ = llama_n_ctx(ctx_) - n_spare_ctx;
+    n_batch_ = llama_n_batch(ctx_);
+    n_budget_ = FLAG_step_budget;
+    if (n_budget_ <= 0 || n_budget_ > n_batch_)
+        n_budget_ = n_batch_;
+    n_vocab_ = llama_n_vocab(model_);
+    n_embd_ = llama_n_embd(model_);
+    tokens_ = llama_batch_init(n_batch_, 0, 1);
+    embds_ = llama_batch_init(n_batch_, n_embd_, 1);
+    llama_set_abort_callback(ctx_, on_abort, this);
+    return true;
+}
+
+// returns number of cells in kv cache that slots are free to use
+//
+// the cells reserved for the prefix cache aren't counted. since cells
+// that are used by the prefix cache count as used too, this is a lower
+// bound. the caller must have exclusive access to the kv cache.
+int
+Scheduler::kv_free()
+{
+    return n_kv_ - llama_get_kv_cache_used_cells(ctx_);
+}
+
+// removes pending work that can be evaluated together
+//
+// all the work in a step must be the same kind (tokens versus image
+// embeddings) and use the same lora adapter, since adapters are set on
+// the whole context. the kind and adapter of the oldest pending work
+// get chosen.
+//
+// we first take work that's generating, in fifo order. then we give
+// any remaining budget to prefills in fifo order, slicing the last one
+// if it doesn't fit entirely. the slice size is stored in `len`. if the
+// kv cache is full, then the oldest work is taken with a `len` of 0,
+// which tells step() to fail it.
+Dll*
+Scheduler::gather()
+{
+    int used = 0;
+    Dll* taken = nullptr;
+    int budget = MIN(n_budget_, kv_free());
+    if (budget <= 0) {
+        Dll* e = dll_first(pending_);
+        WORK(e)->len = 0;
+        dll_remove(&pending_, e);
+        dll_make_last(&taken, e);
+        return taken;
+    }
+    bool want_tokens = !!WORK(dll_first(pending_))->tokens;
+    llama_lora_adapter* want_lora = WORK(dll_first(pending_))->lora;
+    for (int pass = 0; pass < 2 && used < budget; ++pass) {
+        for (Dll* e = dll_first(pending_); e && used < budget;) {
+            Dll* next = dll_next(pending_, e);
+            Work* w = WORK(e);
+            int left = w->n - w->off;
+            if (!!w->tokens == want_tokens && w->lora == want_lora &&
+                (pass || left <= DECODE_MAX)) {
+                w->len = MIN(left, budget - used);
+                if (w->len == left || pass) {
+                    used += w->len;
+                    dll_remove(&pending_, e);
+                    dll_make_last(&taken, e);
+                }
+            }
+            e = next;
+        }
+    }
+    return taken;
+}
+
+// evaluates batch of work
+//
+// this must be called by the leader without holding the lock. if the
+// decode fails then every participant learns about it, since there's
+// no way to tell which one of them caused the problem. logits are only
+// requested for the last `n_logits` tokens of each work, which are the
+// rows that get copied into its `logits` array in order.
+//
+// enough cells may be free for the batch, without enough of them being
+// contiguous. if llama_decode() says so, the kv cache is defragmented
+// and we try again. if that's not enough, then the batch gets halved
+// until it fits, and the work left over waits for a later step.
+void
+Scheduler::step(Dll* taken)
+{
+    int i, rc;
+    bool defragged = false;
+    bool is_tokens = !!WORK(dll_first(taken))->tokens;
+    llama_batch& batch = is_tokens ? tokens_ : embds_;
+    for (;;) {
+        i = 0;
+        for (Dll* e = dll_first(taken); e; e = dll_next(taken, e)) {
+            Work* w = WORK(e);
+            for (int j = w->off; j < w->off + w->len; ++j, ++i) {
+                if (is_tokens) {
+                    batch.token[i] = w->tokens[j];
+                } else {
+                    memcpy(batch.embd + (size_t)i * n_embd_,
+                           w->embd + (size_t)j * n_embd_,
+                           n_embd_ * sizeof(float));
+                }
+                batch.pos[i] = w->pos + j;
+                batch.n_seq_id[i] = 1;
+                batch.seq_id[i][0] = w->seq_id;
+                batch.logits[i] = w->logits && j >= w->n - w->n_logits;
+            }
+        }
+        batch.n_tokens = i;
+        if (!i) {
+            SLOG("kv cache is full");
+            for (Dll* e = dll_first(taken); e; e = dll_next(taken, e))
+                WORK(e)->rc = 1;
+            return;
+        }
+        // steps that only generate are limited by memory bandwidth, so
+        // they want fewer threads than prefills. it's an upper bound,
+        // since cores are leased from g_core_manager, which hands out
+        // smaller shares when other contexts (e.g. other models or
+        // embedders) are busy too
+        int n_threads = MIN(FLAG_threads, 20);
+        for (Dll* e = dll_first(taken); e; e = dll_next(taken, e))
+            if (WORK(e)->len > DECODE_MAX)
+                n_threads = FLAG_threads_batch;
+        if (n_threads != n_threads_) {
+            llama_set_n_threads(ctx_, n_threads, n_threads);
+            n_threads_ = n_threads;
+        }
+        llama_lora_adapter* lora = WORK(dll_first(taken))->lora;
+        if (lora != lora_) {
+            llama_lora_adapter_clear(ctx_);
+            if (lora)
+                llama_lora_adapter_set(ctx_, lora, 1.0f);
+            lora_ = lora;
+        }
+        stepping_ = taken;
+        next_poll_ =
+          timespec_add(timespec_mono(), timespec_frommillis(POLL_INTERVAL_MS));
+        rc = llama_decode(ctx_, batch);
+        stepping_ = nullptr;
+        if (rc != 1)
+            break;
+        // ubatches that fit before the one that didn't are already in
+        // the kv cache, so they need to be taken out before retrying
+        for (Dll* e = dll_first(taken); e; e = dll_next(taken, e))
+            llama_kv_cache_seq_rm(
+              ctx_, WORK(e)->seq_id, WORK(e)->pos + WORK(e)->off, -1);
+        if (!defragged) {
+            SLOG("defragmenting kv cache to fit batch of %d", i);
+            llama_kv_cache_defrag(ctx_);
+            llama_kv_cache_update(ctx_);
+            defragged = true;
+        } else if (i > 1) {
+            int keep = i / 2;
+            for (Dll* e = dll_first(taken); e; e = dll_next(taken, e)) {
+                WORK(e)->len = MIN(WORK(e)->len, keep);
+                keep -= WORK(e)->len;
+            }
+        } else {
+            break;
+        }
+    }
+    if (rc == 2) {
+        SLOG("aborted batch of %d since its clients hung up", i);
+    } else if (rc) {
+        SLOG("llama_decode failed with %d for batch of %d", rc, i);
+    }
+    i = 0;
+    for (Dll* e = dll_first(taken); e; e = dll_next(taken, e)) {
+        Work* w = WORK(e);
+        int first = w->n - w->n_logits;
+        for (int j = w->off; j < w->off + w->len; ++j, ++i)
+            if (!rc && w->logits && j >= first)
+                memcpy(w->logits + (size_t)(j - first) * n_vocab_,
+                       llama_get_logits_ith(ctx_, i),
+                       n_vocab_ * sizeof(float));
+        w->off += w->len;
+        w->rc = rc;
+    }
+}
+
+// returns true if every client of the current step has gone away
+//
+// this is called by ggml between each op of the graph, so sockets are
+// only polled once per interval.
+bool
+Scheduler::is_abandoned()
+{
+    if (!stepping_)
+        return false;
+    timespec now = timespec_mono();
+    if (timespec_cmp(now, next_poll_) < 0)
+        return false;
+    next_poll_ = timespec_add(now, timespec_frommillis(POLL_INTERVAL_MS));
+    for (Dll* e = dll_first(stepping_); e; e = dll_next(stepping_, e))
+        if (WORK(e)->fd == -1 || !is_hung_up(WORK(e)->fd))
+            return false;
+    return true;
+}
+
+bool
+Scheduler::on_abort(void* arg)
+{
+    return ((Scheduler*)arg)->is_abandoned();
+}
+
+// evaluates work, batching it with other slots
+//
+// this function blocks until all `n` works have been evaluated. they
+// are enqueued together, so the ones that are small enough will share
+// the same step. cancelation is deferred while we're in here, since
+// either some other thread has a pointer to our work, or everyone else
+// is depending on us to lead. work may be of any size; big prefills
+// will be spread across steps.
+//
+// @return 0 on success, otherwise llama_decode() error code
+int
+Scheduler::decode(Work* works, int n)
+{
+    int cs;
+    unassert(n > 0);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+    for (int i = 0; i < n; ++i) {
+        unassert(works[i].n > 0);
+        works[i].rc = 0;
+        works[i].off = 0;
+        works[i].done = false;
+        dll_init(&works[i].elem_);
+    }
+    pthread_mutex_lock(&lock_);
+    for (int i = 0; i < n; ++i)
+        dll_make_last(&pending_, &works[i].elem_);
+    for (int i = 0; i < n;) {
+        if (works[i].done) {
+            ++i;
+            continue;
+        }
+        if (busy_) {
+            pthread_cond_wait(&cond_, &lock_);
+            continue;
+        }
+        busy_ = true;
+        Dll* taken = gather();
+        pthread_mutex_unlock(&lock_);
+        step(taken);
+        pthread_mutex_lock(&lock_);
+        // unfinished prefills go back to the front so they keep their
+        // place in line ahead of anything that arrived while we worked
+        Dll* unfinished = nullptr;
+        while (taken) {
+            Dll* e = dll_first(taken);
+            dll_remove(&taken, e);
+            Work* w = WORK(e);
+            if (w->rc || w->off == w->n) {
+                w->done = true;
+            } else {
+                dll_make_last(&unfinished, e);
+            }
+        }
+        while (unfinished) {
+            Dll* e = dll_last(unfinished);
+            dll_remove(&unfinished, e);
+            dll_make_first(&pending_, e);
+        }
+        busy_ = false;
+        pthread_cond_broadcast(&cond_);
+    }
+    pthread_mutex_unlock(&lock_);
+    pthread_setcancelstate(cs, 0);
+    for (int i = 0; i < n; ++i)
+        if (works[i].rc)
+            return works[i].rc;
+    return 0;
+}
+
+int
+Scheduler::decode(Work* work)
+{
+    return decode(work, 1);
+}
+
+// obtains exclusive access to kv cache
+//
+// callers must hold this when changing the cache outside of decode(),
+// e.g. llama_kv_cache_seq_rm(), since llama.cpp isn't thread safe.
+void
+Scheduler::lock_kv()
+{
+    int cs;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+    pthread_mutex_lock(&lock_);
+    while (busy_)
+        pthread_cond_wait(&cond_, &lock_);
+    busy_ = true;
+    pthread_mutex_unlock(&lock_);
+    pthread_setcancelstate(cs, 0);
+}
+
+void
+Scheduler::unlock_kv()
+{
+    pthread_mutex_lock(&lock_);
+    busy_ = false;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&lock_);
+}
+
+bool
+Scheduler::seq_rm(int seq_id, int p0, int p1)
+{
+    lock_kv();
+    bool ok = llama_kv_cache_seq_rm(ctx_, seq_id, p0, p1);
+    unlock_kv();
+    return ok;
+}
+
+// replaces sequence `dst` with the first `n` positions of `src`
+//
+// the kv cells are shared rather than copied, so forking a long prompt
+// costs nothing besides bookkeeping.
+bool
+Scheduler::seq_fork(int src, int dst, int n)
+{
+    lock_kv();
+    bool ok = llama_kv_cache_seq_rm(ctx_, dst, 0, -1);
+    if (ok)
+        llama_kv_cache_seq_cp(ctx_, src, dst, 0, n);
+    unlock_kv();
+    return ok;
+}
+
+} // namespace server
+} // namespace lf
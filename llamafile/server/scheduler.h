@@ -0,0 +1,89 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "llama.cpp/llama.h"
+#include <cosmo.h>
+#include <pthread.h>
+#include <string>
+
+#define WORK(e) DLL_CONTAINER(Work, elem_, e)
+
+namespace lf {
+namespace server {
+
+// contribution of a single sequence to a batched decode step
+struct Work
+{
+    Dll elem_;
+    int seq_id = 0;
+    int fd = -1; // connection of client that wants this, or -1
+    int pos = 0; // position of first token in sequence
+    int n = 0; // number of tokens or embeddings
+    const int* tokens = nullptr; // either this
+    const float* embd = nullptr; // or this
+    float* logits = nullptr; // receives logits of last tokens, or null
+    int n_logits = 1; // how many trailing tokens want logits
+    llama_lora_adapter* lora = nullptr; // adapter to apply, or null
+    int rc = 0; // result of llama_decode()
+    int off = 0; // how many have been evaluated so far
+    int len = 0; // how many are being evaluated by current step
+    bool done = false;
+};
+
+struct Scheduler
+{
+    llama_model* model_;
+    llama_context* ctx_ = nullptr;
+    llama_batch tokens_ = {};
+    llama_batch embds_ = {};
+    int n_vocab_ = 0;
+    int n_embd_ = 0;
+    int n_batch_ = 0;
+    int n_budget_ = 0; // max tokens per step
+    int n_ctx_ = 0; // per sequence
+    int n_kv_ = 0; // cells in kv cache for slots
+    std::string system_fingerprint_;
+    pthread_cond_t cond_;
+    pthread_mutex_t lock_;
+    bool busy_ = false;
+    Dll* pending_ = nullptr;
+    Dll* stepping_ = nullptr; // work in current step
+    llama_lora_adapter* lora_ = nullptr; // adapter applied to context
+    int n_threads_ = 0; // threads wanted by context
+    timespec next_poll_;
+
+    explicit Scheduler(llama_model*);
+    ~Scheduler();
+    bool start(int, int, int, int, int);
+    int kv_free();
+    int decode(Work*);
+    int decode(Work*, int);
+    void lock_kv();
+    void unlock_kv();
+    bool seq_rm(int, int, int);
+    bool seq_fork(int, int, int);
+
+  private:
+    Dll* gather();
+    void step(Dll*);
+    bool is_abandoned();
+    static bool on_abort(void*);
+};
+
+} // namespace server
+} // namespace lf
@@ -19,6 +19,8 @@
 #include "llamafile/crash.h"
 #include "llamafile/llamafile.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/models.h"
+#include "llamafile/server/poller.h"
 #include "llamafile/server/server.h"
 #include "llamafile/server/slots.h"
 #include "llamafile/server/worker.h"
@@ -33,8 +35,7 @@
 namespace lf {
 namespace server {
 
-Server::Server(int fd, Slots* slots, llama_model* model)
-  : fd(fd), slots_(slots), model_(model)
+Server::Server(int fd, Models* models) : fd(fd), models_(models)
 {
 }
 
@@ -44,6 +45,7 @@ Server::~Server()
     npassert(!worker_count.load(std::memory_order_relaxed));
     npassert(dll_is_empty(active_workers));
     npassert(dll_is_empty(idle_workers));
+    delete poller_;
     pthread_mutex_destroy(&lock_);
     pthread_cond_destroy(&cond_);
 }
@@ -104,7 +106,7 @@ Server::spawn()
     errno_t err;
     Worker* worker;
     pthread_attr_t attr;
-    worker = new Worker(this, model_);
+    worker = new Worker(this, models_->primary_->model_);
     pthread_attr_init(&attr);
     pthread_attr_setguardsize(&attr, sysconf(_SC_PAGESIZE));
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
@@ -155,6 +157,22 @@ Server::accept(unsigned* out_ip)
     return clifd;
 }
 
+// multiplexes connections between requests onto a single thread
+//
+// @return false if unsupported, in which case workers accept() instead
+bool
+Server::start_poller()
+{
+    Poller* poller = new Poller(this);
+    if (!poller->start()) {
+        SLOG("epoll not available; each connection will need a worker");
+        delete poller;
+        return false;
+    }
+    poller_ = poller;
+    return true;
+}
+
 void
 Server::run()
 {
@@ -179,6 +197,10 @@ Server::shutdown()
     if (IsWindows())
         close();
 
+    // stop handing out connections
+    if (poller_)
+        poller_->stop();
+
     // kill workers
     lock();
     for (Dll* e = dll_first(idle_workers); e; e = dll_next(idle_workers, e))
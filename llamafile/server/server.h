@@ -16,23 +16,24 @@
 // limitations under the License.
 
 #pragma once
+#include "assets.h"
 #include <atomic>
 #include <cosmo.h>
 #include <pthread.h>
 
-struct llama_model;
-
 namespace lf {
 namespace server {
 
-struct Slots;
+struct Models;
+struct Poller;
 
 struct Server
 {
-    Server(int, Slots*, llama_model*);
+    Server(int, Models*);
     ~Server();
 
     int accept(unsigned*);
+    bool start_poller();
     errno_t spawn();
     void terminate();
     void shutdown();
@@ -44,14 +45,15 @@ struct Server
     void wait();
 
     int fd;
-    Slots* slots_;
-    llama_model* model_;
+    Models* models_;
+    Poller* poller_ = nullptr; // null if workers accept() themselves
     Dll* idle_workers = nullptr;
     Dll* active_workers = nullptr;
     pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER;
     pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
     std::atomic_int worker_count = ATOMIC_VAR_INIT(0);
     std::atomic_bool terminated = ATOMIC_VAR_INIT(false);
+    Assets assets_;
 };
 
 extern Server* g_server;
@@ -23,10 +23,14 @@
 #include "llamafile/llamafile.h"
 #include "llamafile/macros.h"
 #include "llamafile/server/atom.h"
+#include "llamafile/server/embedcache.h"
 #include "llamafile/server/image.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/metrics.h"
+#include "llamafile/server/prefixcache.h"
+#include "llamafile/server/scheduler.h"
+#include "llamafile/server/spill.h"
 #include "llamafile/vector.h"
-#include "llamafile/version.h"
 #include <algorithm>
 #include <cassert>
 #include <cosmo.h>
@@ -34,29 +38,6 @@
 namespace lf {
 namespace server {
 
-static int
-choose_ctx_size(llama_model* model)
-{
-    int n_ctx_train = llama_n_ctx_train(model);
-    if (FLAG_ctx_size <= 0 || FLAG_ctx_size > n_ctx_train)
-        return n_ctx_train;
-    return FLAG_ctx_size;
-}
-
-static std::string
-generate_system_fingerprint(const llama_context_params* cparams)
-{
-    uint64_t h = 0;
-    h ^= __fnv(LLAMAFILE_VERSION_STRING, sizeof(LLAMAFILE_VERSION_STRING));
-    h ^= __fnv(cparams, sizeof(*cparams));
-    std::string b = "fp_";
-    for (int j = 0; j < 64 / 5; ++j) {
-        b += "abcdefghijklmnopqrstuvwxyz012345"[h & 31];
-        h >>= 5;
-    }
-    return b;
-}
-
 // having multiple images in the context window is janky right now, so
 // let's erase old images from the chat history until we find out more
 static std::vector<Atom>
@@ -94,53 +75,40 @@ Slot::describe_error(int err)
     }
 }
 
-Slot::Slot(llama_model* model) : model_(model)
+Slot::Slot(llama_model* model,
+           Scheduler* scheduler,
+           PrefixCache* prefixes,
+           Spill* spill,
+           EmbedCache* embeds,
+           int seq_id)
+  : seq_id_(seq_id),
+    model_(model),
+    scheduler_(scheduler),
+    prefixes_(prefixes),
+    spill_(spill),
+    embeds_(embeds)
 {
     dll_init(&elem_);
 }
 
 Slot::~Slot()
 {
-    if (ctx_)
-        llama_free(ctx_);
     if (clip_ctx_)
         clip_free(clip_ctx_);
 }
 
+// prepares slot for use
+//
+// @param mmproj is path of vision model weights, or null
 bool
-Slot::start()
+Slot::start(const char* mmproj)
 {
     unassert(!ctx_);
-    llama_context_params cparams = {};
-    cparams.embeddings = false;
-    cparams.embeddings_only = false;
-    cparams.logits_all = false;
-    cparams.seed = 12345;
-    cparams.n_ctx = choose_ctx_size(model_);
-    cparams.n_batch = FLAG_batch;
-    cparams.n_ubatch = FLAG_ubatch;
-    cparams.n_seq_max = 1;
-    cparams.n_threads = MIN(FLAG_threads, 20);
-    cparams.n_threads_batch = FLAG_threads;
-    cparams.rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED;
-    cparams.pooling_type = LLAMA_POOLING_TYPE_UNSPECIFIED;
-    cparams.attention_type = LLAMA_ATTENTION_TYPE_UNSPECIFIED;
-    cparams.rope_freq_base = 0;
-    cparams.yarn_ext_factor = -1;
-    cparams.yarn_attn_factor = 1;
-    cparams.yarn_beta_fast = 32;
-    cparams.yarn_beta_slow = 1;
-    cparams.yarn_orig_ctx = 0;
-    cparams.defrag_thold = -1;
-    cparams.offload_kqv = true;
-    cparams.type_k = GGML_TYPE_F16;
-    cparams.type_v = GGML_TYPE_F16;
-    cparams.flash_attn = FLAG_flash_attn;
-    system_fingerprint_ = generate_system_fingerprint(&cparams);
-    if (!(ctx_ = llama_new_context_with_model(model_, cparams)))
-        return false;
-    if (FLAG_mmproj)
-        if (!(clip_ctx_ = clip_model_load(FLAG_mmproj, FLAG_verbose)))
+    ctx_ = scheduler_->ctx_;
+    system_fingerprint_ = scheduler_->system_fingerprint_;
+    logits_.resize(scheduler_->n_vocab_);
+    if (mmproj)
+        if (!(clip_ctx_ = clip_model_load(mmproj, FLAG_verbose)))
             return false;
     return true;
 }
@@ -148,7 +116,7 @@ Slot::start()
 int
 Slot::ctx_size() const
 {
-    return llama_n_ctx(ctx_);
+    return scheduler_->n_ctx_;
 }
 
 int
@@ -177,61 +145,226 @@ Slot::eval_tokens(const std::vector<int>& tokens)
     int used = ctx_used();
     if (used + N > ctx_size())
         return out_of_context;
-    std::vector<int> toks(tokens); // TODO(jart): is copying really needed?
-    for (int i = 0; i < N; i += FLAG_batch) {
-        int n_eval = N - i;
-        if (n_eval > FLAG_batch)
-            n_eval = FLAG_batch;
-        if (llama_decode(ctx_,
-                         { .n_tokens = n_eval,
-                           .token = &toks[i],
-                           .all_pos_0 = used,
-                           .all_pos_1 = 1 }))
-            return decode_token_failed;
-        for (int j = 0; j < n_eval; ++j)
-            history_.emplace_back(toks[i + j]);
-        used += n_eval;
+    Work work;
+    work.seq_id = seq_id_;
+    work.fd = fd_;
+    work.lora = lora_;
+    work.pos = used;
+    work.n = N;
+    work.tokens = tokens.data();
+    work.logits = logits_.data();
+    if (scheduler_->decode(&work)) {
+        scheduler_->seq_rm(seq_id_, used, -1);
+        return decode_token_failed;
     }
+    for (int i = 0; i < N; ++i)
+        history_.emplace_back(tokens[i]);
     return N;
 }
 
+// evaluates tokens, keeping the logits computed for each one
+//
+// this is used to verify speculative drafts, since the row for token i
+// says what the model would have predicted after it. `logits` receives
+// one row per token, and the last row is also copied to our logits.
+//
+// @return number of tokens evaluated, otherwise negative error code
 int
-Slot::eval_image(const std::string_view& bytes)
+Slot::eval_draft(const std::vector<int>& tokens, std::vector<float>* logits)
 {
     if (!ctx_)
         return uninitialized;
-    if (!clip_ctx_)
-        return no_vision_model;
+    if (tokens.empty())
+        return 0;
+    int N = tokens.size();
+    int used = ctx_used();
+    if (used + N > ctx_size())
+        return out_of_context;
+    logits->resize((size_t)N * logits_.size());
+    Work work;
+    work.seq_id = seq_id_;
+    work.fd = fd_;
+    work.lora = lora_;
+    work.pos = used;
+    work.n = N;
+    work.tokens = tokens.data();
+    work.logits = logits->data();
+    work.n_logits = N;
+    if (scheduler_->decode(&work)) {
+        scheduler_->seq_rm(seq_id_, used, -1);
+        return decode_token_failed;
+    }
+    std::copy(logits->end() - logits_.size(), logits->end(), logits_.begin());
+    for (int i = 0; i < N; ++i)
+        history_.emplace_back(tokens[i]);
+    return N;
+}
+
+// forgets the last `n` atoms that were evaluated, which must be tokens
+//
+// our logits aren't touched, so the caller needs to provide the right
+// ones before sampling again, e.g. using the rows from eval_draft().
+void
+Slot::rewind(int n)
+{
+    if (n <= 0)
+        return;
+    unassert(n <= (int)history_.size());
+    scheduler_->seq_rm(seq_id_, ctx_used() - n, -1);
+    history_.resize(history_.size() - n);
+}
+
+// forgets kv cache of idle slot, so its cells can be used by others
+//
+// if there's a spill file, then the conversation is copied to `spilled`
+// first, so the caller can save it to disk once it's released its locks
+// and the conversation can be resumed without prefilling it all again.
+//
+// @return number of cells that were used by this slot
+int
+Slot::evict(std::vector<SpillState>* spilled)
+{
+    int used = ctx_used();
+    if (!used)
+        return 0;
+    if (spill_ && !lora_ && used >= Spill::kMinTokens) {
+        spilled->emplace_back();
+        if (!spill_->copy(history_, seq_id_, &spilled->back()))
+            spilled->pop_back();
+    }
+    scheduler_->seq_rm(seq_id_, -1, -1);
+    history_.clear();
+    return used;
+}
+
+// chooses lora adapter for subsequent evaluations
+//
+// the kv cache computed with some other adapter can't be reused, so
+// it gets forgotten if the adapter changes.
+void
+Slot::use_lora(llama_lora_adapter* lora)
+{
+    if (lora == lora_)
+        return;
+    if (!history_.empty()) {
+        scheduler_->seq_rm(seq_id_, -1, -1);
+        history_.clear();
+    }
+    lora_ = lora;
+}
+
+// evaluates one token in each of `n` slots using a single decode step
+//
+// this is how parallel sampling generates its choices, since the choices
+// all advance in lockstep and there's no reason to wait on each other.
+//
+// @return n on success, otherwise negative error code
+int
+Slot::eval_token_each(Slot** slots, const int* tokens, int n)
+{
+    if (n <= 0)
+        return 0;
+    Scheduler* scheduler = slots[0]->scheduler_;
+    std::vector<Work> works(n);
+    for (int i = 0; i < n; ++i) {
+        Slot* slot = slots[i];
+        if (!slot->ctx_)
+            return uninitialized;
+        int used = slot->ctx_used();
+        if (used + 1 > slot->ctx_size())
+            return out_of_context;
+        works[i].seq_id = slot->seq_id_;
+        works[i].fd = slot->fd_;
+        works[i].lora = slot->lora_;
+        works[i].pos = used;
+        works[i].n = 1;
+        works[i].tokens = &tokens[i];
+        works[i].logits = slot->logits_.data();
+    }
+    if (scheduler->decode(works.data(), n)) {
+        for (int i = 0; i < n; ++i)
+            scheduler->seq_rm(works[i].seq_id, works[i].pos, -1);
+        return decode_token_failed;
+    }
+    for (int i = 0; i < n; ++i)
+        slots[i]->history_.emplace_back(tokens[i]);
+    return n;
+}
+
+// makes `dst` a copy of this slot, without evaluating anything
+//
+// the kv cache of our sequence gets shared with the sequence of `dst`,
+// and our logits are copied, so it can start sampling right away.
+bool
+Slot::fork(Slot* dst)
+{
+    if (!ctx_ || !dst->ctx_)
+        return false;
+    if (!scheduler_->seq_fork(seq_id_, dst->seq_id_, ctx_used())) {
+        dst->history_.clear();
+        return false;
+    }
+    dst->history_.clear();
+    for (const Atom& atom : history_)
+        dst->history_.emplace_back(atom);
+    dst->logits_ = logits_;
+    return true;
+}
+
+// runs image through the vision model, unless it's been seen before
+std::shared_ptr<const ImageEmbed>
+Slot::embed_image(const Image& image)
+{
+    std::shared_ptr<const ImageEmbed> embed;
+    if (embeds_ && (embed = embeds_->get(image)))
+        return embed;
+    const std::string& bytes = image.bytes();
     llava_image_embed* image_embed =
       llava_image_embed_make_with_bytes(clip_ctx_,
                                         FLAG_threads_batch,
                                         (const unsigned char*)bytes.data(),
                                         bytes.size());
     if (!image_embed)
+        return embed;
+    int n_embd = llama_n_embd(model_);
+    ImageEmbed* res = new ImageEmbed;
+    res->n = image_embed->n_image_pos;
+    res->data.assign(image_embed->embed,
+                     image_embed->embed + (size_t)res->n * n_embd);
+    llava_image_embed_free(image_embed);
+    embed.reset(res);
+    if (embeds_)
+        embeds_->put(image, embed);
+    return embed;
+}
+
+int
+Slot::eval_image(const Image& image)
+{
+    if (!ctx_)
+        return uninitialized;
+    if (!clip_ctx_)
+        return no_vision_model;
+    std::shared_ptr<const ImageEmbed> embed = embed_image(image);
+    if (!embed)
         return encode_image_failed;
     int used = ctx_used();
-    int N = image_embed->n_image_pos;
-    if (used + N > ctx_size()) {
-        llava_image_embed_free(image_embed);
+    int N = embed->n;
+    if (used + N > ctx_size())
         return out_of_context;
+    Work work;
+    work.seq_id = seq_id_;
+    work.fd = fd_;
+    work.lora = lora_;
+    work.pos = used;
+    work.n = N;
+    work.embd = embed->data.data();
+    work.logits = logits_.data();
+    if (scheduler_->decode(&work)) {
+        scheduler_->seq_rm(seq_id_, used, -1);
+        return decode_image_failed;
     }
-    int n_embd = llama_n_embd(llama_get_model(ctx_));
-    for (int i = 0; i < N; i += FLAG_batch) {
-        int n_eval = N - i;
-        if (n_eval > FLAG_batch)
-            n_eval = FLAG_batch;
-        if (llama_decode(ctx_,
-                         { .n_tokens = n_eval,
-                           .embd = image_embed->embed + i * n_embd,
-                           .all_pos_0 = used,
-                           .all_pos_1 = 1 })) {
-            llava_image_embed_free(image_embed);
-            return decode_image_failed;
-        }
-        used += n_eval;
-    }
-    llava_image_embed_free(image_embed);
-    history_.emplace_back(new Image(bytes, N));
+    history_.emplace_back(new Image(image, N));
     return N;
 }
 
@@ -249,7 +382,7 @@ Slot::eval_atoms(const std::vector<Atom>& atoms)
                 return rc;
             token_count += rc;
             tokens.clear();
-            if ((rc = eval_image(atom.image().bytes())) < 0)
+            if ((rc = eval_image(atom.image())) < 0)
                 return rc;
             token_count += rc;
         }
@@ -280,23 +413,65 @@ Slot::prefill(const std::vector<Atom>& atoms_)
         reuse_atoms -= 1;
         reuse_tokens -= history_[reuse_atoms].ctx_used();
     }
-    if (used_tokens > reuse_tokens) {
+    // the prefix cache and spill file only hold kv computed without any
+    // lora adapter, so slots using one can only reuse their own history
+    PrefixCache* prefixes = lora_ ? nullptr : prefixes_;
+    Spill* spill = lora_ ? nullptr : spill_;
+    if (spill && used_tokens - reuse_tokens >= Spill::kMinTokens)
+        spill->save(history_, seq_id_);
+    int rc;
+    int cached_atoms = 0;
+    int cached_tokens = reuse_tokens;
+    if (prefixes && (cached_atoms = prefixes->restore(
+                       atoms, (int)atoms.size() - 1, reuse_tokens, seq_id_))) {
+        cached_tokens = 0;
+        for (int i = 0; i < cached_atoms; ++i)
+            cached_tokens += atoms[i].ctx_used();
+    }
+    if (spill && (rc = spill->restore(
+                    atoms, (int)atoms.size() - 1, cached_tokens, seq_id_))) {
+        if (rc > 0) {
+            cached_atoms = rc;
+        } else {
+            // restoring cleared our sequence, so prefill all of it
+            cached_atoms = 0;
+            reuse_atoms = 0;
+            reuse_tokens = 0;
+            history_.clear();
+        }
+    }
+    if (cached_atoms) {
+        // prefix cache or disk had more in common than our own history
+        erase_tokens = used_tokens;
+        history_.clear();
+        for (int i = 0; i < cached_atoms; ++i)
+            history_.emplace_back(atoms[i]);
+        reuse_atoms = history_.size();
+        reuse_tokens = ctx_used();
+    } else if (used_tokens > reuse_tokens) {
         erase_tokens = used_tokens - reuse_tokens;
-        if (llama_kv_cache_seq_rm(ctx_, 0, reuse_tokens, -1)) {
+        if (scheduler_->seq_rm(seq_id_, reuse_tokens, -1)) {
             history_.resize(reuse_atoms);
         } else {
             SLOG("failed to remove tokens from KV cache");
             reuse_atoms = 0;
             reuse_tokens = 0;
             erase_tokens = used_tokens;
-            llama_kv_cache_clear(ctx_);
+            scheduler_->seq_rm(seq_id_, -1, -1);
             history_.clear();
         }
     }
     std::vector<Atom> new_atoms(atoms.begin() + reuse_atoms, atoms.end());
-    int rc;
+    timespec started = timespec_real();
     if ((rc = eval_atoms(new_atoms)) < 0)
         return rc;
+    metrics_count(kPrefillTokens, rc);
+    metrics_count(kPrefillMicros,
+                  timespec_tomicros(timespec_sub(timespec_real(), started)));
+    metrics_count(kPromptTokens, reuse_tokens + rc);
+    metrics_count(kReusedTokens, reuse_tokens);
+    if (prefixes)
+        prefixes->insert(history_, seq_id_);
     int token_count = reuse_tokens + rc;
     SLOG("prefilled %zu tokens (after removing %zu and reusing %zu)",
          token_count,
@@ -17,6 +17,7 @@
 
 #pragma once
 #include <cosmo.h>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -24,6 +25,7 @@
 
 struct llama_context;
 struct llama_model;
+struct llama_lora_adapter;
 struct clip_ctx;
 
 namespace lf {
@@ -31,6 +33,12 @@ namespace server {
 
 struct Atom;
 struct Image;
+struct Scheduler;
+struct PrefixCache;
+struct Spill;
+struct SpillState;
+struct EmbedCache;
+struct ImageEmbed;
 
 struct Slot
 {
@@ -47,24 +55,42 @@ struct Slot
     static const char* describe_error(int);
 
     Dll elem_;
+    int seq_id_;
+    int fd_ = -1; // connection of client using slot, or -1
+    timespec taken_; // when slot was last taken
     llama_model* model_;
+    Scheduler* scheduler_;
+    PrefixCache* prefixes_; // may be null
+    Spill* spill_; // may be null
+    EmbedCache* embeds_; // may be null
     clip_ctx* clip_ctx_ = nullptr;
-    llama_context* ctx_ = nullptr;
+    llama_context* ctx_ = nullptr; // shared
+    llama_lora_adapter* lora_ = nullptr; // adapter of history, or null
     std::vector<Atom> history_;
+    std::vector<float> logits_;
     std::string system_fingerprint_;
 
     ~Slot();
-    explicit Slot(llama_model*);
+    Slot(llama_model*, Scheduler*, PrefixCache*, Spill*, EmbedCache*, int);
     int ctx_size() const;
     int ctx_used() const;
-    bool start();
+    bool start(const char*);
     int eval_token(int);
-    int eval_image(const std::string_view&);
+    static int eval_token_each(Slot**, const int*, int);
+    int eval_draft(const std::vector<int>&, std::vector<float>*);
+    void rewind(int);
+    int evict(std::vector<SpillState>*);
+    void use_lora(llama_lora_adapter*);
+    int eval_image(const Image&);
     int eval_tokens(const std::vector<int>&);
     int eval_atoms(const std::vector<Atom>&);
     int prefill(const std::vector<Atom>&);
+    bool fork(Slot*);
     void tokenize(std::vector<Atom>*, std::string_view, bool);
     void dump(std::string*);
+
+  private:
+    std::shared_ptr<const ImageEmbed> embed_image(const Image&);
 };
 
 } // namespace server
@@ -17,11 +17,20 @@
 
 #include "slots.h"
 #include "llamafile/server/atom.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/macros.h"
+#include "llamafile/server/embedcache.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/metrics.h"
+#include "llamafile/server/prefixcache.h"
+#include "llamafile/server/scheduler.h"
 #include "llamafile/server/slot.h"
 #include "llamafile/server/slot_entry.h"
+#include "llamafile/server/spill.h"
+#include "llamafile/server/utils.h"
 #include "llamafile/vector.h"
 #include <cassert>
+#include <cmath>
 
 namespace lf {
 namespace server {
@@ -44,15 +53,56 @@ Slots::size()
     return slots_.size();
 }
 
+static int
+choose_ctx_size(llama_model* model)
+{
+    int n_ctx_train = llama_n_ctx_train(model);
+    if (FLAG_ctx_size <= 0 || FLAG_ctx_size > n_ctx_train)
+        return n_ctx_train;
+    return FLAG_ctx_size;
+}
+
+// creates `count` slots sharing one context
+//
+// the spill file and vision model are only used by the primary model,
+// since they were specified for it.
 int
-Slots::start(int count)
+Slots::start(int count, bool primary)
 {
     int made = 0;
+    int n_ctx = choose_ctx_size(model_);
+    int n_kv = n_ctx * count;
+    if (FLAG_kv_size > 0 && FLAG_kv_size < n_kv)
+        n_kv = MAX(FLAG_kv_size, n_ctx);
+    int n_cache_ctx = FLAG_prefix_cache < 0 ? n_ctx : FLAG_prefix_cache;
+    int n_cache_seq = n_cache_ctx > 0 ? PrefixCache::kMaxEntries : 0;
+    scheduler_.reset(new Scheduler(model_));
+    if (!scheduler_->start(count, n_ctx, n_kv, n_cache_seq, n_cache_ctx)) {
+        SLOG("failed to create shared context for %d slots", count);
+        return 0;
+    }
+    if (n_cache_seq)
+        prefixes_.reset(
+          new PrefixCache(scheduler_.get(), count, n_cache_seq, n_cache_ctx));
+    const char* mmproj = primary ? FLAG_mmproj : nullptr;
+    if (FLAG_spill && primary) {
+        spill_.reset(new Spill(scheduler_.get(), FLAG_model));
+        if (!spill_->open(FLAG_spill, (size_t)FLAG_spill_size << 20))
+            spill_.reset();
+    }
+    if (mmproj && FLAG_image_cache > 0)
+        embeds_.reset(new EmbedCache((size_t)FLAG_image_cache << 20));
     pthread_mutex_lock(&lock_);
     for (int i = 0; i < count; ++i) {
-        Slot* slot = new Slot(model_);
-        if (slot->start()) {
+        Slot* slot = new Slot(model_,
+                              scheduler_.get(),
+                              prefixes_.get(),
+                              spill_.get(),
+                              embeds_.get(),
+                              i);
+        if (slot->start(mmproj)) {
             ++made;
+            ++free_count_;
             slots_.emplace_back(slot);
             dll_make_last(&free_slots_, &slot->elem_);
         } else {
@@ -63,39 +113,201 @@ Slots::start(int count)
         pthread_cond_broadcast(&cond_);
     pthread_mutex_unlock(&lock_);
     if (made < count)
-        SLOG("could only make %d out of %d slots", made);
+        SLOG("could only make %d out of %d slots", made, count);
     return made;
 }
 
-Slot*
-Slots::take(const std::vector<Atom>& prefix)
+static int
+count_tokens(const std::vector<Atom>& atoms, int n)
+{
+    int tokens = 0;
+    for (int i = 0; i < n; ++i)
+        tokens += atoms[i].ctx_used();
+    return tokens;
+}
+
+// picks idle slots to evict, so `prefix` can be prefilled into `out`
+//
+// the slots we're about to use will give back some cells, since their
+// history gets replaced. if that's not enough, then idle slots get
+// chosen, least recently used first, until their cells make up for the
+// rest. the victims are taken off the free list, so nobody else takes
+// them while they're evicted without the lock held.
+//
+// @return number of cells needed beyond what `out` gives back
+int
+Slots::choose_victims(const std::vector<Atom>& prefix,
+                      Slot** out,
+                      int n,
+                      int cpl,
+                      std::vector<Slot*>* victims)
+{
+    int reused = count_tokens(prefix, cpl);
+    int need = count_tokens(prefix, prefix.size()) - reused + n;
+    need -= out[0]->ctx_used() - reused;
+    for (int i = 1; i < n; ++i)
+        need -= out[i]->ctx_used();
+    int marked = 0;
+    for (Dll* e = dll_last(free_slots_); e && marked < need;) {
+        Dll* prev = dll_prev(free_slots_, e);
+        if (int used = SLOT(e)->ctx_used()) {
+            dll_remove(&free_slots_, e);
+            --free_count_;
+            victims->push_back(SLOT(e));
+            marked += used;
+        }
+        e = prev;
+    }
+    return need;
+}
+
+// evicts victims until the kv cache has room for `need` more cells
+//
+// this happens without the lock held, since it waits for the scheduler
+// to finish its current step, and copies the conversations that are to
+// be saved in the spill file into `spilled`.
+void
+Slots::reclaim(int need,
+               const std::vector<Slot*>& victims,
+               std::vector<SpillState>* spilled)
 {
+    if (victims.empty())
+        return;
+    scheduler_->lock_kv();
+    int have = scheduler_->kv_free();
+    scheduler_->unlock_kv();
+    for (Slot* slot : victims) {
+        if (have >= need)
+            break;
+        if (int freed = slot->evict(spilled)) {
+            SLOG("evicted idle slot %d to free %d kv cells",
+                 slot->seq_id_,
+                 freed);
+            have += freed;
+        }
+    }
+}
+
+// puts victims back where they were at the end of the free list
+static void
+release_victims(void* arg)
+{
+    Slots* slots = (Slots*)((void**)arg)[0];
+    std::vector<Slot*>* victims = (std::vector<Slot*>*)((void**)arg)[1];
+    pthread_mutex_lock(&slots->lock_);
+    for (auto i = victims->rbegin(); i != victims->rend(); ++i)
+        dll_make_last(&slots->free_slots_, &(*i)->elem_);
+    slots->free_count_ += victims->size();
+    pthread_cond_broadcast(&slots->cond_);
+    pthread_mutex_unlock(&slots->lock_);
+}
+
+static void
+abandon_ticket(void* arg)
+{
+    Slots* slots = (Slots*)((void**)arg)[0];
+    Ticket* ticket = (Ticket*)((void**)arg)[1];
+    slots->queue_.remove(ticket);
+    pthread_cond_broadcast(&slots->cond_);
+    pthread_mutex_unlock(&slots->lock_);
+}
+
+// takes `ticket->n` slots for a request, once it's the ticket's turn
+//
+// requests are admitted in weighted fair order, see FairQueue. the head
+// of the queue waits until enough slots are free, and nobody may pass
+// it, so requests for several slots for parallel sampling don't starve.
+// all slots get taken at the same time, so two requests can't deadlock
+// each other. the first slot is the one with the longest prefix of our
+// prompt in its kv cache that was computed using the same lora adapter,
+// since it does the prefill. the rest are least recently used, because
+// they'll have their kv cache replaced by a fork of the first.
+//
+// @param lora is adapter the request wants, or null
+// @return admitted on success, otherwise negative error code
+int
+Slots::take(const std::vector<Atom>& prefix,
+            llama_lora_adapter* lora,
+            Slot** out,
+            Ticket* ticket)
+{
+    int n = ticket->n;
+    if (n <= 0 || n > (int)slots_.size())
+        return too_many_slots;
     pthread_mutex_lock(&lock_);
+    if (!queue_.push(ticket, FLAG_queue_depth)) {
+        pthread_mutex_unlock(&lock_);
+        return queue_full;
+    }
+    int rc = admitted;
+    int need = 0;
+    std::vector<Slot*> victims;
+    std::vector<SpillState> spilled;
+    timespec started = timespec_real();
+    void* arg[2] = { this, ticket };
+    pthread_cleanup_push(abandon_ticket, arg);
     for (;;) {
-
-        // find slot with longest matching prefix
-        // favoring least recently used if multiple ones
+        if (queue_.head() == ticket && free_count_ >= n)
+            break;
+        timespec now = timespec_real();
+        if (timespec_cmp(now, ticket->deadline) >= 0) {
+            rc = queue_timeout;
+            break;
+        }
+        if (ticket->fd != -1 && is_hung_up(ticket->fd)) {
+            rc = hung_up;
+            break;
+        }
+        // wake up every second to notice clients hanging up
+        timespec wake = timespec_add(now, timespec_frommillis(1000));
+        if (timespec_cmp(wake, ticket->deadline) > 0)
+            wake = ticket->deadline;
+        pthread_cond_timedwait(&cond_, &lock_, &wake);
+    }
+    if (rc == admitted) {
         int best_cpl = 0;
         Dll* best_slot = nullptr;
-        for (Dll* e = dll_first(free_slots_); e; e = dll_next(free_slots_, e)) {
-            int cpl = vector_common_prefix_length(SLOT(e)->history_, prefix);
+        for (Dll* e = dll_first(free_slots_); e;
+             e = dll_next(free_slots_, e)) {
+            int cpl = 0;
+            if (SLOT(e)->lora_ == lora)
+                cpl = vector_common_prefix_length(SLOT(e)->history_, prefix);
             if (cpl >= best_cpl) {
                 best_cpl = cpl;
                 best_slot = e;
             }
         }
-
-        // return borrowed pointer to best slot
-        if (best_slot) {
-            dll_remove(&free_slots_, best_slot);
-            pthread_mutex_unlock(&lock_);
-            return SLOT(best_slot);
+        dll_remove(&free_slots_, best_slot);
+        out[0] = SLOT(best_slot);
+        for (int i = 1; i < n; ++i) {
+            Dll* e = dll_last(free_slots_);
+            dll_remove(&free_slots_, e);
+            out[i] = SLOT(e);
         }
-
-        // all slots are being used
-        SLOG("waiting for slot to be relinquished...");
-        pthread_cond_wait(&cond_, &lock_);
+        free_count_ -= n;
+        need = choose_victims(prefix, out, n, best_cpl, &victims);
+        timespec now = timespec_real();
+        for (int i = 0; i < n; ++i)
+            out[i]->taken_ = now;
+    } else {
+        SLOG("request from %s wasn't admitted: %s",
+             ticket->tenant.c_str(),
+             rc == queue_timeout ? "timed out" : "hung up");
+    }
+    pthread_cleanup_pop(true);
+    if (rc == admitted) {
+        for (int i = 0; i < n; ++i)
+            out[i]->use_lora(lora);
+        void* arg2[2] = { this, &victims };
+        pthread_cleanup_push(release_victims, arg2);
+        reclaim(need, victims, &spilled);
+        pthread_cleanup_pop(true);
+        for (const SpillState& state : spilled)
+            spill_->write(state);
     }
+    metrics_time(kSlotWait,
+                 timespec_tomicros(timespec_sub(timespec_real(), started)));
+    return rc;
 }
 
 void
@@ -103,10 +315,38 @@ Slots::give(Slot* slot)
 {
     SLOG("relinquishing slot");
     unassert(slot);
+    slot->fd_ = -1;
+    double held =
+      timespec_tomicros(timespec_sub(timespec_real(), slot->taken_)) * 1e-6;
     pthread_mutex_lock(&lock_);
+    hold_ = hold_ ? hold_ * .9 + held * .1 : held;
     dll_make_first(&free_slots_, &slot->elem_);
-    pthread_cond_signal(&cond_);
+    ++free_count_;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&lock_);
+}
+
+// estimates how many seconds a rejected client should wait
+//
+// this is how long it'd take for everyone in the queue to be served, if
+// requests keep holding slots for as long as they have been lately.
+int
+Slots::retry_after()
+{
+    pthread_mutex_lock(&lock_);
+    double wait = hold_ * (1 + (double)queue_.size() / slots_.size());
     pthread_mutex_unlock(&lock_);
+    return MAX(1, MIN(3600, (int)ceil(wait)));
+}
+
+// returns when request of given priority should give up waiting
+timespec
+Slots::deadline(Priority priority)
+{
+    int timeout = FLAG_queue_timeout;
+    if (priority == kPriorityBatch)
+        timeout *= 4;
+    return timespec_add(timespec_real(), timespec_frommillis(timeout * 1000L));
 }
 
 } // namespace server
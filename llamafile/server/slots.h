@@ -16,11 +16,13 @@
 // limitations under the License.
 
 #pragma once
+#include "fairqueue.h"
 #include <memory>
 #include <pthread.h>
 #include <vector>
 
 struct llama_model;
+struct llama_lora_adapter;
 struct Dll;
 
 namespace lf {
@@ -29,25 +31,56 @@ namespace server {
 class Atom;
 class SlotEntry;
 struct Slot;
+struct Scheduler;
+struct PrefixCache;
+struct Spill;
+struct SpillState;
+struct EmbedCache;
 
 struct Slots
 {
+    enum
+    {
+        admitted,
+        too_many_slots = -1,
+        queue_full = -2,
+        queue_timeout = -3,
+        hung_up = -4,
+    };
+
     llama_model* model_;
     pthread_cond_t cond_;
     pthread_mutex_t lock_;
+    std::unique_ptr<Scheduler> scheduler_;
+    std::unique_ptr<PrefixCache> prefixes_;
+    std::unique_ptr<Spill> spill_;
+    std::unique_ptr<EmbedCache> embeds_;
     std::vector<std::unique_ptr<Slot>> slots_;
 
     // first elements are most recently used
     // last elements are least recently used
     Dll* free_slots_ = nullptr;
+    int free_count_ = 0;
+
+    // requests waiting for slots
+    FairQueue queue_;
+    double hold_ = 0; // moving average of seconds slots are held
 
     explicit Slots(llama_model*);
     ~Slots();
     size_t size();
-    int start(int);
+    int start(int, bool);
     void tokenize(std::vector<Atom>*, std::string_view, bool);
-    Slot* take(const std::vector<Atom>&);
+    int take(const std::vector<Atom>&, llama_lora_adapter*, Slot**, Ticket*);
     void give(Slot*);
+    int retry_after();
+    int choose_victims(const std::vector<Atom>&,
+                       Slot**,
+                       int,
+                       int,
+                       std::vector<Slot*>*);
+    void reclaim(int, const std::vector<Slot*>&, std::vector<SpillState>*);
+    static timespec deadline(Priority);
 };
 
 } // namespace server
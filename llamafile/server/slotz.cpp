@@ -16,6 +16,7 @@
 // limitations under the License.
 
 #include "client.h"
+#include "models.h"
 #include "server.h"
 #include "slot.h"
 #include "slots.h"
@@ -32,9 +33,10 @@ Client::slotz()
     int id = atoi(s.c_str());
     if (id < 0)
         return send_error(400);
-    if (id >= worker_->server_->slots_->size())
+    Slots* slots = worker_->server_->models_->primary_->slots_;
+    if (id >= slots->size())
         return send_error(404);
-    Slot* slot = worker_->server_->slots_->slots_[id].get();
+    Slot* slot = slots->slots_[id].get();
     std::string dump;
     slot->dump(&dump);
     char* p = append_http_response_message(obuf_.p, 200);
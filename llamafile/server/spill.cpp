@@ -0,0 +1,398 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "spill.h"
+#include "llama.cpp/llama.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/server/atom.h"
+#include "llamafile/server/image.h"
+#include "llamafile/server/log.h"
+#include "llamafile/server/scheduler.h"
+#include <cosmo.h>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lf {
+namespace server {
+
+/**
+ * @fileoverview Disk-backed KV cache for evicted conversations.
+ *
+ * When a slot is about to throw away a long conversation, so it can be
+ * used by someone else, llama_state_seq_get_data() is used to copy the
+ * sequence's KV cells into a memory mapped file. If the user returns,
+ * the prompt they send will begin with the atoms of that conversation,
+ * in which case llama_state_seq_set_data() restores it. Loading a few
+ * hundred megabytes from disk is much faster than re-prefilling.
+ *
+ * Records are page aligned and appended to the file in a ring. Record
+ * bodies are written before their headers, and a new record always
+ * overwrites the header of the old record it displaces first. So if a
+ * header is valid, then the whole record is valid. That means the file
+ * can be indexed at startup by scanning for headers, and we don't need
+ * to maintain a table of contents.
+ *
+ * Records only match the model file they were computed by. It's named
+ * by its path, size, and modified time, along with the context params,
+ * since a fine-tuned model may otherwise look exactly like its base.
+ */
+
+#define SPILL_MAGIC 0x4c4c4950534c4c4full // "OLLSPILL"
+#define SPILL_ALIGN 4096
+
+struct SpillHeader
+{
+    uint64_t magic;
+    uint64_t gen;
+    uint64_t key;
+    uint64_t model;
+    uint64_t state_size;
+    uint32_t n_atoms;
+    uint32_t n_tokens;
+    uint64_t check;
+};
+
+static size_t
+align_up(size_t n)
+{
+    return (n + SPILL_ALIGN - 1) & -SPILL_ALIGN;
+}
+
+static uint64_t
+mix(uint64_t h, uint64_t x)
+{
+    h ^= x + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9;
+    return h ^ h >> 29;
+}
+
+// returns value that identifies atom across process restarts
+static uint64_t
+fingerprint(const Atom& atom)
+{
+    if (atom.is_image()) {
+        uint64_t h;
+        memcpy(&h, atom.image().hash(), sizeof(h));
+        return 2ull << 62 | h >> 2;
+    }
+    return (unsigned)atom.token();
+}
+
+static uint64_t
+check_header(const SpillHeader* h)
+{
+    return __fnv(&h->gen,
+                 offsetof(SpillHeader, check) - offsetof(SpillHeader, gen)) |
+           1;
+}
+
+static size_t
+record_size(int n_atoms, size_t state_size)
+{
+    return align_up(sizeof(SpillHeader) + n_atoms * sizeof(uint64_t) +
+                    state_size);
+}
+
+Spill::Spill(Scheduler* scheduler, const char* model_path)
+  : scheduler_(scheduler)
+{
+    struct stat st;
+    pthread_mutex_init(&lock_, 0);
+    const std::string& fp = scheduler_->system_fingerprint_;
+    model_ = __fnv(fp.data(), fp.size());
+    model_ = mix(model_, __fnv(model_path, strlen(model_path)));
+    if (!stat(model_path, &st)) {
+        model_ = mix(model_, st.st_size);
+        model_ = mix(model_, st.st_mtim.tv_sec);
+        model_ = mix(model_, st.st_mtim.tv_nsec);
+    }
+}
+
+Spill::~Spill()
+{
+    if (map_)
+        munmap(map_, size_);
+    if (fd_ != -1)
+        close(fd_);
+    pthread_mutex_destroy(&lock_);
+}
+
+// opens spill file
+//
+// this must be called before pledge() since the file is opened and
+// mapped once. the file is resized to `size` bytes if needed.
+bool
+Spill::open(const char* path, size_t size)
+{
+    size = size & -SPILL_ALIGN;
+    if (size < SPILL_ALIGN) {
+        SLOG("%s: spill file too small", path);
+        return false;
+    }
+    if ((fd_ = ::open(path, O_RDWR | O_CREAT, 0600)) == -1) {
+        SLOG("%s: open failed: %s", path, strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd_, size)) {
+        SLOG("%s: ftruncate failed: %s", path, strerror(errno));
+        return false;
+    }
+    map_ = (char*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (map_ == MAP_FAILED) {
+        SLOG("%s: mmap failed: %s", path, strerror(errno));
+        map_ = nullptr;
+        return false;
+    }
+    size_ = size;
+    load();
+    SLOG("%s: loaded %zu spilled conversations", path, records_.size());
+    return true;
+}
+
+// indexes records by scanning file for valid headers
+void
+Spill::load()
+{
+    size_t off = 0;
+    while (off + sizeof(SpillHeader) <= size_) {
+        const SpillHeader* h = (const SpillHeader*)(map_ + off);
+        size_t size;
+        if (h->magic != SPILL_MAGIC || //
+            h->check != check_header(h) || //
+            h->model != model_ || //
+            (size = record_size(h->n_atoms, h->state_size)) > size_ - off) {
+            off += SPILL_ALIGN;
+            continue;
+        }
+        auto it = records_.find(h->key);
+        if (it != records_.end()) {
+            if (it->second.gen > h->gen) {
+                off += size;
+                continue;
+            }
+            forget(h->key);
+        }
+        index(h->key,
+              { off, size, h->gen, (int)h->n_atoms, (int)h->n_tokens });
+        if (h->gen >= gen_) {
+            gen_ = h->gen + 1;
+            head_ = off + size;
+        }
+        off += size;
+    }
+}
+
+void
+Spill::index(uint64_t key, const Record& rec)
+{
+    records_[key] = rec;
+    offsets_[rec.off] = key;
+    ++lengths_[rec.n_atoms];
+}
+
+void
+Spill::forget(uint64_t key)
+{
+    auto it = records_.find(key);
+    if (it == records_.end())
+        return;
+    offsets_.erase(it->second.off);
+    if (!--lengths_[it->second.n_atoms])
+        lengths_.erase(it->second.n_atoms);
+    records_.erase(it);
+}
+
+// copies kv cache of sequence, whose content is `atoms`, into memory
+//
+// the kv cache is only locked while the state is being copied. nothing
+// is copied if the conversation is too short, already saved, or won't
+// fit in the file.
+//
+// @return true if `out` should be passed to write()
+bool
+Spill::copy(const std::vector<Atom>& atoms, int seq_id, SpillState* out)
+{
+    int n_tokens = 0;
+    uint64_t key = 0;
+    for (const Atom& atom : atoms) {
+        key = mix(key, fingerprint(atom));
+        n_tokens += atom.ctx_used();
+    }
+    if (n_tokens < kMinTokens)
+        return false;
+
+    int cs;
+    bool ok = false;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+    pthread_mutex_lock(&lock_);
+    bool known = records_.count(key);
+    pthread_mutex_unlock(&lock_);
+    if (!known) {
+        llama_context* ctx = scheduler_->ctx_;
+        scheduler_->lock_kv();
+        size_t state_size = llama_state_seq_get_size(ctx, seq_id);
+        if (record_size(atoms.size(), state_size) <= size_) {
+            out->data.resize(state_size);
+            ok = llama_state_seq_get_data(
+                   ctx, out->data.data(), state_size, seq_id) == state_size;
+        }
+        scheduler_->unlock_kv();
+    }
+    pthread_setcancelstate(cs, 0);
+    if (!ok)
+        return false;
+    out->key = key;
+    out->n_tokens = n_tokens;
+    out->fps.clear();
+    for (const Atom& atom : atoms)
+        out->fps.emplace_back(fingerprint(atom));
+    return true;
+}
+
+// writes state that was copied out of the kv cache to the file
+void
+Spill::write(const SpillState& state)
+{
+    int cs;
+    int n_atoms = state.fps.size();
+    size_t size = record_size(n_atoms, state.data.size());
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+    pthread_mutex_lock(&lock_);
+    if (!records_.count(state.key) && size <= size_) {
+
+        // find space, overwriting the oldest records
+        if (head_ + size > size_)
+            head_ = 0;
+        auto it = offsets_.lower_bound(head_);
+        if (it != offsets_.begin()) {
+            auto prev = std::prev(it);
+            const Record& rec = records_[prev->second];
+            if (rec.off + rec.size > head_)
+                it = prev;
+        }
+        while (it != offsets_.end() && it->first < head_ + size) {
+            uint64_t victim = it->second;
+            ++it;
+            forget(victim);
+        }
+
+        // write body, then header
+        SpillHeader* h = (SpillHeader*)(map_ + head_);
+        h->magic = 0;
+        uint64_t* fps = (uint64_t*)(h + 1);
+        memcpy(fps, state.fps.data(), n_atoms * sizeof(uint64_t));
+        memcpy(fps + n_atoms, state.data.data(), state.data.size());
+        h->gen = gen_++;
+        h->key = state.key;
+        h->model = model_;
+        h->state_size = state.data.size();
+        h->n_atoms = n_atoms;
+        h->n_tokens = state.n_tokens;
+        h->check = check_header(h);
+        h->magic = SPILL_MAGIC;
+        index(state.key, { head_, size, h->gen, n_atoms, state.n_tokens });
+        head_ += size;
+        if (FLAG_verbose)
+            SLOG("spilled %d tokens to disk", state.n_tokens);
+    }
+    pthread_mutex_unlock(&lock_);
+    pthread_setcancelstate(cs, 0);
+}
+
+// saves kv cache of sequence, whose content is `atoms`
+void
+Spill::save(const std::vector<Atom>& atoms, int seq_id)
+{
+    SpillState state;
+    if (copy(atoms, seq_id, &state))
+        write(state);
+}
+
+// restores longest spilled conversation that's a prefix of atoms
+//
+// only the first `max_atoms` atoms are considered, and conversations
+// that need `min_tokens` cells or fewer are ignored. on success, any
+// existing content of `seq_id` is replaced.
+//
+// @return number of atoms restored, zero if nothing changed, or -1 if
+//     restoring failed, in which case `seq_id` will have been cleared
+int
+Spill::restore(const std::vector<Atom>& atoms,
+               int max_atoms,
+               int min_tokens,
+               int seq_id)
+{
+    int cs;
+    int got = 0;
+    int got_tokens = 0;
+    int n = std::min((int)atoms.size(), max_atoms);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+    pthread_mutex_lock(&lock_);
+
+    // find longest prefix whose hash is in the index
+    uint64_t key = 0;
+    const Record* best = nullptr;
+    std::vector<uint64_t> fps;
+    auto lit = lengths_.begin();
+    for (int i = 0; i < n && lit != lengths_.end(); ++i) {
+        fps.emplace_back(fingerprint(atoms[i]));
+        key = mix(key, fps.back());
+        if (i + 1 < lit->first)
+            continue;
+        ++lit;
+        auto it = records_.find(key);
+        if (it != records_.end() && it->second.n_atoms == i + 1)
+            best = &it->second;
+    }
+
+    // verify it and read it from disk
+    std::vector<uint8_t> data;
+    if (best && best->n_tokens > min_tokens) {
+        const SpillHeader* h = (const SpillHeader*)(map_ + best->off);
+        const uint64_t* stored = (const uint64_t*)(h + 1);
+        if (!memcmp(stored, fps.data(), best->n_atoms * sizeof(uint64_t))) {
+            const uint8_t* p = (const uint8_t*)(stored + h->n_atoms);
+            data.assign(p, p + h->state_size);
+            got = best->n_atoms;
+            got_tokens = best->n_tokens;
+        }
+    }
+    pthread_mutex_unlock(&lock_);
+
+    // load it into the kv cache
+    if (got) {
+        llama_context* ctx = scheduler_->ctx_;
+        scheduler_->lock_kv();
+        llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+        if (!llama_state_seq_set_data(ctx, data.data(), data.size(), seq_id)) {
+            SLOG("failed to restore spilled kv cache");
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            got = -1;
+        }
+        scheduler_->unlock_kv();
+    }
+    pthread_setcancelstate(cs, 0);
+    if (got > 0 && FLAG_verbose)
+        SLOG("restored %d tokens from disk", got_tokens);
+    return got;
+}
+
+} // namespace server
+} // namespace lf
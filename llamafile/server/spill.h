@@ -0,0 +1,91 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace lf {
+namespace server {
+
+class Atom;
+struct Scheduler;
+
+// kv cache state of a sequence that's been copied out of the context,
+// but hasn't been written to the spill file yet
+struct SpillState
+{
+    uint64_t key = 0;
+    int n_tokens = 0;
+    std::vector<uint64_t> fps; // fingerprints of atoms
+    std::vector<uint8_t> data;
+};
+
+// on-disk store of kv cache state for evicted conversations
+//
+// the store is a single file that's memory mapped and written to as a
+// ring buffer, so the oldest conversations get overwritten first. each
+// record is keyed by a hash of the atoms that were in the sequence.
+//
+// saving happens in two phases. copy() takes the kv cache lock just long
+// enough to copy the state into memory, and write() puts it in the file
+// afterwards, so callers holding other locks can defer the disk i/o.
+struct Spill
+{
+    static constexpr int kMinTokens = 512;
+
+    struct Record
+    {
+        size_t off;
+        size_t size;
+        uint64_t gen;
+        int n_atoms;
+        int n_tokens;
+    };
+
+    Scheduler* scheduler_;
+    uint64_t model_ = 0;
+    uint64_t gen_ = 0;
+    int fd_ = -1;
+    char* map_ = nullptr;
+    size_t size_ = 0;
+    size_t head_ = 0;
+    std::unordered_map<uint64_t, Record> records_; // by key
+    std::map<size_t, uint64_t> offsets_; // record offset to key
+    std::map<int, int> lengths_; // n_atoms to count of records
+    pthread_mutex_t lock_;
+
+    Spill(Scheduler*, const char*);
+    ~Spill();
+    bool open(const char*, size_t);
+    bool copy(const std::vector<Atom>&, int, SpillState*);
+    void write(const SpillState&);
+    void save(const std::vector<Atom>&, int);
+    int restore(const std::vector<Atom>&, int, int, int);
+
+  private:
+    void load();
+    void forget(uint64_t);
+    void index(uint64_t, const Record&);
+};
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,284 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "client.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/macros.h"
+#include "llamafile/server/assets.h"
+#include "llamafile/server/cleanup.h"
+#include "llamafile/server/log.h"
+#include "llamafile/server/server.h"
+#include "llamafile/server/time.h"
+#include "llamafile/server/worker.h"
+#include "llamafile/string.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lf {
+namespace server {
+
+static const char*
+pick_content_type(const std::string_view& path)
+{
+    const char* ct = FindContentType(path.data(), path.size());
+    if (!ct)
+        ct = "application/octet-stream";
+    return ct;
+}
+
+static std::string
+make_etag(const struct stat& st)
+{
+    char buf[64];
+    snprintf(buf,
+             sizeof(buf),
+             "\"%lx-%lx-%lx\"",
+             (unsigned long)st.st_size,
+             (unsigned long)st.st_mtim.tv_sec,
+             (unsigned long)st.st_mtim.tv_nsec);
+    return buf;
+}
+
+static bool
+contains(const std::string_view& haystack, const std::string_view& needle)
+{
+    return haystack.find(needle) != std::string_view::npos;
+}
+
+static char*
+append_last_modified(char* p, int64_t mtime)
+{
+    tm tm;
+    gmtime_lockless(mtime, &tm);
+    p = stpcpy(p, "Last-Modified: ");
+    p = FormatHttpDateTime(p, &tm);
+    return stpcpy(p, "\r\n");
+}
+
+// returns true if client's cached copy is still good
+bool
+Client::is_not_modified(const std::string_view& etag, int64_t mtime)
+{
+    if (HasHeader(kHttpIfNoneMatch)) {
+        std::string_view inm = get_header("If-None-Match");
+        return inm == "*" || contains(inm, etag);
+    }
+    if (HasHeader(kHttpIfModifiedSince)) {
+        int64_t since = ParseHttpDateTime(HeaderData(kHttpIfModifiedSince),
+                                          HeaderLength(kHttpIfModifiedSince));
+        return since > 0 && mtime <= since;
+    }
+    return false;
+}
+
+// serves file from www root
+//
+// assets inside the executable are served from memory, optionally
+// gzip encoded. other files are sent by the kernel with sendfile().
+// conditional requests and single byte ranges are supported.
+bool
+Client::static_file(std::string_view path)
+{
+    // find file
+    int infd;
+    struct stat st;
+    resolved_ = resolve(FLAG_www_root, path);
+    for (;;) {
+        infd = open(resolved_.c_str(), O_RDONLY);
+        if (infd == -1) {
+            if (errno == ENOENT || errno == ENOTDIR) {
+                SLOG("path not found: %s", resolved_.c_str());
+                return send_error(404);
+            } else if (errno == EPERM || errno == EACCES) {
+                SLOG("path not authorized: %s", resolved_.c_str());
+                return send_error(401);
+            } else {
+                SLOG("%s: %s", strerror(errno), resolved_.c_str());
+                return send_error(500);
+            }
+        }
+        if (fstat(infd, &st)) {
+            SLOG("%s: %s", strerror(errno), resolved_.c_str());
+            ::close(infd);
+            return send_error(500);
+        }
+        if (S_ISREG(st.st_mode)) {
+            break;
+        } else if (S_ISDIR(st.st_mode)) {
+            ::close(infd);
+            resolved_ = resolve(resolved_, "index.html");
+        } else {
+            ::close(infd);
+            SLOG("won't serve special file: %s", resolved_.c_str());
+            return send_error(500);
+        }
+    }
+    defer_cleanup(cleanup_fildes, (void*)(intptr_t)infd);
+
+    // files inside the executable can't change
+    std::shared_ptr<const Asset> asset;
+    if (resolved_.starts_with("/zip/"))
+        asset = worker_->server_->assets_.get(resolved_, infd, st);
+
+    // choose representation
+    std::string etag;
+    std::string_view body;
+    bool use_gzip = false;
+    if (asset) {
+        etag = asset->etag;
+        body = asset->data;
+        if (!asset->gzip.empty() && !HasHeader(kHttpRange) &&
+            contains(get_header("Accept-Encoding"), "gzip")) {
+            use_gzip = true;
+            body = asset->gzip;
+            etag.insert(etag.size() - 1, "-gzip");
+        }
+    } else {
+        etag = make_etag(st);
+    }
+    int64_t size = asset ? body.size() : st.st_size;
+
+    // handle conditional request
+    char* p = obuf_.p;
+    should_send_error_if_canceled_ = false;
+    if (is_not_modified(etag, st.st_mtime)) {
+        cleanup();
+        p = append_http_response_message(p, 304);
+        p = stpcpy(p, "ETag: ");
+        p = stpcpy(p, etag.c_str());
+        p = stpcpy(p, "\r\n");
+        p = append_last_modified(p, st.st_mtime);
+        if (asset && !asset->gzip.empty())
+            p = stpcpy(p, "Vary: Accept-Encoding\r\n");
+        p = stpcpy(p, "\r\n");
+        return send(std::string_view(obuf_.p, p - obuf_.p));
+    }
+
+    // handle range request
+    int code = 200;
+    long off = 0;
+    long len = size;
+    if (HasHeader(kHttpRange) &&
+        (!HasHeader(kHttpIfRange) || get_header("If-Range") == etag)) {
+        if (!ParseHttpRange(HeaderData(kHttpRange),
+                            HeaderLength(kHttpRange),
+                            size,
+                            &off,
+                            &len)) {
+            cleanup();
+            p = append_http_response_message(p, 416);
+            p = stpcpy(p, "Content-Range: bytes */");
+            p = FormatInt64(p, size);
+            p = stpcpy(p, "\r\n");
+            p = stpcpy(p, "Content-Length: 0\r\n");
+            p = stpcpy(p, "\r\n");
+            return send(std::string_view(obuf_.p, p - obuf_.p));
+        }
+        code = 206;
+    }
+
+    // send headers
+    p = append_http_response_message(p, code);
+    p = stpcpy(p, "Content-Type: ");
+    p = stpcpy(p, pick_content_type(resolved_));
+    p = stpcpy(p, "\r\n");
+    p = stpcpy(p, "ETag: ");
+    p = stpcpy(p, etag.c_str());
+    p = stpcpy(p, "\r\n");
+    p = append_last_modified(p, st.st_mtime);
+    p = stpcpy(p, "Accept-Ranges: bytes\r\n");
+    if (asset && !asset->gzip.empty())
+        p = stpcpy(p, "Vary: Accept-Encoding\r\n");
+    if (use_gzip)
+        p = stpcpy(p, "Content-Encoding: gzip\r\n");
+    if (code == 206) {
+        p = stpcpy(p, "Content-Range: bytes ");
+        p = FormatInt64(p, off);
+        *p++ = '-';
+        p = FormatInt64(p, off + len - 1);
+        *p++ = '/';
+        p = FormatInt64(p, size);
+        p = stpcpy(p, "\r\n");
+    }
+    p = stpcpy(p, "Content-Length: ");
+    p = FormatInt64(p, len);
+    p = stpcpy(p, "\r\n");
+    p = stpcpy(p, "\r\n");
+    if (!send(std::string_view(obuf_.p, p - obuf_.p)))
+        return false;
+
+    // send content
+    if (msg_.method != kHttpHead) {
+        if (asset) {
+            if (!send_binary(body.data() + off, len))
+                return false;
+        } else if (!send_file(infd, off, len)) {
+            return false;
+        }
+    }
+    SLOG("served %s", resolved_.c_str());
+    cleanup();
+    return true;
+}
+
+// sends `len` bytes of file starting at `off` to client
+//
+// the kernel copies the file straight into the socket if it can.
+bool
+Client::send_file(int infd, long off, long len)
+{
+    while (len > 0) {
+        int64_t pos = off;
+        ssize_t sent = sendfile(fd_, infd, &pos, len);
+        if (sent > 0) {
+            off += sent;
+            len -= sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EINVAL || errno == ENOSYS))
+            break; // fall back to copying through userspace
+        if (sent == -1 && errno != EAGAIN && errno != ECONNRESET &&
+            errno != EPIPE)
+            SLOG("sendfile failed %m");
+        close_connection_ = true;
+        return false;
+    }
+    while (len > 0) {
+        ssize_t got = pread(infd, obuf_.p, MIN((size_t)len, obuf_.c), off);
+        if (got <= 0) {
+            SLOG("static asset pread failed: %m");
+            close_connection_ = true;
+            return false;
+        }
+        if (!send_binary(obuf_.p, got))
+            return false;
+        off += got;
+        len -= got;
+    }
+    return true;
+}
+
+} // namespace server
+} // namespace lf
@@ -0,0 +1,117 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stopmatcher.h"
+#include <algorithm>
+#include <cassert>
+
+namespace lf {
+namespace server {
+
+void
+StopMatcher::add(std::string_view stop)
+{
+    if (!stop.empty())
+        stops_.emplace_back(stop);
+}
+
+bool
+StopMatcher::empty() const
+{
+    return stops_.empty();
+}
+
+// compiles stop sequences into automaton
+//
+// first a trie of the stop sequences is built. then its states get put
+// in breadth first order, so the failure link of each state is already
+// complete by the time it's needed to fill in its missing transitions.
+void
+StopMatcher::build()
+{
+    next_.assign(256, 0);
+    depth_.assign(1, 0);
+    match_.assign(1, 0);
+    for (const std::string& stop : stops_) {
+        int s = 0;
+        for (unsigned char c : stop) {
+            if (!next_[s * 256 + c]) {
+                next_[s * 256 + c] = depth_.size();
+                next_.resize(next_.size() + 256, 0);
+                depth_.emplace_back(depth_[s] + 1);
+                match_.emplace_back(0);
+            }
+            s = next_[s * 256 + c];
+        }
+        match_[s] = stop.size();
+    }
+    std::vector<int> fail(depth_.size(), 0);
+    std::vector<int> queue;
+    for (int c = 0; c < 256; ++c)
+        if (next_[c])
+            queue.emplace_back(next_[c]);
+    for (size_t i = 0; i < queue.size(); ++i) {
+        int s = queue[i];
+        match_[s] = std::max(match_[s], match_[fail[s]]);
+        for (int c = 0; c < 256; ++c) {
+            int t = next_[s * 256 + c];
+            if (t) {
+                fail[t] = next_[fail[s] * 256 + c];
+                queue.emplace_back(t);
+            } else {
+                next_[s * 256 + c] = next_[fail[s] * 256 + c];
+            }
+        }
+    }
+}
+
+// advances cursor over text
+//
+// text that's known not to be part of a stop sequence is appended to
+// `out`. if a stop sequence is found, then everything before it gets
+// appended, and true is returned, in which case the rest of the text
+// should be discarded. once a stream of text ends without a stop, the
+// caller is responsible for appending what's left in `cursor->held`.
+bool
+StopMatcher::feed(Cursor* cursor, std::string_view text, std::string* out) const
+{
+    if (stops_.empty()) {
+        *out += text;
+        return false;
+    }
+    unassert(!next_.empty());
+    int s = cursor->state;
+    std::string& held = cursor->held;
+    for (unsigned char c : text) {
+        s = next_[s * 256 + c];
+        held += c;
+        if (match_[s]) {
+            out->append(held, 0, held.size() - match_[s]);
+            held.clear();
+            cursor->state = 0;
+            return true;
+        }
+    }
+    size_t n = held.size() - depth_[s];
+    out->append(held, 0, n);
+    held.erase(0, n);
+    cursor->state = s;
+    return false;
+}
+
+} // namespace server
+} // namespace lf
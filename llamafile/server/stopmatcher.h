@@ -0,0 +1,57 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lf {
+namespace server {
+
+// finds stop sequences in generated text as it's streamed
+//
+// this is an aho-corasick automaton over bytes, that's compiled into a
+// dfa once per request, so each byte of output costs one table lookup
+// no matter how many stop sequences there are. matching text, rather
+// than tokens, means a stop is found no matter how the model chose to
+// tokenize it. output that could be the beginning of a stop sequence
+// is held back until we know, so clients never see part of a stop.
+class StopMatcher
+{
+  public:
+    // position of one stream of text within the automaton
+    struct Cursor
+    {
+        int state = 0;
+        std::string held; // text that might be start of a stop
+    };
+
+    void add(std::string_view);
+    void build();
+    bool empty() const;
+    bool feed(Cursor*, std::string_view, std::string*) const;
+
+  private:
+    std::vector<std::string> stops_;
+    std::vector<int> next_; // 256 transitions per state
+    std::vector<int> depth_; // length of text that reaches state
+    std::vector<int> match_; // length of longest stop ending at state
+};
+
+} // namespace server
+} // namespace lf
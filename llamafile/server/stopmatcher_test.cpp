@@ -0,0 +1,141 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llamafile/server/stopmatcher.h"
+#include <cstdlib>
+#include <string>
+
+namespace lf {
+namespace server {
+namespace {
+
+// feeds pieces one at a time and returns what got through
+std::string
+run(const StopMatcher& m, const char* const* pieces, bool* stopped)
+{
+    std::string out;
+    StopMatcher::Cursor cursor;
+    *stopped = false;
+    for (; *pieces; ++pieces)
+        if ((*stopped = m.feed(&cursor, *pieces, &out)))
+            return out;
+    return out + cursor.held;
+}
+
+void
+test_no_stops()
+{
+    bool stopped;
+    StopMatcher m;
+    m.build();
+    const char* pieces[] = { "hello", " world", nullptr };
+    if (run(m, pieces, &stopped) != "hello world" || stopped)
+        exit(1);
+}
+
+void
+test_stop_split_across_pieces()
+{
+    bool stopped;
+    StopMatcher m;
+    m.add("</tool_call>");
+    m.build();
+    const char* pieces[] = { "ok</", "tool", "_call", ">more", nullptr };
+    if (run(m, pieces, &stopped) != "ok" || !stopped)
+        exit(2);
+}
+
+void
+test_false_start_is_released()
+{
+    bool stopped;
+    StopMatcher m;
+    m.add("abc");
+    m.build();
+    const char* pieces[] = { "xab", "abx", nullptr };
+    if (run(m, pieces, &stopped) != "xababx" || stopped)
+        exit(3);
+}
+
+void
+test_holdback_is_minimal()
+{
+    std::string out;
+    StopMatcher m;
+    StopMatcher::Cursor cursor;
+    m.add("STOP");
+    m.build();
+    if (m.feed(&cursor, "hello ST", &out))
+        exit(4);
+    if (out != "hello " || cursor.held != "ST")
+        exit(5);
+    if (m.feed(&cursor, "x", &out))
+        exit(6);
+    if (out != "hello STx" || !cursor.held.empty())
+        exit(7);
+}
+
+void
+test_overlapping_stops()
+{
+    bool stopped;
+    StopMatcher m;
+    m.add("abcd");
+    m.add("bc");
+    m.add("\n\n");
+    m.build();
+    const char* pieces[] = { "xa", "b", "cd", nullptr };
+    if (run(m, pieces, &stopped) != "xa" || !stopped)
+        exit(8);
+    const char* pieces2[] = { "one\n", "\ntwo", nullptr };
+    if (run(m, pieces2, &stopped) != "one" || !stopped)
+        exit(9);
+}
+
+void
+test_longest_stop_ending_here_wins()
+{
+    bool stopped;
+    StopMatcher m;
+    m.add("c");
+    m.add("abc");
+    m.build();
+    const char* pieces[] = { "xabc", nullptr };
+    if (run(m, pieces, &stopped) != "x" || !stopped)
+        exit(10);
+}
+
+void
+stopmatcher_test()
+{
+    test_no_stops();
+    test_stop_split_across_pieces();
+    test_false_start_is_released();
+    test_holdback_is_minimal();
+    test_overlapping_stops();
+    test_longest_stop_ending_here_wins();
+}
+
+} // namespace
+} // namespace server
+} // namespace lf
+
+int
+main()
+{
+    lf::server::stopmatcher_test();
+}
@@ -35,9 +35,21 @@ safe_writev(int, const iovec*, int);
 bool
 atob(std::string_view, bool);
 
+bool
+is_hung_up(int);
+
 std::string_view
 or_empty(std::optional<std::string_view> x);
 
+double
+logits_logsumexp(const float*, int);
+
+double
+token_logprob(const float*, int, int);
+
+void
+top_tokens(const float*, int, int, std::vector<int>*);
+
 void
 atomize(const llama_model* model,
         std::vector<Atom>* result,
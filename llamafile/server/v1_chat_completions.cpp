@@ -23,15 +23,21 @@
 #include "llamafile/macros.h"
 #include "llamafile/server/atom.h"
 #include "llamafile/server/cleanup.h"
+#include "llamafile/server/drafter.h"
 #include "llamafile/server/fastjson.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/metrics.h"
+#include "llamafile/server/models.h"
 #include "llamafile/server/server.h"
 #include "llamafile/server/slot.h"
 #include "llamafile/server/slots.h"
+#include "llamafile/server/stopmatcher.h"
 #include "llamafile/server/utils.h"
 #include "llamafile/server/worker.h"
 #include "llamafile/string.h"
 #include "llamafile/vector.h"
+#include <algorithm>
+#include <climits>
 #include <cmath>
 #include <cstring>
 #include <sys/resource.h>
@@ -45,6 +51,9 @@ namespace server {
 struct V1ChatCompletionParams
 {
     bool stream = false;
+    bool logprobs = false;
+    int top_logprobs = 0;
+    int n = 1;
     long max_tokens = -1;
     long seed = _rand64();
     double top_p = 1;
@@ -53,23 +62,21 @@ struct V1ChatCompletionParams
     double frequency_penalty = 0;
     std::string user;
     std::string model;
+    std::string lora;
     std::vector<llama_chat_msg> messages;
-    std::vector<std::vector<Atom>> stop;
+    StopMatcher stop;
     std::string grammar;
+};
 
-    void add_stop(llama_model* model, const std::string& text)
-    {
-        stop.emplace_back();
-        atomize(model, &stop.back(), text, DONT_PARSE_SPECIAL);
-    }
-
-    bool should_stop(const std::vector<Atom>& history)
-    {
-        for (const auto& suffix : stop)
-            if (vector_ends_with(history, suffix))
-                return true;
-        return false;
-    }
+struct V1ChatCompletionChoice
+{
+    Slot* slot = nullptr;
+    llama_sampling_context* sampler = nullptr;
+    const char* finish_reason = nullptr; // null while generating
+    int completion_tokens = 0;
+    StopMatcher::Cursor stop;
+    std::string content;
+    Json logprobs; // pending array of token logprobs
 };
 
 struct V1ChatCompletionState
@@ -77,6 +84,17 @@ struct V1ChatCompletionState
     std::string prompt;
     std::vector<Atom> atoms;
     std::string piece;
+    std::string delta;
+    std::vector<V1ChatCompletionChoice> choices;
+    Drafter* drafter = nullptr; // only when speculating
+
+    ~V1ChatCompletionState()
+    {
+        for (V1ChatCompletionChoice& choice : choices)
+            if (choice.sampler)
+                llama_sampling_free(choice.sampler);
+        delete drafter;
+    }
 };
 
 struct V1ChatCompletionResponse
@@ -103,20 +121,17 @@ cleanup_response(void* arg)
     delete (V1ChatCompletionResponse*)arg;
 }
 
-static void
-cleanup_sampler(void* arg)
-{
-    llama_sampling_free((llama_sampling_context*)arg);
-}
-
 static void
 cleanup_slot(void* arg)
 {
     Client* client = (Client*)arg;
     if (client->slot_) {
-        client->worker_->server_->slots_->give(client->slot_);
+        client->bound_->slots_->give(client->slot_);
         client->slot_ = nullptr;
     }
+    for (Slot* slot : client->forks_)
+        client->bound_->slots_->give(slot);
+    client->forks_.clear();
 }
 
 static bool
@@ -142,14 +157,14 @@ generate_id()
 }
 
 static llama_sampling_context*
-create_sampler(const V1ChatCompletionParams* params)
+create_sampler(const V1ChatCompletionParams* params, int index)
 {
     llama_sampling_params sparams;
     sparams.temp = params->temperature;
     sparams.top_p = params->top_p;
     sparams.penalty_freq = params->frequency_penalty;
     sparams.penalty_present = params->presence_penalty;
-    sparams.seed = params->seed;
+    sparams.seed = params->seed + index;
     sparams.grammar = params->grammar;
     return llama_sampling_init(sparams);
 }
@@ -163,6 +178,59 @@ make_event(const Json& json)
     return s;
 }
 
+static Json
+make_token_bytes(const std::string& piece)
+{
+    Json bytes;
+    bytes.setArray();
+    for (unsigned char c : piece)
+        bytes.getArray().emplace_back((int)c);
+    return bytes;
+}
+
+// describes how likely the sampled token was
+//
+// the log-softmax normalizer is computed once and shared by the token
+// and its alternatives. alternatives are ranked by a partial top-k so
+// we don't have to sort the whole vocabulary for every token.
+static Json
+make_logprob(const llama_context* ctx,
+             const float* logits,
+             int n_vocab,
+             int token,
+             int top_logprobs)
+{
+    Json entry;
+    double lse = logits_logsumexp(logits, n_vocab);
+    std::string piece =
+      llamafile_token_to_piece(ctx, token, DONT_RENDER_SPECIAL_TOKENS);
+    entry["token"] = piece;
+    entry["logprob"] = logits[token] - lse;
+    entry["bytes"] = make_token_bytes(piece);
+    Json& top = entry["top_logprobs"];
+    top.setArray();
+    std::vector<int> ids;
+    top_tokens(logits, n_vocab, top_logprobs, &ids);
+    for (int id : ids) {
+        Json alt;
+        piece = llamafile_token_to_piece(ctx, id, DONT_RENDER_SPECIAL_TOKENS);
+        alt["token"] = piece;
+        alt["logprob"] = logits[id] - lse;
+        alt["bytes"] = make_token_bytes(piece);
+        top.getArray().emplace_back(std::move(alt));
+    }
+    return entry;
+}
+
+// removes logprobs that haven't been sent to the client yet
+static Json
+take_logprobs(V1ChatCompletionChoice* choice)
+{
+    Json res = std::move(choice->logprobs);
+    choice->logprobs.setArray();
+    return res;
+}
+
 bool
 Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
 {
@@ -190,16 +258,12 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
         return send_error(400, "OpenAI tools field not supported yet");
     if (json.contains("audio"))
         return send_error(400, "OpenAI audio field not supported yet");
-    if (json.contains("logprobs"))
-        return send_error(400, "OpenAI logprobs field not supported yet");
     if (json.contains("functions"))
         return send_error(400, "OpenAI functions field not supported yet");
     if (json.contains("modalities"))
         return send_error(400, "OpenAI modalities field not supported yet");
     if (json.contains("tool_choice"))
         return send_error(400, "OpenAI tool_choice field not supported yet");
-    if (json.contains("top_logprobs"))
-        return send_error(400, "OpenAI top_logprobs field not supported yet");
     if (json.contains("function_call"))
         return send_error(400, "OpenAI function_call field not supported yet");
     if (json.contains("parallel_tool_calls"))
@@ -211,6 +275,17 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
         return send_error(400, "JSON missing model string");
     params->model = model.getString();
 
+    // lora: string|null
+    //
+    // Name of lora adapter to apply to the model, as specified by the
+    // --lora flag. If absent, then the model field may name one.
+    Json& lora = json["lora"];
+    if (!lora.isNull()) {
+        if (!lora.isString())
+            return send_error(400, "lora must be string");
+        params->lora = lora.getString();
+    }
+
     // messages: array<object<role:string, content:string>>
     if (!json["messages"].isArray())
         return send_error(400, "JSON missing messages array");
@@ -240,8 +315,9 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     if (!n.isNull()) {
         if (!n.isLong())
             return send_error(400, "n field must be integer");
-        if (n.getLong() != 1)
-            return send_error(400, "n field must be 1 if specified");
+        if (!(1 <= n.getLong() && n.getLong() <= 128))
+            return send_error(400, "n field must be between 1 and 128");
+        params->n = n.getLong();
     }
 
     // stream: bool|null
@@ -274,6 +350,35 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
         params->max_tokens = max_completion_tokens.getNumber();
     }
 
+    // logprobs: bool|null
+    //
+    // Whether to return log probabilities of the output tokens or not.
+    // If true, returns the log probabilities of each output token
+    // returned in the content of message.
+    Json& logprobs = json["logprobs"];
+    if (!logprobs.isNull()) {
+        if (!logprobs.isBool())
+            return send_error(400, "logprobs must be boolean");
+        params->logprobs = logprobs.getBool();
+    }
+
+    // top_logprobs: integer|null
+    //
+    // An integer between 0 and 20 specifying the number of most likely
+    // tokens to return at each token position, each with an associated
+    // log probability. logprobs must be set to true if this parameter
+    // is used.
+    Json& top_logprobs = json["top_logprobs"];
+    if (!top_logprobs.isNull()) {
+        if (!top_logprobs.isLong())
+            return send_error(400, "top_logprobs must be integer");
+        if (!(0 <= top_logprobs.getLong() && top_logprobs.getLong() <= 20))
+            return send_error(400, "top_logprobs must be between 0 and 20");
+        if (!params->logprobs)
+            return send_error(400, "top_logprobs requires logprobs be true");
+        params->top_logprobs = top_logprobs.getLong();
+    }
+
     // top_p: number|null
     //
     // An alternative to sampling with temperature, called nucleus
@@ -367,7 +472,9 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
     Json& stop = json["stop"];
     if (!stop.isNull()) {
         if (stop.isString()) {
-            params->add_stop(model_, stop.getString());
+            if (stop.getString().size() > 50)
+                return send_error(400, "stop string too long");
+            params->stop.add(stop.getString());
         } else if (stop.isArray()) {
             std::vector<Json>& stops = stop.getArray();
             if (stops.size() > 4)
@@ -377,12 +484,13 @@ Client::get_v1_chat_completions_params(V1ChatCompletionParams* params)
                     return send_error(400, "stop array item must be string");
                 if (stop2.getString().size() > 50)
                     return send_error(400, "stop array string too long");
-                params->add_stop(model_, stop2.getString());
+                params->stop.add(stop2.getString());
             }
         } else {
             return send_error(400, "stop field must be string or string array");
         }
     }
+    params->stop.build();
 
     // response_format: "auto"
     // response_format: { "type": "json_object" }
@@ -449,6 +557,10 @@ Client::v1_chat_completions()
     defer_cleanup(cleanup_params, params);
     if (!get_v1_chat_completions_params(params))
         return false;
+    if (!use_model(params->model))
+        return false;
+    if (!use_lora(params->lora, params->model))
+        return false;
 
     // create state and response objects
     V1ChatCompletionState* state = new V1ChatCompletionState;
@@ -465,15 +577,32 @@ Client::v1_chat_completions()
       model_, FLAG_chat_template, params->messages, ADD_ASSISTANT);
     atomize(model_, &state->atoms, state->prompt, PARSE_SPECIAL);
 
-    // find appropriate slot
-    slot_ = worker_->server_->slots_->take(state->atoms);
+    // find appropriate slots
+    //
+    // the prompt only gets prefilled once, even if several choices are
+    // wanted, in which case its kv cache is forked into the other slots
+    int n_choices = params->n;
+    std::vector<Slot*> slots(n_choices);
+    if (!admit(state->atoms,
+               slots.data(),
+               n_choices,
+               params->user,
+               params->max_tokens))
+        return false;
+    slot_ = slots[0];
+    forks_.assign(slots.begin() + 1, slots.end());
     defer_cleanup(cleanup_slot, this);
+    for (Slot* slot : slots)
+        slot->fd_ = fd_;
 
     // init sampling
-    llama_sampling_context* sampler = create_sampler(params);
-    if (!sampler)
-        return send_error(500, "failed to create sampler");
-    defer_cleanup(cleanup_sampler, sampler);
+    state->choices.resize(n_choices);
+    for (int i = 0; i < n_choices; ++i) {
+        state->choices[i].slot = slots[i];
+        state->choices[i].logprobs.setArray();
+        if (!(state->choices[i].sampler = create_sampler(params, i)))
+            return send_error(500, "failed to create sampler");
+    }
 
     // prefill time
     int prompt_tokens = 0;
@@ -481,6 +610,17 @@ Client::v1_chat_completions()
         SLOG("slot prefill failed: %s", Slot::describe_error(prompt_tokens));
         return send_error(500, Slot::describe_error(prompt_tokens));
     }
+    for (Slot* fork : forks_)
+        if (!slot_->fork(fork))
+            return send_error(500, "failed to fork kv cache");
+
+    // speculate when there's a single choice. several choices already
+    // share each decode step, which is the same kind of win. logprobs
+    // need the logits each token was sampled from, so they don't mix.
+    if (FLAG_draft > 0 && n_choices == 1 && !params->logprobs) {
+        state->drafter = new Drafter(FLAG_draft);
+        state->drafter->start(slot_->history_);
+    }
 
     // setup response json
     response->json["id"] = generate_id();
@@ -498,77 +638,184 @@ Client::v1_chat_completions()
         p = stpcpy(p, "Content-Type: text/event-stream\r\n");
         if (!send_response_start(obuf_.p, p))
             return false;
-        choice["delta"]["role"] = "assistant";
-        choice["delta"]["content"] = "";
-        response->json["created"] = timespec_real().tv_sec;
-        response->content = make_event(response->json);
-        choice.getObject().erase("delta");
-        if (!send_response_chunk(response->content))
-            return false;
+        for (int i = 0; i < n_choices; ++i) {
+            choice["index"] = i;
+            choice["delta"]["role"] = "assistant";
+            choice["delta"]["content"] = "";
+            response->json["created"] = timespec_real().tv_sec;
+            response->content = make_event(response->json);
+            choice.getObject().erase("delta");
+            if (!send_response_chunk(response->content))
+                return false;
+        }
     }
 
     // prediction time
+    int rc;
+    int steps = 0;
     int completion_tokens = 0;
-    const char* finish_reason = "length";
+    timespec last_token_time = message_started_;
+    std::vector<int> ids;
+    std::vector<int> active;
     for (;;) {
-        if (params->max_tokens >= 0 &&
-            completion_tokens >= params->max_tokens) {
-            slot_->eval_token(llamafile_token_eot(model_));
-            break;
+        // don't keep the slots busy for a client that's gone away
+        if (is_hung_up(fd_)) {
+            SLOG("client hung up during generation");
+            close_connection_ = true;
+            return false;
         }
-        llama_token id = llama_sampling_sample(sampler, slot_->ctx_, NULL);
-        llama_sampling_accept(sampler, slot_->ctx_, id, APPLY_GRAMMAR);
-        ++completion_tokens;
-        if (!slot_->eval_token(id)) {
-            SLOG("ran out of context window");
-            break;
+        ids.clear();
+        slots.clear();
+        active.clear();
+        for (int i = 0; i < n_choices; ++i) {
+            V1ChatCompletionChoice& c = state->choices[i];
+            if (c.finish_reason)
+                continue;
+            if (params->max_tokens >= 0 &&
+                c.completion_tokens >= params->max_tokens) {
+                if (state->drafter)
+                    state->drafter->flush(c.slot);
+                c.slot->eval_token(llamafile_token_eot(model_));
+                c.finish_reason = "length";
+                continue;
+            }
+            if (state->drafter) {
+                int max = INT_MAX;
+                if (params->max_tokens >= 0)
+                    max = params->max_tokens - c.completion_tokens;
+                if ((rc = speculate(c.slot,
+                                    c.sampler,
+                                    state->drafter,
+                                    max,
+                                    APPLY_GRAMMAR,
+                                    &ids)) < 0) {
+                    SLOG("failed to eval token: %s", Slot::describe_error(rc));
+                    c.finish_reason = "length";
+                    continue;
+                }
+                c.completion_tokens += rc;
+                active.insert(active.end(), rc, i);
+                continue;
+            }
+            llama_token id = llama_sampling_sample_logits(
+              c.sampler, c.slot->ctx_, c.slot->logits_.data());
+            llama_sampling_accept(c.sampler, c.slot->ctx_, id, APPLY_GRAMMAR);
+            if (params->logprobs && !llama_token_is_eog(model_, id))
+                c.logprobs.getArray().emplace_back(
+                  make_logprob(c.slot->ctx_,
+                               c.slot->logits_.data(),
+                               c.slot->logits_.size(),
+                               id,
+                               params->top_logprobs));
+            ++c.completion_tokens;
+            ids.emplace_back(id);
+            slots.emplace_back(c.slot);
+            active.emplace_back(i);
         }
-        if (llama_token_is_eog(model_, id)) {
-            finish_reason = "stop";
+        if (active.empty())
             break;
+        completion_tokens += active.size();
+        timespec now = timespec_real();
+        int64_t micros = timespec_tomicros(timespec_sub(now, last_token_time));
+        if (!steps++) {
+            metrics_time(kTimeToFirstToken, micros);
+        } else {
+            metrics_time(kInterTokenLatency, micros);
+            metrics_count(kDecodeMicros, micros);
+            metrics_count(kDecodeTokens, active.size());
         }
-        if (params->should_stop(slot_->history_)) {
-            slot_->eval_token(llamafile_token_eot(model_));
-            finish_reason = "stop";
+        last_token_time = now;
+        if (!state->drafter &&
+            (rc = Slot::eval_token_each(
+               slots.data(), ids.data(), active.size())) < 0) {
+            SLOG("failed to eval token: %s", Slot::describe_error(rc));
+            for (int i : active)
+                state->choices[i].finish_reason = "length";
             break;
         }
-        state->piece =
-          llamafile_token_to_piece(slot_->ctx_, id, DONT_RENDER_SPECIAL_TOKENS);
-        if (!state->piece.empty()) {
+        for (size_t k = 0; k < active.size(); ++k) {
+            V1ChatCompletionChoice& c = state->choices[active[k]];
+            if (c.finish_reason)
+                continue;
+            if (llama_token_is_eog(model_, ids[k])) {
+                if (state->drafter)
+                    state->drafter->flush(c.slot);
+                c.finish_reason = "stop";
+                continue;
+            }
+            state->piece = llamafile_token_to_piece(
+              c.slot->ctx_, ids[k], DONT_RENDER_SPECIAL_TOKENS);
+            state->delta.clear();
+            if (params->stop.feed(&c.stop, state->piece, &state->delta)) {
+                // speculation may have evaluated tokens past this one,
+                // except for the last, which it left pending
+                int past =
+                  std::count(active.begin() + k + 1, active.end(), active[k]);
+                if (state->drafter && state->drafter->drop())
+                    past = std::max(past - 1, 0);
+                c.slot->rewind(past);
+                c.slot->eval_token(llamafile_token_eot(model_));
+                c.finish_reason = "stop";
+            }
+            if (state->delta.empty())
+                continue;
             if (params->stream) {
-                char* p = append_http_response_message(obuf_.p, 200);
-                choice["delta"]["content"] = state->piece;
+                choice["index"] = active[k];
+                choice["delta"]["content"] = state->delta;
+                if (params->logprobs)
+                    choice["logprobs"]["content"] = take_logprobs(&c);
                 response->json["created"] = timespec_real().tv_sec;
                 response->content = make_event(response->json);
                 choice.getObject().erase("delta");
+                choice["logprobs"] = nullptr;
                 if (!send_response_chunk(response->content))
                     return false;
             } else {
-                response->content += state->piece;
+                c.content += state->delta;
             }
         }
     }
-    choice["finish_reason"] = finish_reason;
 
     // finalize response
     cleanup_slot(this);
     if (params->stream) {
-        choice["delta"]["content"] = "";
-        response->json["created"] = timespec_real().tv_sec;
-        response->content = make_event(response->json);
-        choice.getObject().erase("delta");
-        if (!send_response_chunk(response->content))
-            return false;
+        for (int i = 0; i < n_choices; ++i) {
+            choice["index"] = i;
+            choice["delta"]["content"] = state->choices[i].stop.held;
+            choice["finish_reason"] = state->choices[i].finish_reason;
+            if (params->logprobs)
+                choice["logprobs"]["content"] =
+                  take_logprobs(&state->choices[i]);
+            response->json["created"] = timespec_real().tv_sec;
+            response->content = make_event(response->json);
+            choice.getObject().erase("delta");
+            choice["logprobs"] = nullptr;
+            if (!send_response_chunk(response->content))
+                return false;
+        }
         if (!send_response_chunk("data: [DONE]\n\n"))
             return false;
         return send_response_finish();
     } else {
+        Json choices;
+        for (int i = 0; i < n_choices; ++i) {
+            Json& c = choices[i];
+            c["index"] = i;
+            c["message"]["role"] = "assistant";
+            state->choices[i].content += state->choices[i].stop.held;
+            c["message"]["content"] = std::move(state->choices[i].content);
+            if (params->logprobs) {
+                c["logprobs"]["content"] = take_logprobs(&state->choices[i]);
+            } else {
+                c["logprobs"] = nullptr;
+            }
+            c["finish_reason"] = state->choices[i].finish_reason;
+        }
+        response->json["choices"] = std::move(choices);
         Json& usage = response->json["usage"];
         usage["prompt_tokens"] = prompt_tokens;
         usage["completion_tokens"] = completion_tokens;
         usage["total_tokens"] = completion_tokens + prompt_tokens;
-        choice["message"]["role"] = "assistant";
-        choice["message"]["content"] = std::move(response->content);
         response->json["created"] = timespec_real().tv_sec;
         char* p = append_http_response_message(obuf_.p, 200);
         p = stpcpy(p, "Content-Type: application/json\r\n");
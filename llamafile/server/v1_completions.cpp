@@ -23,15 +23,21 @@
 #include "llamafile/macros.h"
 #include "llamafile/server/atom.h"
 #include "llamafile/server/cleanup.h"
+#include "llamafile/server/drafter.h"
 #include "llamafile/server/fastjson.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/metrics.h"
+#include "llamafile/server/models.h"
 #include "llamafile/server/server.h"
 #include "llamafile/server/slot.h"
 #include "llamafile/server/slots.h"
+#include "llamafile/server/stopmatcher.h"
 #include "llamafile/server/utils.h"
 #include "llamafile/server/worker.h"
 #include "llamafile/string.h"
 #include "llamafile/vector.h"
+#include <algorithm>
+#include <climits>
 #include <cmath>
 #include <cstring>
 #include <sys/resource.h>
@@ -46,6 +52,9 @@ struct V1CompletionParams
 {
     bool echo = false;
     bool stream = false;
+    int n = 1;
+    int best_of = 1;
+    int logprobs = -1; // off if negative
     long max_tokens = -1;
     long seed = _rand64();
     double top_p = 1;
@@ -54,28 +63,39 @@ struct V1CompletionParams
     double frequency_penalty = 0;
     std::string user;
     std::string model;
+    std::string lora;
     std::string prompt;
-    std::vector<std::vector<Atom>> stop;
-
-    void add_stop(llama_model* model, const std::string& text)
-    {
-        stop.emplace_back();
-        atomize(model, &stop.back(), text, DONT_PARSE_SPECIAL);
-    }
+    StopMatcher stop;
+};
 
-    bool should_stop(const std::vector<Atom>& history)
-    {
-        for (const auto& s : stop)
-            if (vector_ends_with(history, s))
-                return true;
-        return false;
-    }
+struct V1CompletionChoice
+{
+    Slot* slot = nullptr;
+    llama_sampling_context* sampler = nullptr;
+    const char* finish_reason = nullptr; // null while generating
+    int completion_tokens = 0;
+    double logprob = 0;
+    StopMatcher::Cursor stop;
+    std::string text;
+    Json logprobs; // pending tokens, token_logprobs, etc.
+    int text_offset = 0;
 };
 
 struct V1CompletionState
 {
     std::vector<Atom> atoms;
     std::string piece;
+    std::string delta;
+    std::vector<V1CompletionChoice> choices;
+    Drafter* drafter = nullptr; // only when speculating
+
+    ~V1CompletionState()
+    {
+        for (V1CompletionChoice& choice : choices)
+            if (choice.sampler)
+                llama_sampling_free(choice.sampler);
+        delete drafter;
+    }
 };
 
 struct V1CompletionResponse
@@ -102,20 +122,17 @@ cleanup_response(void* arg)
     delete (V1CompletionResponse*)arg;
 }
 
-static void
-cleanup_sampler(void* arg)
-{
-    llama_sampling_free((llama_sampling_context*)arg);
-}
-
 static void
 cleanup_slot(void* arg)
 {
     Client* client = (Client*)arg;
     if (client->slot_) {
-        client->worker_->server_->slots_->give(client->slot_);
+        client->bound_->slots_->give(client->slot_);
         client->slot_ = nullptr;
     }
+    for (Slot* slot : client->forks_)
+        client->bound_->slots_->give(slot);
+    client->forks_.clear();
 }
 
 static bool
@@ -141,17 +158,72 @@ generate_id()
 }
 
 static llama_sampling_context*
-create_sampler(const V1CompletionParams* params)
+create_sampler(const V1CompletionParams* params, int index)
 {
     llama_sampling_params sparams;
     sparams.temp = params->temperature;
     sparams.top_p = params->top_p;
     sparams.penalty_freq = params->frequency_penalty;
     sparams.penalty_present = params->presence_penalty;
-    sparams.seed = params->seed;
+    sparams.seed = params->seed + index;
     return llama_sampling_init(sparams);
 }
 
+// orders candidates by mean log probability per token, best first
+static bool
+is_better_choice(const V1CompletionChoice* a, const V1CompletionChoice* b)
+{
+    return a->logprob / MAX(a->completion_tokens, 1) >
+           b->logprob / MAX(b->completion_tokens, 1);
+}
+
+static void
+reset_logprobs(V1CompletionChoice* choice)
+{
+    choice->logprobs["tokens"].setArray();
+    choice->logprobs["token_logprobs"].setArray();
+    choice->logprobs["top_logprobs"].setArray();
+    choice->logprobs["text_offset"].setArray();
+}
+
+// removes logprobs that haven't been sent to the client yet
+static Json
+take_logprobs(V1CompletionChoice* choice)
+{
+    Json res = std::move(choice->logprobs);
+    reset_logprobs(choice);
+    return res;
+}
+
+// records how likely the sampled token was
+//
+// the log-softmax normalizer is computed once and shared by the token
+// and its alternatives. alternatives are ranked by a partial top-k so
+// we don't have to sort the whole vocabulary for every token.
+static void
+add_logprob(V1CompletionChoice* choice, int token, int top_logprobs)
+{
+    const llama_context* ctx = choice->slot->ctx_;
+    const float* logits = choice->slot->logits_.data();
+    int n_vocab = choice->slot->logits_.size();
+    double lse = logits_logsumexp(logits, n_vocab);
+    std::string piece =
+      llamafile_token_to_piece(ctx, token, DONT_RENDER_SPECIAL_TOKENS);
+    Json& lp = choice->logprobs;
+    lp["tokens"].getArray().emplace_back(piece);
+    lp["token_logprobs"].getArray().emplace_back(logits[token] - lse);
+    lp["text_offset"].getArray().emplace_back(choice->text_offset);
+    choice->text_offset += piece.size();
+    Json top;
+    top.setObject();
+    std::vector<int> ids;
+    top_tokens(logits, n_vocab, top_logprobs, &ids);
+    for (int id : ids)
+        top[llamafile_token_to_piece(ctx, id, DONT_RENDER_SPECIAL_TOKENS)] =
+          logits[id] - lse;
+    lp["top_logprobs"].getArray().emplace_back(std::move(top));
+}
+
 static std::string
 make_event(const Json& json)
 {
@@ -193,6 +265,17 @@ Client::get_v1_completions_params(V1CompletionParams* params)
         return send_error(400, "JSON missing model string");
     params->model = model.getString();
 
+    // lora: string|null
+    //
+    // Name of lora adapter to apply to the model, as specified by the
+    // --lora flag. If absent, then the model field may name one.
+    Json& lora = json["lora"];
+    if (!lora.isNull()) {
+        if (!lora.isString())
+            return send_error(400, "lora must be string");
+        params->lora = lora.getString();
+    }
+
     // prompt: string
     if (!json["prompt"].isString())
         return send_error(400, "JSON missing prompt string");
@@ -208,8 +291,9 @@ Client::get_v1_completions_params(V1CompletionParams* params)
     if (!n.isNull()) {
         if (!n.isLong())
             return send_error(400, "n field must be integer");
-        if (n.getLong() != 1)
-            return send_error(400, "n field must be 1 if specified");
+        if (!(1 <= n.getLong() && n.getLong() <= 128))
+            return send_error(400, "n field must be between 1 and 128");
+        params->n = n.getLong();
     }
 
     // best_of: integer|null
@@ -223,9 +307,14 @@ Client::get_v1_completions_params(V1CompletionParams* params)
     if (!best_of.isNull()) {
         if (!best_of.isLong())
             return send_error(400, "best_of field must be integer");
-        if (best_of.getLong() != 1)
-            return send_error(400, "best_of field must be 1 if specified");
+        if (!(1 <= best_of.getLong() && best_of.getLong() <= 128))
+            return send_error(400, "best_of field must be between 1 and 128");
+        params->best_of = best_of.getLong();
+    } else {
+        params->best_of = params->n;
     }
+    if (params->best_of < params->n)
+        return send_error(400, "best_of must be greater than or equal to n");
 
     // echo: bool|null
     //
@@ -249,6 +338,8 @@ Client::get_v1_completions_params(V1CompletionParams* params)
             return send_error(400, "stream field must be boolean");
         params->stream = stream.getBool();
     }
+    if (params->stream && params->best_of > params->n)
+        return send_error(400, "best_of can't be used with stream");
 
     // max_tokens: integer|null
     //
@@ -267,6 +358,23 @@ Client::get_v1_completions_params(V1CompletionParams* params)
         params->max_tokens = max_completion_tokens.getNumber();
     }
 
+    // logprobs: integer|null
+    //
+    // Include the log probabilities on the logprobs most likely output
+    // tokens, as well the chosen tokens. For example, if logprobs is 5,
+    // the API will return a list of the 5 most likely tokens. The API
+    // will always return the logprob of the sampled token, so there may
+    // be up to logprobs+1 elements in the response. The maximum value
+    // for logprobs is 5.
+    Json& logprobs = json["logprobs"];
+    if (!logprobs.isNull()) {
+        if (!logprobs.isLong())
+            return send_error(400, "logprobs must be integer");
+        if (!(0 <= logprobs.getLong() && logprobs.getLong() <= 5))
+            return send_error(400, "logprobs must be between 0 and 5");
+        params->logprobs = logprobs.getLong();
+    }
+
     // top_p: number|null
     //
     // An alternative to sampling with temperature, called nucleus
@@ -360,7 +468,9 @@ Client::get_v1_completions_params(V1CompletionParams* params)
     Json& stop = json["stop"];
     if (!stop.isNull()) {
         if (stop.isString()) {
-            params->add_stop(model_, stop.getString());
+            if (stop.getString().size() > 50)
+                return send_error(400, "stop string too long");
+            params->stop.add(stop.getString());
         } else if (stop.isArray()) {
             std::vector<Json>& stops = stop.getArray();
             if (stops.size() > 4)
@@ -370,12 +480,13 @@ Client::get_v1_completions_params(V1CompletionParams* params)
                     return send_error(400, "stop array item must be string");
                 if (stop2.getString().size() > 50)
                     return send_error(400, "stop array string too long");
-                params->add_stop(model_, stop2.getString());
+                params->stop.add(stop2.getString());
             }
         } else {
             return send_error(400, "stop field must be string or string array");
         }
     }
+    params->stop.build();
 
     return true;
 }
@@ -388,6 +499,10 @@ Client::v1_completions()
     defer_cleanup(cleanup_params, params);
     if (!get_v1_completions_params(params))
         return false;
+    if (!use_model(params->model))
+        return false;
+    if (!use_lora(params->lora, params->model))
+        return false;
 
     // create state and response objects
     V1CompletionState* state = new V1CompletionState;
@@ -402,15 +517,35 @@ Client::v1_completions()
     // turn text into tokens
     atomize(model_, &state->atoms, params->prompt, PARSE_SPECIAL);
 
-    // find appropriate slot
-    slot_ = worker_->server_->slots_->take(state->atoms);
+    // find appropriate slots
+    //
+    // when several choices are wanted, the prompt only gets prefilled
+    // once. its kv cache is then forked into the slots of the remaining
+    // choices, which are all decoded together in each batch.
+    int n_choices = params->best_of;
+    std::vector<Slot*> slots(n_choices);
+    if (n_choices > (int)bound_->slots_->size())
+        return send_error(400, "best_of and n can't exceed number of slots");
+    if (!admit(state->atoms,
+               slots.data(),
+               n_choices,
+               params->user,
+               params->max_tokens))
+        return false;
+    slot_ = slots[0];
+    forks_.assign(slots.begin() + 1, slots.end());
     defer_cleanup(cleanup_slot, this);
+    for (Slot* slot : slots)
+        slot->fd_ = fd_;
 
     // init sampling
-    llama_sampling_context* sampler = create_sampler(params);
-    if (!sampler)
-        return send_error(500, "failed to create sampler");
-    defer_cleanup(cleanup_sampler, sampler);
+    state->choices.resize(n_choices);
+    for (int i = 0; i < n_choices; ++i) {
+        state->choices[i].slot = slots[i];
+        reset_logprobs(&state->choices[i]);
+        if (!(state->choices[i].sampler = create_sampler(params, i)))
+            return send_error(500, "failed to create sampler");
+    }
 
     // prefill time
     int prompt_tokens = 0;
@@ -418,6 +553,17 @@ Client::v1_completions()
         SLOG("slot prefill failed: %s", Slot::describe_error(prompt_tokens));
         return send_error(500, Slot::describe_error(prompt_tokens));
     }
+    for (Slot* fork : forks_)
+        if (!slot_->fork(fork))
+            return send_error(500, "failed to fork kv cache");
+
+    // speculate when there's a single choice. several choices already
+    // share each decode step, which is the same kind of win. logprobs
+    // need the logits each token was sampled from, so they don't mix.
+    if (FLAG_draft > 0 && n_choices == 1 && params->logprobs < 0) {
+        state->drafter = new Drafter(FLAG_draft);
+        state->drafter->start(slot_->history_);
+    }
 
     // setup response json
     response->json["id"] = generate_id();
@@ -435,74 +581,186 @@ Client::v1_completions()
         p = stpcpy(p, "Content-Type: text/event-stream\r\n");
         if (!send_response_start(obuf_.p, p))
             return false;
-        choice["delta"]["role"] = "assistant";
-        choice["delta"]["content"] = "";
-        response->json["created"] = timespec_real().tv_sec;
-        response->content = make_event(response->json);
-        choice.getObject().erase("delta");
-        if (!send_response_chunk(response->content))
-            return false;
+        for (int i = 0; i < n_choices; ++i) {
+            choice["index"] = i;
+            choice["delta"]["role"] = "assistant";
+            choice["delta"]["content"] = "";
+            response->json["created"] = timespec_real().tv_sec;
+            response->content = make_event(response->json);
+            choice.getObject().erase("delta");
+            if (!send_response_chunk(response->content))
+                return false;
+        }
     }
 
     // prediction time
+    int rc;
+    int steps = 0;
     int completion_tokens = 0;
-    const char* finish_reason = "length";
+    timespec last_token_time = message_started_;
+    std::vector<int> ids;
+    std::vector<int> active;
     for (;;) {
-        if (params->max_tokens >= 0 &&
-            completion_tokens >= params->max_tokens) {
-            slot_->eval_token(llamafile_token_eot(model_));
-            break;
+        // don't keep the slots busy for a client that's gone away
+        if (is_hung_up(fd_)) {
+            SLOG("client hung up during generation");
+            close_connection_ = true;
+            return false;
         }
-        llama_token id = llama_sampling_sample(sampler, slot_->ctx_, NULL);
-        llama_sampling_accept(sampler, slot_->ctx_, id, DONT_APPLY_GRAMMAR);
-        ++completion_tokens;
-        if (!slot_->eval_token(id)) {
-            SLOG("ran out of context window");
-            break;
+        ids.clear();
+        slots.clear();
+        active.clear();
+        for (int i = 0; i < n_choices; ++i) {
+            V1CompletionChoice& c = state->choices[i];
+            if (c.finish_reason)
+                continue;
+            if (params->max_tokens >= 0 &&
+                c.completion_tokens >= params->max_tokens) {
+                if (state->drafter)
+                    state->drafter->flush(c.slot);
+                c.slot->eval_token(llamafile_token_eot(model_));
+                c.finish_reason = "length";
+                continue;
+            }
+            if (state->drafter) {
+                int max = INT_MAX;
+                if (params->max_tokens >= 0)
+                    max = params->max_tokens - c.completion_tokens;
+                if ((rc = speculate(c.slot,
+                                    c.sampler,
+                                    state->drafter,
+                                    max,
+                                    DONT_APPLY_GRAMMAR,
+                                    &ids)) < 0) {
+                    SLOG("failed to eval token: %s", Slot::describe_error(rc));
+                    c.finish_reason = "length";
+                    continue;
+                }
+                c.completion_tokens += rc;
+                active.insert(active.end(), rc, i);
+                continue;
+            }
+            llama_token id = llama_sampling_sample_logits(
+              c.sampler, c.slot->ctx_, c.slot->logits_.data());
+            llama_sampling_accept(
+              c.sampler, c.slot->ctx_, id, DONT_APPLY_GRAMMAR);
+            if (n_choices > params->n)
+                c.logprob += token_logprob(
+                  c.slot->logits_.data(), c.slot->logits_.size(), id);
+            if (params->logprobs >= 0 && !llama_token_is_eog(model_, id))
+                add_logprob(&c, id, params->logprobs);
+            ++c.completion_tokens;
+            ids.emplace_back(id);
+            slots.emplace_back(c.slot);
+            active.emplace_back(i);
         }
-        if (llama_token_is_eog(model_, id)) {
-            finish_reason = "stop";
+        if (active.empty())
             break;
+        completion_tokens += active.size();
+        timespec now = timespec_real();
+        int64_t micros = timespec_tomicros(timespec_sub(now, last_token_time));
+        if (!steps++) {
+            metrics_time(kTimeToFirstToken, micros);
+        } else {
+            metrics_time(kInterTokenLatency, micros);
+            metrics_count(kDecodeMicros, micros);
+            metrics_count(kDecodeTokens, active.size());
         }
-        if (params->should_stop(slot_->history_)) {
-            slot_->eval_token(llamafile_token_eot(model_));
-            finish_reason = "stop";
+        last_token_time = now;
+        if (!state->drafter &&
+            (rc = Slot::eval_token_each(
+               slots.data(), ids.data(), active.size())) < 0) {
+            SLOG("failed to eval token: %s", Slot::describe_error(rc));
+            for (int i : active)
+                state->choices[i].finish_reason = "length";
             break;
         }
-        state->piece =
-          llamafile_token_to_piece(slot_->ctx_, id, DONT_RENDER_SPECIAL_TOKENS);
-        if (!state->piece.empty()) {
+        for (size_t k = 0; k < active.size(); ++k) {
+            V1CompletionChoice& c = state->choices[active[k]];
+            if (c.finish_reason)
+                continue;
+            if (llama_token_is_eog(model_, ids[k])) {
+                if (state->drafter)
+                    state->drafter->flush(c.slot);
+                c.finish_reason = "stop";
+                continue;
+            }
+            state->piece = llamafile_token_to_piece(
+              c.slot->ctx_, ids[k], DONT_RENDER_SPECIAL_TOKENS);
+            state->delta.clear();
+            if (params->stop.feed(&c.stop, state->piece, &state->delta)) {
+                // speculation may have evaluated tokens past this one,
+                // except for the last, which it left pending
+                int past =
+                  std::count(active.begin() + k + 1, active.end(), active[k]);
+                if (state->drafter && state->drafter->drop())
+                    past = std::max(past - 1, 0);
+                c.slot->rewind(past);
+                c.slot->eval_token(llamafile_token_eot(model_));
+                c.finish_reason = "stop";
+            }
+            if (state->delta.empty())
+                continue;
             if (params->stream) {
-                char* p = append_http_response_message(obuf_.p, 200);
-                choice["text"] = state->piece;
+                choice["index"] = active[k];
+                choice["text"] = state->delta;
+                if (params->logprobs >= 0)
+                    choice["logprobs"] = take_logprobs(&c);
                 response->json["created"] = timespec_real().tv_sec;
                 response->content = make_event(response->json);
+                choice["logprobs"] = nullptr;
                 if (!send_response_chunk(response->content))
                     return false;
             } else {
-                response->content += state->piece;
+                c.text += state->delta;
             }
         }
     }
-    choice["finish_reason"] = finish_reason;
 
     // finalize response
     cleanup_slot(this);
     if (params->stream) {
-        choice["text"] = "";
-        response->json["created"] = timespec_real().tv_sec;
-        response->content = make_event(response->json);
-        if (!send_response_chunk(response->content))
-            return false;
+        for (int i = 0; i < n_choices; ++i) {
+            choice["index"] = i;
+            choice["text"] = state->choices[i].stop.held;
+            choice["finish_reason"] = state->choices[i].finish_reason;
+            if (params->logprobs >= 0)
+                choice["logprobs"] = take_logprobs(&state->choices[i]);
+            response->json["created"] = timespec_real().tv_sec;
+            response->content = make_event(response->json);
+            choice["logprobs"] = nullptr;
+            if (!send_response_chunk(response->content))
+                return false;
+        }
         if (!send_response_chunk("data: [DONE]\n\n"))
             return false;
         return send_response_finish();
     } else {
+        // return the n candidates with highest mean logprob per token
+        std::vector<V1CompletionChoice*> ranked;
+        for (V1CompletionChoice& c : state->choices) {
+            c.text += c.stop.held;
+            ranked.emplace_back(&c);
+        }
+        if (n_choices > params->n)
+            std::stable_sort(ranked.begin(), ranked.end(), is_better_choice);
+        Json choices;
+        for (int i = 0; i < params->n; ++i) {
+            Json& c = choices[i];
+            c["index"] = i;
+            c["text"] = std::move(ranked[i]->text);
+            if (params->logprobs >= 0) {
+                c["logprobs"] = std::move(ranked[i]->logprobs);
+            } else {
+                c["logprobs"] = nullptr;
+            }
+            c["finish_reason"] = ranked[i]->finish_reason;
+        }
+        response->json["choices"] = std::move(choices);
         Json& usage = response->json["usage"];
         usage["prompt_tokens"] = prompt_tokens;
         usage["completion_tokens"] = completion_tokens;
         usage["total_tokens"] = completion_tokens + prompt_tokens;
-        choice["text"] = std::move(response->content);
         response->json["created"] = timespec_real().tv_sec;
         char* p = append_http_response_message(obuf_.p, 200);
         p = stpcpy(p, "Content-Type: application/json\r\n");
@@ -16,18 +16,22 @@
 // limitations under the License.
 
 #include "worker.h"
+#include "llamafile/db.h"
 #include "llamafile/llamafile.h"
 #include "llamafile/server/client.h"
 #include "llamafile/server/log.h"
+#include "llamafile/server/metrics.h"
+#include "llamafile/server/poller.h"
 #include "llamafile/server/server.h"
 #include "llamafile/server/signals.h"
-#include "llamafile/server/tokenbucket.h"
 #include "llamafile/threadlocal.h"
 #include "llamafile/trust.h"
 #include <cosmo.h>
 #include <cassert>
+#include <cstring>
 #include <exception>
 #include <pthread.h>
+#include <string>
 
 namespace lf {
 namespace server {
@@ -38,6 +42,25 @@ Worker::Worker(Server* server, llama_model* model)
     dll_init(&elem_);
 }
 
+Worker::~Worker()
+{
+    if (db_)
+        db::close(db_);
+}
+
+// returns this worker's database connection, opening it on first use
+//
+// each worker keeps its own connection for as long as it lives, so the
+// schema check and pragmas only happen once per thread, and statements
+// prepared by one request get reused by the next.
+sqlite3*
+Worker::db()
+{
+    if (!db_)
+        db_ = db::open();
+    return db_;
+}
+
 void
 Worker::kill()
 {
@@ -50,24 +73,14 @@ Worker::begin()
     npassert(!working_);
     client_.worker_ = this;
     client_.client_ip_trusted_ = is_trusted_ip(client_.client_ip_);
-    int tokens = 0;
-    if (!client_.client_ip_trusted_)
-        tokens = tokenbucket_acquire(client_.client_ip_);
     server_->lock();
     dll_remove(&server_->idle_workers, &elem_);
-    if (dll_is_empty(server_->idle_workers)) {
-        Dll* slowbro;
-        if ((slowbro = dll_last(server_->active_workers))) {
-            SLOG("all threads active! dropping oldest client");
-            WORKER(slowbro)->kill();
-        }
-    }
+    client_.overloaded_ = dll_is_empty(server_->idle_workers) &&
+                          !dll_is_empty(server_->active_workers);
+    if (client_.overloaded_)
+        SLOG("all threads active! turning away client");
     working_ = true;
-    if (tokens > FLAG_token_burst) {
-        dll_make_last(&server_->active_workers, &elem_);
-    } else {
-        dll_make_first(&server_->active_workers, &elem_);
-    }
+    dll_make_first(&server_->active_workers, &elem_);
     server_->unlock();
 }
 
@@ -82,16 +95,6 @@ Worker::end()
     server_->unlock();
 }
 
-void
-Worker::deprioritize()
-{
-    npassert(working_);
-    server_->lock();
-    dll_remove(&server_->active_workers, &elem_);
-    dll_make_last(&server_->active_workers, &elem_);
-    server_->unlock();
-}
-
 void
 Worker::retire()
 {
@@ -109,26 +112,52 @@ Worker::retire()
 void
 Worker::handle()
 {
-    if ((client_.fd_ = server_->accept(&client_.client_ip_)) == -1) {
-        if (IsWindows() && errno == ENOTSOCK) {
-            // Server::shutdown() calls close() on the listening socket
-        } else {
-            SLOG("accept returned %m");
+    Poller* poller = server_->poller_;
+    if (poller) {
+        if (!(conn_ = poller->take()))
+            return;
+        metrics_time(
+          kQueueWait,
+          timespec_tomicros(timespec_sub(timespec_real(), conn_->ready)));
+        client_.fd_ = conn_->fd;
+        client_.client_ip_ = conn_->ip;
+        memcpy(client_.ibuf_.p, conn_->buf.data(), conn_->buf.size());
+        client_.ibuf_.n = conn_->buf.size();
+        std::string().swap(conn_->buf);
+    } else {
+        if ((client_.fd_ = server_->accept(&client_.client_ip_)) == -1) {
+            if (IsWindows() && errno == ENOTSOCK) {
+                // Server::shutdown() calls close() on the listening socket
+            } else {
+                SLOG("accept returned %m");
+            }
+            return;
         }
-        return;
+        client_.ibuf_.n = 0;
     }
 
     begin();
 
+    bool keepalive = false;
     try {
-        client_.run();
+        keepalive = client_.run();
     } catch (const std::exception& e) {
         SLOG("caught %s", e.what());
     } catch (...) {
         SLOG("caught unknown exception");
     }
 
-    client_.close();
+    if (keepalive && conn_) {
+        // let poller wait for the next request
+        conn_->buf.assign(client_.ibuf_.p, client_.ibuf_.n);
+        client_.fd_ = -1;
+        client_.close();
+        poller->park(conn_);
+    } else {
+        client_.close();
+        delete conn_;
+    }
+    conn_ = nullptr;
     end();
 }
 
@@ -145,6 +174,7 @@ Worker::run()
             worker->client_.close();
             worker->end();
         }
+        delete worker->conn_;
         worker->retire();
     });
     cleanup.set(this);
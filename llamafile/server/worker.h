@@ -23,10 +23,12 @@
 #define WORKER(e) DLL_CONTAINER(Worker, elem_, e)
 
 struct llama_model;
+struct sqlite3;
 
 namespace lf {
 namespace server {
 
+struct Conn;
 struct Server;
 
 struct Worker
@@ -35,14 +37,17 @@ struct Worker
     Dll elem_;
     pthread_t th_ = 0;
     bool working_ = false;
+    Conn* conn_ = nullptr; // owned or null
+    sqlite3* db_ = nullptr; // owned or null
     Client client_;
 
     explicit Worker(Server*, llama_model*);
+    ~Worker();
+    sqlite3* db();
     void run();
     void begin();
     void handle();
     void end();
-    void deprioritize();
     void retire();
     void kill();
 };
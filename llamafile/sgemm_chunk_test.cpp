@@ -0,0 +1,125 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ansiblas.h"
+#include "llama.cpp/ggml.h"
+#include "macros.h"
+#include "micros.h"
+#include "numba.h"
+#include "sgemm.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+// shows how splitting the tinyBLAS tiles of each thread into smaller
+// jobs that get claimed dynamically (the way ggml_compute_forward_mul_mat
+// does it) cuts the tail latency of an op when some threads are slower
+// than others, e.g. efficiency cores on a hybrid cpu. odd threads are
+// made to run at half speed by doing each piece of their work twice.
+
+#define ITERATIONS 30
+#define CHUNKS_PER_THREAD 4
+#define ALLOC(n) (float *)memalign(4096, sizeof(float) * (n))
+
+static void sgemm_static(long m, long n, long k, const float *A, long lda, const float *B, long ldb,
+                         float *C, long ldc) {
+    static int nth = cpu_get_num_math();
+#pragma omp parallel for num_threads(nth)
+    for (int ith = 0; ith < nth; ++ith) {
+        for (int rep = 0; rep < 1 + (ith & 1); ++rep) {
+            bool res = llamafile_sgemm(m, n, k, A, lda, B, ldb, C, ldc, ith, nth, GGML_TYPE_F32,
+                                       GGML_TYPE_F32, GGML_TYPE_F32);
+            assert(res);
+        }
+    }
+}
+
+static void sgemm_chunked(long m, long n, long k, const float *A, long lda, const float *B,
+                          long ldb, float *C, long ldc) {
+    static int nth = cpu_get_num_math();
+    int njobs = nth * CHUNKS_PER_THREAD;
+    std::atomic_int current(nth);
+#pragma omp parallel for num_threads(nth)
+    for (int ith = 0; ith < nth; ++ith) {
+        for (int job = ith; job < njobs; job = current.fetch_add(1)) {
+            for (int rep = 0; rep < 1 + (ith & 1); ++rep) {
+                bool res = llamafile_sgemm(m, n, k, A, lda, B, ldb, C, ldc, job, njobs,
+                                           GGML_TYPE_F32, GGML_TYPE_F32, GGML_TYPE_F32);
+                assert(res);
+            }
+        }
+    }
+}
+
+static void report(const char *name, long long *t) {
+    std::sort(t, t + ITERATIONS);
+    printf("%12lld us p50 %12lld us p90 %12lld us max %s\n", t[ITERATIONS / 2],
+           t[ITERATIONS * 9 / 10], t[ITERATIONS - 1], name);
+}
+
+int test(long m, long n, long k) {
+    long lda = ROUNDUP(k, 16);
+    long ldb = ROUNDUP(k, 16);
+    long ldc = ROUNDUP(m, 16);
+    float *A = ALLOC(lda * m);
+    float *B = ALLOC(ldb * n);
+    float *C = ALLOC(ldc * n);
+    float *G = ALLOC(ldc * n);
+    randomize(k, m, A, lda);
+    randomize(k, n, B, ldb);
+
+    long long ts[ITERATIONS];
+    long long tc[ITERATIONS];
+    sgemm_static(m, n, k, A, lda, B, ldb, G, ldc);
+    sgemm_chunked(m, n, k, A, lda, B, ldb, C, ldc);
+    for (int i = 0; i < ITERATIONS; ++i) {
+        long long start = micros();
+        sgemm_static(m, n, k, A, lda, B, ldb, G, ldc);
+        ts[i] = micros() - start;
+        start = micros();
+        sgemm_chunked(m, n, k, A, lda, B, ldb, C, ldc);
+        tc[i] = micros() - start;
+    }
+
+    printf("m=%ld n=%ld k=%ld\n", m, n, k);
+    report("static", ts);
+    report("chunked", tc);
+
+    // every tile is computed the same way regardless of who computes it
+    int rc = 0;
+    for (long j = 0; j < n; ++j)
+        if (memcmp(G + ldc * j, C + ldc * j, m * sizeof(float)))
+            rc = 1;
+
+    free(G);
+    free(C);
+    free(B);
+    free(A);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    int rc;
+    if ((rc = test(4096, 1, 4096))) // matvec, i.e. token generation
+        return rc;
+    if ((rc = test(4096, 64, 4096))) // small batch
+        return rc;
+    if ((rc = test(4096, 512, 4096))) // prompt processing
+        return rc;
+}
@@ -0,0 +1,105 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llama.cpp/ggml-quants.h"
+#include "llama.cpp/ggml.h"
+#include "micros.h"
+#include "numba.h"
+#include "sgemm.h"
+#include <algorithm>
+#include <cstdio>
+
+// compares tinyBLAS_K_AVX2 with iqk_mul_mat() on k-quant prefills
+//
+// llamafile_sgemm() sends batches of 128+ columns to tinyBLAS on x86,
+// except for zen4, so that's what it's timed with here. each side runs
+// single threaded and reports its fastest of ITERATIONS runs.
+//
+// m=256 k=4096, microseconds, tinyBLAS / iqk, on a xeon vm:
+//
+//                        n=128          n=256          n=512
+//   avx2     q4_K    3066 / 3476    6373 / 6737   12813 / 14300
+//   avx2     q5_K    3152 / 3784    6192 / 7409   12779 / 15113
+//   avx2     q6_K    3247 / 3254    6242 / 6328   12970 / 13060
+//   avx512f  q4_K    2900 / 3108    5704 / 6456   12049 / 12871
+//   avx512f  q5_K    3062 / 3617    6089 / 7346   12865 / 14482
+//   avx512f  q6_K    3204 / 3187    5978 / 5964   12213 / 12870
+//
+// below 128 columns there isn't enough reuse to amortize unpacking.
+// the zen4 build doesn't route to tinyBLAS, and uses iqk's avx512 vnni
+// kernels instead.
+
+#define ITERATIONS 20
+
+static long long time_tinyblas(ggml_type type, long m, long n, long k, const void *A,
+                               const void *B, float *C) {
+    long long best = -1;
+    for (int i = 0; i < ITERATIONS; ++i) {
+        long long start = micros();
+        if (!llamafile_sgemm(m, n, k / QK_K, A, k / QK_K, B, k / QK_K, C, m, 0, 1, type,
+                             GGML_TYPE_Q8_K, GGML_TYPE_F32))
+            return -1;
+        long long t = micros() - start;
+        if (best < 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+static long long time_iqk(ggml_type type, long m, long n, long k, const void *A, const void *B,
+                          float *C) {
+    long long best = -1;
+    for (int i = 0; i < ITERATIONS; ++i) {
+        long long start = micros();
+        if (!iqk_mul_mat(m, n, k, type, A, B, C, m, 0, 1))
+            return -1;
+        long long t = micros() - start;
+        if (best < 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+static void bench(ggml_type type, long m, long n, long k) {
+    float *fa = new float[m * k];
+    float *fb = new float[n * k];
+    char *A = new char[ggml_row_size(type, k) * m];
+    char *B = new char[ggml_row_size(GGML_TYPE_Q8_K, k) * n];
+    float *C = new float[m * n];
+    randomize(fa, m * k);
+    randomize(fb, n * k);
+    ggml_quantize_chunk(type, fa, A, 0, m, k, nullptr);
+    for (long j = 0; j < n; ++j)
+        quantize_row_q8_K(fb + j * k, B + j * ggml_row_size(GGML_TYPE_Q8_K, k), k);
+
+    long long tb = time_tinyblas(type, m, n, k, A, B, C);
+    long long iq = time_iqk(type, m, n, k, A, B, C);
+    printf("%s m=%ld n=%ld k=%ld %8lld us tinyblas %8lld us iqk\n", ggml_type_name(type), m, n,
+           k, tb, iq);
+
+    delete[] C;
+    delete[] B;
+    delete[] A;
+    delete[] fb;
+    delete[] fa;
+}
+
+int main(int argc, char *argv[]) {
+    for (ggml_type type : {GGML_TYPE_Q4_K, GGML_TYPE_Q5_K, GGML_TYPE_Q6_K})
+        for (long n : {128, 256, 512})
+            bench(type, 256, n, 4096);
+}
@@ -1002,6 +1002,354 @@ class tinyBLAS_Q0_AVX2 {
     const int ith;
     const int nth;
 };
+
+// multiplies Q4_0 weights that were repacked at load time into the
+// interleaved Q4_0_8_8 layout, where each block_q4_0x8 holds the same
+// block of eight consecutive rows. this lets us compute eight output
+// rows at once from contiguous memory, with one vector of scales per
+// block, rather than gathering scales and quants from eight rows.
+template <int CONFIG, typename TA, typename TB, typename TC>
+class tinyBLAS_Q4_0_8X8_AVX2 {
+  public:
+    tinyBLAS_Q4_0_8X8_AVX2(long k, const TA *A, long lda, const TB *B, long ldb, TC *C, long ldc,
+                           int ith, int nth)
+        : A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(long m, long n) {
+        mnpack(m / 8, 0, n);
+    }
+
+  private:
+    void mnpack(long groups, long n0, long n) {
+        long nc;
+#if VECTOR_REGISTERS == 32
+        switch (MIN(n - n0, 4)) {
+#else
+        switch (MIN(n - n0, 2)) {
+#endif
+        case 4:
+            nc = 4;
+            gemm<4>(groups, n0, n);
+            break;
+        case 3:
+            nc = 3;
+            gemm<3>(groups, n0, n);
+            break;
+        case 2:
+            nc = 2;
+            gemm<2>(groups, n0, n);
+            break;
+        case 1:
+            nc = 1;
+            gemm<1>(groups, n0, n);
+            break;
+        default:
+            return;
+        }
+        mnpack(groups, n0 + (n - n0) / nc * nc, n);
+    }
+
+    template <int RN>
+    NOINLINE void gemm(long groups, long n0, long n) {
+        long xtiles = (n - n0) / RN;
+        long tiles = xtiles * groups;
+        long duty = (tiles + nth - 1) / nth;
+        long start = duty * ith;
+        long end = start + duty;
+        if (end > tiles)
+            end = tiles;
+        // _mm256_hadd_epi32() leaves the row sums in this lane order
+        const __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+        for (long job = start; job < end; ++job) {
+            long ii = job / xtiles;
+            long jj = n0 + job % xtiles * RN;
+            __m256 Cv[RN] = {};
+            __m256 Ce[RN] = {};
+            for (long l = 0; l < k; ++l) {
+                const TA *a = INDEX(A, lda, ii, l);
+                __m256 ad = _mm256_permutevar8x32_ps(
+                    _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)a->d)), order);
+                __m256i sums[RN][2] = {};
+                // qs holds two steps of eight quant bytes for rows 0-3
+                // and then for rows 4-7. each byte has a low nibble for
+                // the first half of the block and a high nibble for the
+                // second half, stored in sign form (i.e. xor 0x88)
+#pragma GCC unroll 4
+                for (int c = 0; c < 4; ++c) {
+                    __m256i x = _mm256_xor_si256(
+                        _mm256_loadu_si256((const __m256i *)(a->qs + 32 * c)),
+                        _mm256_set1_epi8(0x88));
+                    __m256i lo = _mm256_sub_epi8(_mm256_and_si256(x, _mm256_set1_epi8(15)),
+                                                 _mm256_set1_epi8(8));
+                    __m256i hi = _mm256_sub_epi8(
+                        _mm256_and_si256(_mm256_srli_epi16(x, 4), _mm256_set1_epi8(15)),
+                        _mm256_set1_epi8(8));
+                    __m256i ulo = _mm256_sign_epi8(lo, lo);
+                    __m256i uhi = _mm256_sign_epi8(hi, hi);
+#pragma GCC unroll 100
+                    for (int j = 0; j < RN; ++j) {
+                        const int8_t *bq = INDEX(B, ldb, jj + j, l)->qs + 8 * (c >> 1);
+                        __m256i blo = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *)bq));
+                        __m256i bhi =
+                            _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *)(bq + 16)));
+                        sums[j][c & 1] = _mm256_add_epi32(
+                            sums[j][c & 1],
+                            _mm256_add_epi32(updot(ulo, _mm256_sign_epi8(blo, lo)),
+                                             updot(uhi, _mm256_sign_epi8(bhi, hi))));
+                    }
+                }
+#pragma GCC unroll 100
+                for (int j = 0; j < RN; ++j) {
+                    __m256 d =
+                        _mm256_mul_ps(ad, _mm256_set1_ps(unhalf(INDEX(B, ldb, jj + j, l)->d)));
+                    __m256 s = _mm256_cvtepi32_ps(_mm256_hadd_epi32(sums[j][0], sums[j][1]));
+                    if (FLAG_precise)
+                        Cv[j] = madder(d, s, Cv[j], &Ce[j]);
+                    else
+                        Cv[j] = madd(d, s, Cv[j]);
+                }
+            }
+#pragma GCC unroll 100
+            for (int j = 0; j < RN; ++j)
+                _mm256_storeu_ps(INDEX(C, ldc, jj + j, ii * 8),
+                                 _mm256_permutevar8x32_ps(Cv[j], order));
+        }
+    }
+
+    inline __m256i updot(__m256i u, __m256i s) {
+#if defined(__AVXVNNI__) || (defined(__AVX512VNNI__) && defined(__AVX512VL__))
+        return _mm256_dpbusd_epi32(_mm256_setzero_si256(), u, s);
+#else
+        return _mm256_madd_epi16(_mm256_set1_epi16(1), _mm256_maddubs_epi16(u, s));
+#endif
+    }
+
+    const TA *const A;
+    const TB *const B;
+    TC *const C;
+    const long k;
+    const long lda;
+    const long ldb;
+    const long ldc;
+    const int ith;
+    const int nth;
+};
+
+// k-quant super-block unpacked into a form that's cheap to multiply
+// with block_q8_K. quants become unsigned bytes less than 64 so they
+// can go straight into maddubs, and every scale is widened to int16
+// and repeated across the lanes that maddubs produces for its quants.
+// mins are subtracted afterwards, using the block sums of block_q8_K
+struct block_kx {
+    float d; // scale of quants
+    float dmin; // scale of mins
+    int16_t scales[QK_K / 32][16]; // per 16 quants, for each 32 quants
+    int16_t mins[QK_K / 16]; // per 16 quants
+    uint8_t qs[QK_K];
+};
+
+inline void unpack_scale_min_k4(int j, const uint8_t *q, int *d, int *m) {
+    if (j < 4) {
+        *d = q[j] & 63;
+        *m = q[j + 4] & 63;
+    } else {
+        *d = (q[j + 4] & 0xF) | ((q[j - 4] >> 6) << 4);
+        *m = (q[j + 4] >> 4) | ((q[j - 0] >> 6) << 4);
+    }
+}
+
+inline void unpack(const block_q4_K *x, block_kx *y) {
+    y->d = unhalf(x->d);
+    y->dmin = unhalf(x->dmin);
+    for (int j = 0; j < QK_K / 32; ++j) {
+        int sc, m;
+        unpack_scale_min_k4(j, x->scales, &sc, &m);
+        for (int l = 0; l < 16; ++l)
+            y->scales[j][l] = sc;
+        y->mins[2 * j + 0] = m;
+        y->mins[2 * j + 1] = m;
+    }
+    for (int j = 0; j < QK_K / 64; ++j)
+        for (int l = 0; l < 32; ++l) {
+            y->qs[64 * j + l + 0] = x->qs[32 * j + l] & 15;
+            y->qs[64 * j + l + 32] = x->qs[32 * j + l] >> 4;
+        }
+}
+
+inline void unpack(const block_q5_K *x, block_kx *y) {
+    y->d = unhalf(x->d);
+    y->dmin = unhalf(x->dmin);
+    for (int j = 0; j < QK_K / 32; ++j) {
+        int sc, m;
+        unpack_scale_min_k4(j, x->scales, &sc, &m);
+        for (int l = 0; l < 16; ++l)
+            y->scales[j][l] = sc;
+        y->mins[2 * j + 0] = m;
+        y->mins[2 * j + 1] = m;
+    }
+    for (int j = 0; j < QK_K / 64; ++j)
+        for (int l = 0; l < 32; ++l) {
+            y->qs[64 * j + l + 0] =
+                (x->qs[32 * j + l] & 15) | (((x->qh[l] >> (2 * j + 0)) & 1) << 4);
+            y->qs[64 * j + l + 32] =
+                (x->qs[32 * j + l] >> 4) | (((x->qh[l] >> (2 * j + 1)) & 1) << 4);
+        }
+}
+
+inline void unpack(const block_q6_K *x, block_kx *y) {
+    // q6_K has no mins but its quants are offset by 32, which we treat
+    // as a min of 32 * scale so the quants themselves can be unsigned
+    y->d = unhalf(x->d);
+    y->dmin = y->d;
+    for (int j = 0; j < QK_K / 16; ++j) {
+        for (int l = 0; l < 8; ++l)
+            y->scales[j / 2][8 * (j & 1) + l] = x->scales[j];
+        y->mins[j] = 32 * x->scales[j];
+    }
+    for (int j = 0; j < QK_K / 128; ++j)
+        for (int l = 0; l < 32; ++l) {
+            const uint8_t *ql = x->ql + 64 * j;
+            const uint8_t *qh = x->qh + 32 * j;
+            uint8_t *q = y->qs + 128 * j;
+            q[l + 0] = (ql[l + 0] & 15) | (((qh[l] >> 0) & 3) << 4);
+            q[l + 32] = (ql[l + 32] & 15) | (((qh[l] >> 2) & 3) << 4);
+            q[l + 64] = (ql[l + 0] >> 4) | (((qh[l] >> 4) & 3) << 4);
+            q[l + 96] = (ql[l + 32] >> 4) | (((qh[l] >> 6) & 3) << 4);
+        }
+}
+
+// multiplies k-quant weights with q8_K activations during prompt
+// processing. each panel of RM rows and KC super-blocks of A gets
+// unpacked into an L1-resident buffer, and is then reused for NC
+// columns of B, so the cost of unpacking bits doesn't get paid again
+// for each group of columns like it would with a vec_dot loop. every
+// panel of a thread is swept over the same NC columns before moving
+// on, so that slice of B stays in L2 rather than being streamed from
+// memory again for each panel
+template <int CONFIG, typename TA, typename TB, typename TC>
+class tinyBLAS_K_AVX2 {
+  public:
+    tinyBLAS_K_AVX2(long k, const TA *A, long lda, const TB *B, long ldb, TC *C, long ldc, int ith,
+                    int nth)
+        : A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(long m, long n) {
+        long panels = (m + RM - 1) / RM;
+        long duty = (panels + nth - 1) / nth;
+        long start = duty * ith;
+        long end = start + duty;
+        if (end > panels)
+            end = panels;
+        for (long l0 = 0; l0 < k; l0 += KC) {
+            long kc = MIN(k - l0, KC);
+            for (long j0 = 0; j0 < n; j0 += NC) {
+                long j1 = MIN(n, j0 + NC);
+                for (long p = start; p < end; ++p) {
+                    long ii = p * RM;
+                    long rows = MIN(m - ii, RM);
+                    for (long l = 0; l < kc; ++l)
+                        for (long i = 0; i < RM; ++i)
+                            if (i < rows) {
+                                unpack(INDEX(A, lda, ii + i, l0 + l), &panel[l][i]);
+                                d[l][i] = panel[l][i].d;
+                                dmin[l][i] = -panel[l][i].dmin;
+                            } else {
+                                panel[l][i] = {};
+                                d[l][i] = 0;
+                                dmin[l][i] = 0;
+                            }
+                    long jj = j0;
+                    for (; jj + RN <= j1; jj += RN)
+                        gemm<RN>(ii, jj, l0, kc, rows);
+                    for (; jj < j1; ++jj)
+                        gemm<1>(ii, jj, l0, kc, rows);
+                }
+            }
+        }
+    }
+
+  private:
+    static constexpr int RM = 4;
+#if VECTOR_REGISTERS == 32
+    static constexpr int RN = 4;
+#else
+    static constexpr int RN = 2;
+#endif
+    static constexpr int KC = 8;
+    static constexpr int NC = 256;
+
+    template <int RN2>
+    NOINLINE void gemm(long ii, long jj, long l0, long kc, long rows) {
+        __m256 Cv[RN2] = {};
+        for (long l = 0; l < kc; ++l) {
+            __m256i Iv[RN2][RM] = {};
+#pragma GCC unroll 8
+            for (int c = 0; c < QK_K / 32; ++c) {
+                __m256i a[RM];
+#pragma GCC unroll 100
+                for (int i = 0; i < RM; ++i)
+                    a[i] = _mm256_loadu_si256((const __m256i *)(panel[l][i].qs + 32 * c));
+#pragma GCC unroll 100
+                for (int j = 0; j < RN2; ++j) {
+                    __m256i b = _mm256_loadu_si256(
+                        (const __m256i *)(INDEX(B, ldb, jj + j, l0 + l)->qs + 32 * c));
+#pragma GCC unroll 100
+                    for (int i = 0; i < RM; ++i)
+                        Iv[j][i] = _mm256_add_epi32(
+                            Iv[j][i],
+                            _mm256_madd_epi16(_mm256_maddubs_epi16(a[i], b),
+                                              _mm256_loadu_si256(
+                                                  (const __m256i *)panel[l][i].scales[c])));
+                }
+            }
+            // each of the RM rows gets its own lane in both halves
+            __m256 dv = _mm256_broadcast_ps((const __m128 *)d[l]);
+            __m256 mv = _mm256_broadcast_ps((const __m128 *)dmin[l]);
+#pragma GCC unroll 100
+            for (int j = 0; j < RN2; ++j) {
+                const TB *b = INDEX(B, ldb, jj + j, l0 + l);
+                __m256i bsums = _mm256_loadu_si256((const __m256i *)b->bsums);
+                __m256i Mv[RM];
+#pragma GCC unroll 100
+                for (int i = 0; i < RM; ++i)
+                    Mv[i] = _mm256_madd_epi16(
+                        _mm256_loadu_si256((const __m256i *)panel[l][i].mins), bsums);
+                __m256 db = _mm256_set1_ps(b->d);
+                Cv[j] = madd(_mm256_mul_ps(dv, db), _mm256_cvtepi32_ps(reduce(Iv[j])), Cv[j]);
+                Cv[j] = madd(_mm256_mul_ps(mv, db), _mm256_cvtepi32_ps(reduce(Mv)), Cv[j]);
+            }
+        }
+#pragma GCC unroll 100
+        for (int j = 0; j < RN2; ++j) {
+            float out[RM];
+            _mm_storeu_ps(out, _mm_add_ps(_mm256_castps256_ps128(Cv[j]),
+                                          _mm256_extractf128_ps(Cv[j], 1)));
+            for (long i = 0; i < rows; ++i) {
+                TC *c = INDEX(C, ldc, jj + j, ii + i);
+                *c = l0 ? *c + out[i] : out[i];
+            }
+        }
+    }
+
+    static inline __m256i reduce(const __m256i x[RM]) {
+        return _mm256_hadd_epi32(_mm256_hadd_epi32(x[0], x[1]), _mm256_hadd_epi32(x[2], x[3]));
+    }
+
+    block_kx panel[KC][RM];
+    alignas(16) float d[KC][RM];
+    alignas(16) float dmin[KC][RM]; // negated
+    const TA *const A;
+    const TB *const B;
+    TC *const C;
+    const long k;
+    const long lda;
+    const long ldb;
+    const long ldc;
+    const int ith;
+    const int nth;
+};
 #endif // __AVX2__
 
 } // namespace